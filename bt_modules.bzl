@@ -102,6 +102,9 @@ register_bt_modules(
 	"btfm_codec_hw_interface.c",
 	"btfm_codec_interface.c",
 	],
+   config_srcs = {
+        "CONFIG_BTFM_CODEC_KUNIT_TEST": ["btfm_codec_test.c"],
+   },
    deps = [":btfmcodec_headers"],
 )
 
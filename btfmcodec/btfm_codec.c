@@ -12,9 +12,16 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "btfm_codec.h"
 #include "btfm_codec_pkt.h"
 
+#define CREATE_TRACE_POINTS
+#include "btfm_codec_trace.h"
+
 #define dev_to_btfmcodec(_dev) container_of(_dev, struct btfmcodec_data, dev)
 
 static DEFINE_IDR(dev_minor);
@@ -28,6 +35,8 @@ bool is_cp_supported = true;
 #define cdev_to_btfmchardev(_cdev) container_of(_cdev, struct btfmcodec_char_device, cdev)
 #define MIN_PKT_LEN  0x9
 
+static void btfmcodec_txn_abort_all(struct btfmcodec_char_device *btfmcodec_dev);
+
 char *coverttostring(enum btfmcodec_states state) {
 	switch (state) {
 	case IDLE:
@@ -51,6 +60,243 @@ char *coverttostring(enum btfmcodec_states state) {
 	}
 }
 
+static struct btfmcodec_pkt *btfmcodec_pkt_alloc(struct btfmcodec_char_device *btfmcodec_dev,
+						 gfp_t gfp)
+{
+	struct btfmcodec_pkt *pkt = mempool_alloc(btfmcodec_dev->pkt_pool, gfp);
+
+	if (pkt)
+		pkt->len = 0;
+	return pkt;
+}
+
+static void btfmcodec_pkt_free(struct btfmcodec_char_device *btfmcodec_dev,
+			       struct btfmcodec_pkt *pkt)
+{
+	mempool_free(pkt, btfmcodec_dev->pkt_pool);
+}
+
+static void btfmcodec_pkt_free_list(struct btfmcodec_char_device *btfmcodec_dev,
+				    struct list_head *head)
+{
+	struct btfmcodec_pkt *pkt, *tmp;
+
+	list_for_each_entry_safe(pkt, tmp, head, list) {
+		list_del(&pkt->list);
+		btfmcodec_pkt_free(btfmcodec_dev, pkt);
+	}
+}
+
+static void btfmcodec_observer_put(struct btfmcodec_observer *obs,
+				   const void *data, uint32_t len)
+{
+	uint32_t off = obs->head & (BTM_OBSERVER_BUF_SIZE - 1);
+	uint32_t chunk = min_t(uint32_t, len, BTM_OBSERVER_BUF_SIZE - off);
+
+	memcpy(obs->buf + off, data, chunk);
+	memcpy(obs->buf, (const uint8_t *)data + chunk, len - chunk);
+	obs->head += len;
+}
+
+/*
+ * btfmcodec_observer_copy() - hand a copy of a packet to the observers
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * dir:			BTM_OBSERVER_TX or BTM_OBSERVER_RX.
+ * opcode:		packet opcode.
+ * data:		packet payload.
+ * len:			payload length.
+ *
+ * Can be called from atomic context, a full observer loses the packet.
+ */
+static void btfmcodec_observer_copy(struct btfmcodec_char_device *btfmcodec_dev,
+				    uint8_t dir, btm_opcode opcode,
+				    const uint8_t *data, uint32_t len)
+{
+	struct btfmcodec_observer *obs;
+	struct btm_observer_hdr hdr;
+	uint32_t pkt_hdr[2] = { opcode, len };
+	uint32_t size = sizeof(hdr) + BTM_HEADER_LEN + len;
+	unsigned long flags;
+
+	if (list_empty(&btfmcodec_dev->observers))
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.timestamp_ns = ktime_get_ns();
+	hdr.dir = dir;
+	hdr.len = BTM_HEADER_LEN + len;
+
+	spin_lock_irqsave(&btfmcodec_dev->observers_lock, flags);
+	list_for_each_entry(obs, &btfmcodec_dev->observers, list) {
+		spin_lock(&obs->lock);
+		if (BTM_OBSERVER_BUF_SIZE - (obs->head - obs->tail) < size) {
+			obs->dropped++;
+		} else {
+			hdr.dropped = obs->dropped;
+			obs->dropped = 0;
+			btfmcodec_observer_put(obs, &hdr, sizeof(hdr));
+			btfmcodec_observer_put(obs, pkt_hdr, BTM_HEADER_LEN);
+			btfmcodec_observer_put(obs, data, len);
+		}
+		spin_unlock(&obs->lock);
+		wake_up_interruptible(&obs->readq);
+	}
+	spin_unlock_irqrestore(&btfmcodec_dev->observers_lock, flags);
+}
+
+static uint32_t btfmcodec_observer_rec_len(struct btfmcodec_observer *obs,
+					   uint32_t pos)
+{
+	struct btm_observer_hdr hdr;
+	uint32_t off = pos & (BTM_OBSERVER_BUF_SIZE - 1);
+	uint32_t chunk = min_t(uint32_t, sizeof(hdr), BTM_OBSERVER_BUF_SIZE - off);
+
+	memcpy(&hdr, obs->buf + off, chunk);
+	memcpy((uint8_t *)&hdr + chunk, obs->buf, sizeof(hdr) - chunk);
+	return sizeof(hdr) + hdr.len;
+}
+
+static bool btfmcodec_observer_empty(struct btfmcodec_observer *obs)
+{
+	unsigned long flags;
+	bool empty;
+
+	spin_lock_irqsave(&obs->lock, flags);
+	empty = obs->head == obs->tail;
+	spin_unlock_irqrestore(&obs->lock, flags);
+	return empty;
+}
+
+/*
+ * btfmcodec_observer_read() - read() syscall for observers
+ * file:	Pointer to the file structure.
+ * buf:		Pointer to the userspace buffer.
+ * count:	Number bytes to read from the file.
+ * ppos:	Pointer to the position into the file.
+ *
+ * Returns as many whole records (struct btm_observer_hdr followed by the
+ * packet) as fit in the userspace buffer.
+ */
+static ssize_t btfmcodec_observer_read(struct file *file, char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct btfmcodec_observer *obs = file->private_data;
+	uint8_t *kbuf;
+	unsigned long flags;
+	uint32_t tail, rec, off, chunk;
+	size_t total = 0;
+	ssize_t ret;
+
+	while (btfmcodec_observer_empty(obs)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(obs->readq,
+					     !btfmcodec_observer_empty(obs)))
+			return -ERESTARTSYS;
+	}
+
+	count = min_t(size_t, count, BTM_OBSERVER_BUF_SIZE);
+	kbuf = kmalloc(count, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&obs->lock, flags);
+	tail = obs->tail;
+	while (tail != obs->head) {
+		rec = btfmcodec_observer_rec_len(obs, tail);
+		if (total + rec > count)
+			break;
+		off = tail & (BTM_OBSERVER_BUF_SIZE - 1);
+		chunk = min_t(uint32_t, rec, BTM_OBSERVER_BUF_SIZE - off);
+		memcpy(kbuf + total, obs->buf + off, chunk);
+		memcpy(kbuf + total + chunk, obs->buf, rec - chunk);
+		total += rec;
+		tail += rec;
+	}
+	obs->tail = tail;
+	spin_unlock_irqrestore(&obs->lock, flags);
+
+	if (!total)
+		ret = -EMSGSIZE;
+	else if (copy_to_user(buf, kbuf, total))
+		ret = -EFAULT;
+	else
+		ret = total;
+
+	kfree(kbuf);
+	return ret;
+}
+
+static __poll_t btfmcodec_observer_poll(struct file *file, poll_table *wait)
+{
+	struct btfmcodec_observer *obs = file->private_data;
+
+	poll_wait(file, &obs->readq, wait);
+	return btfmcodec_observer_empty(obs) ? 0 : POLLIN | POLLRDNORM;
+}
+
+static int btfmcodec_observer_release(struct inode *inode, struct file *file)
+{
+	struct btfmcodec_observer *obs = file->private_data;
+	struct btfmcodec_char_device *btfmcodec_dev = obs->btfmcodec_dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&btfmcodec_dev->observers_lock, flags);
+	list_del(&obs->list);
+	btfmcodec_dev->num_observers--;
+	spin_unlock_irqrestore(&btfmcodec_dev->observers_lock, flags);
+	kfree(obs);
+	return 0;
+}
+
+static const struct file_operations btfmcodec_observer_fops = {
+	.owner = THIS_MODULE,
+	.release = btfmcodec_observer_release,
+	.poll = btfmcodec_observer_poll,
+	.read = btfmcodec_observer_read,
+	.llseek = noop_llseek,
+};
+
+/*
+ * btfmcodec_observer_open() - attach a read-only observer
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * file:		Pointer to the file structure.
+ *
+ * Observers don't count as active clients and can't write, so they never
+ * interfere with the BTADV audio manager.
+ */
+static int btfmcodec_observer_open(struct btfmcodec_char_device *btfmcodec_dev,
+				   struct file *file)
+{
+	struct btfmcodec_observer *obs;
+	unsigned long flags;
+
+	obs = kzalloc(sizeof(*obs), GFP_KERNEL);
+	if (!obs)
+		return -ENOMEM;
+
+	obs->btfmcodec_dev = btfmcodec_dev;
+	spin_lock_init(&obs->lock);
+	init_waitqueue_head(&obs->readq);
+
+	spin_lock_irqsave(&btfmcodec_dev->observers_lock, flags);
+	if (btfmcodec_dev->num_observers == BTM_MAX_OBSERVERS) {
+		spin_unlock_irqrestore(&btfmcodec_dev->observers_lock, flags);
+		BTFMCODEC_WARN("too many observers on %s", btfmcodec_dev->dev_name);
+		kfree(obs);
+		return -EBUSY;
+	}
+	btfmcodec_dev->num_observers++;
+	list_add_tail(&obs->list, &btfmcodec_dev->observers);
+	spin_unlock_irqrestore(&btfmcodec_dev->observers_lock, flags);
+
+	BTFMCODEC_INFO("observer %s:%d attached to %s", current->comm,
+		       task_pid_nr(current), btfmcodec_dev->dev_name);
+	file->private_data = obs;
+	replace_fops(file, &btfmcodec_observer_fops);
+	return 0;
+}
+
 /*
  * btfmcodec_dev_open() - open() syscall for the btfmcodec dev node
  * inode:	Pointer to the inode structure.
@@ -67,8 +313,11 @@ static int btfmcodec_dev_open(struct inode *inode, struct file *file)
 	struct btfmcodec_data *btfmcodec = (struct btfmcodec_data *)btfmcodec_dev->btfmcodec;
 	unsigned int active_clients = refcount_read(&btfmcodec_dev->active_clients);
 
-	btfmcodec->states.current_state = IDLE; /* Just a temp*/
-	btfmcodec->states.next_state = IDLE;
+	/* Read-only opens observe the traffic of the primary client */
+	if (!(file->f_mode & FMODE_WRITE))
+		return btfmcodec_observer_open(btfmcodec_dev, file);
+
+	btfmcodec_reset_state(&btfmcodec->states); /* Just a temp*/
 	BTFMCODEC_INFO("for %s by %s:%d active_clients[%d]\n",
 		       btfmcodec_dev->dev_name, current->comm,
 		       task_pid_nr(current), refcount_read(&btfmcodec_dev->active_clients));
@@ -95,6 +344,7 @@ static int btfmcodec_dev_open(struct inode *inode, struct file *file)
 static int btfmcodec_dev_release(struct inode *inode, struct file *file)
 {
 	struct btfmcodec_char_device *btfmcodec_dev = cdev_to_btfmchardev(inode->i_cdev);
+	LIST_HEAD(purge);
 	unsigned long flags;
 	int idx;
 
@@ -105,12 +355,14 @@ static int btfmcodec_dev_release(struct inode *inode, struct file *file)
 	refcount_dec(&btfmcodec_dev->active_clients);
 	if (refcount_read(&btfmcodec_dev->active_clients) == 1) {
 		spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
-		skb_queue_purge(&btfmcodec_dev->txq);
+		list_splice_init(&btfmcodec_dev->txq, &purge);
 		/* Wakeup the device if waiting for the data */
 		wake_up_interruptible(&btfmcodec_dev->readq);
 		spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
-		/* we need to have separte rx lock for below buff */
-		skb_queue_purge(&btfmcodec_dev->rxq);
+		spin_lock_irqsave(&btfmcodec_dev->rx_queue_lock, flags);
+		list_splice_init(&btfmcodec_dev->rxq, &purge);
+		spin_unlock_irqrestore(&btfmcodec_dev->rx_queue_lock, flags);
+		btfmcodec_pkt_free_list(btfmcodec_dev, &purge);
 	}
 
 	/* Notify waiting clients that client is closed or killed */
@@ -118,146 +370,840 @@ static int btfmcodec_dev_release(struct inode *inode, struct file *file)
 		btfmcodec_dev->status[idx] = BTM_RSP_NOT_RECV_CLIENT_KILLED;
 		wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[idx]);
 	}
+	btfmcodec_txn_abort_all(btfmcodec_dev);
 
 	if (btfmcodec_dev->wq_hwep_shutdown.func)
 		cancel_work_sync(&btfmcodec_dev->wq_hwep_shutdown);
 	if (btfmcodec_dev->wq_hwep_configure.func)
 		cancel_work_sync(&btfmcodec_dev->wq_hwep_configure);
-	if (btfmcodec_dev->wq_prepare_bearer.func)
-		cancel_work_sync(&btfmcodec_dev->wq_prepare_bearer);
+	if (btfmcodec_dev->wq_ssr_recovery.func)
+		cancel_work_sync(&btfmcodec_dev->wq_ssr_recovery);
+	if (btfmcodec_dev->wq_prepare_bearer.work.func)
+		cancel_delayed_work_sync(&btfmcodec_dev->wq_prepare_bearer);
+	atomic_set(&btfmcodec_dev->switch_merged, 0);
+	btfmcodec_switch_ind_reset(btfmcodec_dev);
+
+	btfmcodec_dev->batch_mode = false;
+	btfmcodec->deferred_start = false;
+	/* mmap holds a reference on the file, so no mapping is alive here */
+	if (btfmcodec_dev->ring_buf) {
+		spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
+		WRITE_ONCE(btfmcodec_dev->ring_mapped, false);
+		spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
+		flush_work(&btfmcodec_dev->rx_work);
+		vfree(btfmcodec_dev->ring_buf);
+		btfmcodec_dev->ring_buf = NULL;
+	}
 
-	btfmcodec->states.current_state = IDLE;
-	btfmcodec->states.next_state = IDLE;
+	btfmcodec_reset_state(&btfmcodec->states);
 	return 0;
 }
 
-btm_opcode STREAM_TO_UINT32 (struct sk_buff *skb)
+static inline uint32_t btfmcodec_buf_to_uint32(const uint8_t *buf)
 {
-	return (skb->data[0] | (skb->data[1] << 8) |
-		(skb->data[2] << 16) | (skb->data[3] << 24));
+	return (buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24));
 }
 
-static void btfmcodec_dev_rxwork(struct work_struct *work)
+static const uint32_t btm_lat_bounds_us[BTM_LAT_BUCKETS - 1] = {
+	100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000,
+};
+
+static const char * const btm_lat_op_name[BTM_LAT_OP_MAX] = {
+	"master_config", "dma_config", "shutdown", "bearer_ind",
+};
+
+static const char * const btm_lat_stage_name[BTM_LAT_STAGE_MAX] = {
+	"queue", "client", "rtt",
+};
+
+void btfmcodec_lat_record(struct btfmcodec_lat_hist *hist, ktime_t start)
 {
-	struct btfmcodec_char_device *btfmcodec_dev = container_of(work, struct btfmcodec_char_device, rx_work);
-	struct sk_buff *skb;
-	uint32_t len;
-	uint8_t status;
-	int idx;
-	uint8_t *bearer_switch_ind;
+	s64 us = max_t(s64, ktime_us_delta(ktime_get(), start), 0);
+	s64 max, old;
+	int i;
 
-	BTFMCODEC_DBG("start");
-	while ((skb = skb_dequeue(&btfmcodec_dev->rxq))) {
-		btm_opcode opcode = STREAM_TO_UINT32(skb);
-		skb_pull(skb, sizeof(btm_opcode));
-		len = STREAM_TO_UINT32(skb);
-		skb_pull(skb, sizeof(len));
-		switch (opcode) {
-		case BTM_BTFMCODEC_PREPARE_AUDIO_BEARER_SWITCH_REQ:
-			idx = BTM_PKT_TYPE_PREPARE_REQ;
-			BTFMCODEC_DBG("BTM_BTFMCODEC_PREPARE_AUDIO_BEARER_SWITCH_REQ");
-			if (len == BTM_PREPARE_AUDIO_BEARER_SWITCH_REQ_LEN) {
-				/* there are chances where bearer indication is not recevied,
-				 * So inform waiting thread to unblock itself and move to
-				 * previous state.
-				 */
-				if (btfmcodec_dev->status[BTM_PKT_TYPE_BEARER_SWITCH_IND] == BTM_WAITING_RSP) {
-				  BTFMCODEC_DBG("Notifying waiting beare indications");
-				  btfmcodec_dev->status[BTM_PKT_TYPE_BEARER_SWITCH_IND] = BTM_FAIL_RESP_RECV;
-				  wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[BTM_PKT_TYPE_BEARER_SWITCH_IND]);
-				}
-				btfmcodec_dev->status[idx] = skb->data[0];
-				/* Reset bearer switch ind flag */
-				bearer_switch_ind =
-					&btfmcodec_dev->status[BTM_PKT_TYPE_BEARER_SWITCH_IND];
-				*bearer_switch_ind = BTM_WAITING_RSP;
-				queue_work(btfmcodec_dev->workqueue, &btfmcodec_dev->wq_prepare_bearer);
-			} else {
-				BTFMCODEC_ERR("wrong packet format with len:%d", len);
-			}
-			break;
-		case BTM_BTFMCODEC_MASTER_CONFIG_RSP:
-			idx = BTM_PKT_TYPE_MASTER_CONFIG_RSP;
-			if (len == BTM_MASTER_CONFIG_RSP_LEN) {
-				status = skb->data[1];
-				if (status == MSG_SUCCESS)
-				  btfmcodec_dev->status[idx] = BTM_RSP_RECV;
-				else
-				  btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
-			} else {
-				BTFMCODEC_ERR("wrong packet format with len:%d", len);
-				btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
-			}
-			BTFMCODEC_INFO("Rx BTM_BTFMCODEC_MASTER_CONFIG_RSP status:%d",
-				status);
-			wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[idx]);
+	for (i = 0; i < BTM_LAT_BUCKETS - 1; i++) {
+		if (us < btm_lat_bounds_us[i])
 			break;
-		case BTM_BTFMCODEC_CODEC_CONFIG_DMA_RSP:
-			idx = BTM_PKT_TYPE_DMA_CONFIG_RSP;
-			if (len == BTM_CODEC_CONFIG_DMA_RSP_LEN) {
-				status = skb->data[1];
-				if (status == MSG_SUCCESS)
-					btfmcodec_dev->status[idx] = BTM_RSP_RECV;
-				else
-					btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
-			} else {
-				BTFMCODEC_ERR("wrong packet format with len:%d", len);
-				btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
-			}
-			BTFMCODEC_INFO("Rx BTM_BTFMCODEC_CODEC_CONFIG_DMA_RSP status:%d",
-				status);
-			wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[idx]);
+	}
+
+	atomic_inc(&hist->bucket[i]);
+	atomic_inc(&hist->count);
+	atomic64_add(us, &hist->sum_us);
+	max = atomic64_read(&hist->max_us);
+	while (us > max) {
+		old = atomic64_cmpxchg(&hist->max_us, max, us);
+		if (old == max)
 			break;
-		case BTM_BTFMCODEC_CTRL_MASTER_SHUTDOWN_RSP:
-			idx = BTM_PKT_TYPE_MASTER_SHUTDOWN_RSP;
-			if (len == BTM_MASTER_CONFIG_RSP_LEN) {
-				status = skb->data[1];
-				if (status == MSG_SUCCESS)
-				  btfmcodec_dev->status[idx] = BTM_RSP_RECV;
-				else
-				  btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
-			} else {
-				BTFMCODEC_ERR("wrong packet format with len:%d", len);
-				btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
-			}
-			BTFMCODEC_INFO("Rx BTM_BTFMCODEC_CTRL_MASTER_SHUTDOWN_RSP status:%d",
-				status);
-			wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[idx]);
-			BTFMCODEC_INFO("%s: waiting to cancel prepare bearer wq", __func__);
-			cancel_work_sync(&btfmcodec_dev->wq_prepare_bearer);
-			BTFMCODEC_INFO("%s: prepare bearer wq canceled", __func__);
+		max = old;
+	}
+}
+
+static int btfmcodec_lat_op(btm_opcode rsp_opcode)
+{
+	switch (rsp_opcode) {
+	case BTM_BTFMCODEC_MASTER_CONFIG_RSP:
+		return BTM_LAT_OP_MASTER_CONFIG;
+	case BTM_BTFMCODEC_CODEC_CONFIG_DMA_RSP:
+		return BTM_LAT_OP_DMA_CONFIG;
+	case BTM_BTFMCODEC_CTRL_MASTER_SHUTDOWN_RSP:
+		return BTM_LAT_OP_SHUTDOWN;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * btfmcodec_txn_start() - reserve a slot for a request waiting on response
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * rsp_opcode:		opcode of the expected response.
+ * stream_id:		stream id sent to BTADV audio manager.
+ * id:			stream index the request is for.
+ *
+ * Returns NULL if the transaction table is full or if a request for the
+ * same response and stream id is already in flight. Responses only echo
+ * stream_id, so hw eps sharing a DAI id can't have requests for it in
+ * flight together.
+ */
+struct btfmcodec_txn *btfmcodec_txn_start(struct btfmcodec_char_device *btfmcodec_dev,
+					  btm_opcode rsp_opcode, uint8_t stream_id,
+					  uint8_t id)
+{
+	struct btfmcodec_txn *txn = NULL, *tmp;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&btfmcodec_dev->txn_lock, flags);
+	for (i = 0; i < BTM_MAX_TXN; i++) {
+		tmp = &btfmcodec_dev->txn[i];
+		if (!tmp->in_use) {
+			if (!txn)
+				txn = tmp;
+		} else if (tmp->rsp_opcode == rsp_opcode &&
+			   tmp->stream_id == stream_id) {
+			BTFMCODEC_ERR("rsp %08x for stream %d already pending seq:%u",
+				      rsp_opcode, stream_id, tmp->seq);
+			spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+			return NULL;
+		}
+	}
+
+	if (txn) {
+		txn->in_use = true;
+		txn->seq = ++btfmcodec_dev->txn_seq;
+		txn->rsp_opcode = rsp_opcode;
+		txn->stream_id = stream_id;
+		txn->id = id;
+		txn->status = BTM_WAITING_RSP;
+		txn->t_start = ktime_get();
+		txn->t_read = 0;
+		txn->complete = NULL;
+	} else {
+		BTFMCODEC_ERR("no free transaction slot for rsp %08x", rsp_opcode);
+	}
+	spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+	return txn;
+}
+
+void btfmcodec_txn_release(struct btfmcodec_char_device *btfmcodec_dev,
+			   struct btfmcodec_txn *txn)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&btfmcodec_dev->txn_lock, flags);
+	txn->in_use = false;
+	spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+}
+
+/* Time spent so far in each state, including the current one */
+static void btfmcodec_state_time(struct btfmcodec_state_machine *states, s64 *us)
+{
+	int state;
+
+	for (state = IDLE; state <= BTADV_AUDIO_Connected; state++)
+		us[state] = atomic64_read(&states->dwell[state].sum_us);
+	state = BTM_STATE_CUR(atomic_read(&states->state_word));
+	us[state] += div_s64(ktime_get_ns() - atomic64_read(&states->entered_ns),
+			     NSEC_PER_USEC);
+}
+
+void btfmcodec_stats_open(struct btfmcodec_data *btfmcodec, int id,
+			  uint32_t sample_rate, uint8_t codectype, uint8_t bit_width)
+{
+	struct btfmcodec_dai_stats *st;
+	unsigned long flags;
+
+	if (id < 0 || id >= BTM_MAX_STREAMS)
+		return;
+
+	st = &btfmcodec->dai_stats[id];
+	spin_lock_irqsave(&btfmcodec->stats_lock, flags);
+	st->stats.prepare_cnt++;
+	st->stats.sample_rate = sample_rate;
+	st->stats.codectype = codectype;
+	st->stats.bit_width = bit_width;
+	if (!st->open) {
+		btfmcodec_state_time(&btfmcodec->states, st->state_base_us);
+		st->open = true;
+	}
+	spin_unlock_irqrestore(&btfmcodec->stats_lock, flags);
+}
+
+void btfmcodec_stats_close(struct btfmcodec_data *btfmcodec, int id)
+{
+	struct btfmcodec_dai_stats *st;
+	s64 now[BTADV_AUDIO_Connected + 1];
+	unsigned long flags;
+	int state;
+
+	if (id < 0 || id >= BTM_MAX_STREAMS)
+		return;
+
+	st = &btfmcodec->dai_stats[id];
+	btfmcodec_state_time(&btfmcodec->states, now);
+	spin_lock_irqsave(&btfmcodec->stats_lock, flags);
+	st->stats.shutdown_cnt++;
+	if (st->open) {
+		for (state = IDLE; state <= BTADV_AUDIO_Connected; state++)
+			st->stats.state_time_us[state] += now[state] -
+							  st->state_base_us[state];
+		st->open = false;
+	}
+	spin_unlock_irqrestore(&btfmcodec->stats_lock, flags);
+}
+
+static void btfmcodec_stats_config_rsp(struct btfmcodec_char_device *btfmcodec_dev,
+				       uint8_t id, ktime_t start)
+{
+	struct btfmcodec_data *btfmcodec = btfmcodec_dev->btfmcodec;
+	struct btm_dai_stats *st;
+	uint32_t us = max_t(s64, ktime_us_delta(ktime_get(), start), 0);
+	unsigned long flags;
+
+	if (id >= BTM_MAX_STREAMS)
+		return;
+
+	st = &btfmcodec->dai_stats[id].stats;
+	spin_lock_irqsave(&btfmcodec->stats_lock, flags);
+	if (!st->config_cnt || us < st->config_rtt_min_us)
+		st->config_rtt_min_us = us;
+	st->config_rtt_max_us = max(st->config_rtt_max_us, us);
+	st->config_rtt_sum_us += us;
+	st->config_cnt++;
+	spin_unlock_irqrestore(&btfmcodec->stats_lock, flags);
+}
+
+static void btfmcodec_stats_timeout(struct btfmcodec_char_device *btfmcodec_dev,
+				    uint8_t id)
+{
+	struct btfmcodec_data *btfmcodec = btfmcodec_dev->btfmcodec;
+	unsigned long flags;
+
+	if (id >= BTM_MAX_STREAMS)
+		return;
+
+	spin_lock_irqsave(&btfmcodec->stats_lock, flags);
+	btfmcodec->dai_stats[id].stats.timeout_cnt++;
+	spin_unlock_irqrestore(&btfmcodec->stats_lock, flags);
+}
+
+/* Consistent copy of all stream stats, counting time of open streams */
+static void btfmcodec_stats_read(struct btfmcodec_data *btfmcodec,
+				 struct btm_dai_stats *out)
+{
+	struct btfmcodec_dai_stats *st;
+	s64 now[BTADV_AUDIO_Connected + 1];
+	unsigned long flags;
+	int id, state;
+
+	btfmcodec_state_time(&btfmcodec->states, now);
+	spin_lock_irqsave(&btfmcodec->stats_lock, flags);
+	for (id = 0; id < BTM_MAX_STREAMS; id++) {
+		st = &btfmcodec->dai_stats[id];
+		out[id] = st->stats;
+		if (!st->open)
+			continue;
+		for (state = IDLE; state <= BTADV_AUDIO_Connected; state++)
+			out[id].state_time_us[state] += now[state] -
+							st->state_base_us[state];
+	}
+	spin_unlock_irqrestore(&btfmcodec->stats_lock, flags);
+}
+
+/* Result of a transaction as reported to its waiter */
+static int btfmcodec_txn_result(struct btfmcodec_txn *txn)
+{
+	if (txn->status == BTM_RSP_RECV)
+		return 0;
+	else if (txn->status != BTM_WAITING_RSP)
+		return -1;
+	return -ETIMEDOUT;
+}
+
+struct btfmcodec_txn_done {
+	btfmcodec_txn_cb complete;
+	void *priv;
+	uint8_t id;
+	int ret;
+};
+
+/* Caller holds txn_lock. Frees the slot of an async transaction and keeps
+ * what is needed to run its callback once the lock is dropped.
+ */
+static void btfmcodec_txn_detach(struct btfmcodec_txn *txn,
+				 struct btfmcodec_txn_done *done)
+{
+	done->complete = txn->complete;
+	done->priv = txn->priv;
+	done->id = txn->id;
+	done->ret = btfmcodec_txn_result(txn);
+	txn->complete = NULL;
+	txn->in_use = false;
+}
+
+static void btfmcodec_txn_run_done(struct btfmcodec_txn_done *done, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		done[i].complete(done[i].priv, done[i].id, done[i].ret);
+}
+
+/* Caller holds txn_lock. Schedules the timeout worker for the earliest
+ * deadline of the pending async transactions.
+ */
+static void btfmcodec_txn_arm_timeout(struct btfmcodec_char_device *btfmcodec_dev)
+{
+	struct btfmcodec_txn *txn;
+	unsigned long next = 0;
+	bool pending = false;
+	int i;
+
+	for (i = 0; i < BTM_MAX_TXN; i++) {
+		txn = &btfmcodec_dev->txn[i];
+		if (!txn->in_use || !txn->complete)
+			continue;
+		if (!pending || time_before(txn->deadline, next))
+			next = txn->deadline;
+		pending = true;
+	}
+
+	if (pending)
+		mod_delayed_work(system_wq, &btfmcodec_dev->txn_timeout_work,
+				 time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+static void btfmcodec_txn_timeout(struct work_struct *work)
+{
+	struct btfmcodec_char_device *btfmcodec_dev = container_of(to_delayed_work(work),
+						struct btfmcodec_char_device,
+						txn_timeout_work);
+	struct btfmcodec_txn_done done[BTM_MAX_TXN];
+	struct btfmcodec_txn *txn;
+	unsigned long flags;
+	int i, count = 0;
+
+	spin_lock_irqsave(&btfmcodec_dev->txn_lock, flags);
+	for (i = 0; i < BTM_MAX_TXN; i++) {
+		txn = &btfmcodec_dev->txn[i];
+		if (!txn->in_use || !txn->complete ||
+		    time_before(jiffies, txn->deadline))
+			continue;
+		BTFMCODEC_ERR("no rsp %08x for stream %d seq:%u", txn->rsp_opcode,
+			      txn->stream_id, txn->seq);
+		btfmcodec_stats_timeout(btfmcodec_dev, txn->id);
+		btfmcodec_txn_detach(txn, &done[count++]);
+	}
+	btfmcodec_txn_arm_timeout(btfmcodec_dev);
+	spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+
+	btfmcodec_txn_run_done(done, count);
+}
+
+/*
+ * btfmcodec_txn_wait_async() - complete a transaction through a callback
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * txn:			transaction returned by btfmcodec_txn_start().
+ * timeout_ms:		maximum time to wait for the response.
+ * complete:		called once with the result btfmcodec_txn_wait() would
+ *			return.
+ * priv:		passed back to complete.
+ *
+ * Returns right away. complete runs from the rx worker, the timeout worker
+ * or release of the client after the slot is freed, so it must not wait
+ * for another response.
+ */
+void btfmcodec_txn_wait_async(struct btfmcodec_char_device *btfmcodec_dev,
+			      struct btfmcodec_txn *txn, unsigned int timeout_ms,
+			      btfmcodec_txn_cb complete, void *priv)
+{
+	struct btfmcodec_txn_done done;
+	unsigned long flags;
+	int count = 0;
+
+	spin_lock_irqsave(&btfmcodec_dev->txn_lock, flags);
+	txn->complete = complete;
+	txn->priv = priv;
+	if (txn->status != BTM_WAITING_RSP) {
+		/* Response arrived before the callback was set */
+		btfmcodec_txn_detach(txn, &done);
+		count = 1;
+	} else {
+		txn->deadline = jiffies + msecs_to_jiffies(timeout_ms);
+		btfmcodec_txn_arm_timeout(btfmcodec_dev);
+	}
+	spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+
+	btfmcodec_txn_run_done(&done, count);
+}
+
+/*
+ * btfmcodec_txn_wait() - wait for the response of a transaction
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * txn:			transaction returned by btfmcodec_txn_start().
+ * timeout_ms:		maximum time to wait for the response.
+ *
+ * The transaction slot is released before returning. Returns 0 on a
+ * successful response, -ETIMEDOUT when no response arrived, -ERESTARTSYS
+ * when interrupted and -1 for failure responses or a killed client.
+ */
+int btfmcodec_txn_wait(struct btfmcodec_char_device *btfmcodec_dev,
+		       struct btfmcodec_txn *txn, unsigned int timeout_ms)
+{
+	unsigned long flags;
+	int ret;
+
+	ret = wait_event_interruptible_timeout(btfmcodec_dev->txn_wait_q,
+		READ_ONCE(txn->status) != BTM_WAITING_RSP,
+		msecs_to_jiffies(timeout_ms));
+
+	spin_lock_irqsave(&btfmcodec_dev->txn_lock, flags);
+	if (txn->status != BTM_WAITING_RSP) {
+		ret = btfmcodec_txn_result(txn);
+	} else if (ret == 0) {
+		BTFMCODEC_ERR("no rsp %08x for stream %d seq:%u", txn->rsp_opcode,
+			      txn->stream_id, txn->seq);
+		btfmcodec_stats_timeout(btfmcodec_dev, txn->id);
+		ret = -ETIMEDOUT;
+	}
+	txn->in_use = false;
+	spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+
+	return ret;
+}
+
+/*
+ * btfmcodec_txn_complete() - complete transactions waiting on a response
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * rsp_opcode:		opcode of the received response.
+ * stream_id:		stream id echoed in the response, or negative to
+ *			complete every transaction waiting on rsp_opcode.
+ * status:		rx_status to report to the waiters.
+ */
+static int btfmcodec_txn_complete(struct btfmcodec_char_device *btfmcodec_dev,
+				  btm_opcode rsp_opcode, int stream_id,
+				  uint8_t status)
+{
+	struct btfmcodec_txn_done done[BTM_MAX_TXN];
+	struct btfmcodec_txn *txn;
+	unsigned long flags;
+	int i, op, count = 0, completed = 0;
+
+	spin_lock_irqsave(&btfmcodec_dev->txn_lock, flags);
+	for (i = 0; i < BTM_MAX_TXN; i++) {
+		txn = &btfmcodec_dev->txn[i];
+		if (!txn->in_use || txn->status != BTM_WAITING_RSP ||
+		    txn->rsp_opcode != rsp_opcode ||
+		    (stream_id >= 0 && txn->stream_id != stream_id))
+			continue;
+		trace_btfmcodec_rsp_latency(rsp_opcode, txn->stream_id, status,
+					    ktime_us_delta(ktime_get(), txn->t_start));
+		op = btfmcodec_lat_op(rsp_opcode);
+		if (op == BTM_LAT_OP_MASTER_CONFIG || op == BTM_LAT_OP_DMA_CONFIG)
+			btfmcodec_stats_config_rsp(btfmcodec_dev, txn->id,
+						   txn->t_start);
+		if (op >= 0) {
+			btfmcodec_lat_record(&btfmcodec_dev->lat[op][BTM_LAT_RTT],
+					     txn->t_start);
+			if (txn->t_read)
+				btfmcodec_lat_record(&btfmcodec_dev->lat[op][BTM_LAT_CLIENT],
+						     txn->t_read);
+		}
+		WRITE_ONCE(txn->status, status);
+		if (txn->complete)
+			btfmcodec_txn_detach(txn, &done[count++]);
+		completed++;
+	}
+	spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+
+	btfmcodec_txn_run_done(done, count);
+
+	if (completed)
+		wake_up_interruptible(&btfmcodec_dev->txn_wait_q);
+	else
+		BTFMCODEC_WARN("no pending request for rsp %08x stream %d",
+			       rsp_opcode, stream_id);
+	return completed;
+}
+
+/*
+ * btfmcodec_txn_mark_read() - account a request handed to userspace
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * data:		request read by userspace or put in the tx ring.
+ * len:			length of data.
+ * stamp:		time the request was queued.
+ *
+ * Records how long the request sat in txq and stamps the read time in its
+ * transaction, so that the response can account the client latency.
+ */
+static void btfmcodec_txn_mark_read(struct btfmcodec_char_device *btfmcodec_dev,
+				    const uint8_t *data, int len, ktime_t stamp)
+{
+	struct btfmcodec_txn *txn;
+	btm_opcode rsp_opcode;
+	unsigned long flags;
+	int i, op;
+
+	if (len <= BTM_HEADER_LEN)
+		return;
+
+	/* Every request is answered with the opcode that follows it */
+	rsp_opcode = btfmcodec_buf_to_uint32(data) + 1;
+	op = btfmcodec_lat_op(rsp_opcode);
+	if (op < 0)
+		return;
+
+	btfmcodec_lat_record(&btfmcodec_dev->lat[op][BTM_LAT_QUEUE], stamp);
+
+	spin_lock_irqsave(&btfmcodec_dev->txn_lock, flags);
+	for (i = 0; i < BTM_MAX_TXN; i++) {
+		txn = &btfmcodec_dev->txn[i];
+		if (txn->in_use && !txn->t_read &&
+		    txn->rsp_opcode == rsp_opcode &&
+		    txn->stream_id == data[BTM_HEADER_LEN])
+			txn->t_read = ktime_get();
+	}
+	spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+}
+
+static void btfmcodec_txn_abort_all(struct btfmcodec_char_device *btfmcodec_dev)
+{
+	struct btfmcodec_txn_done done[BTM_MAX_TXN];
+	struct btfmcodec_txn *txn;
+	unsigned long flags;
+	int i, count = 0;
+
+	spin_lock_irqsave(&btfmcodec_dev->txn_lock, flags);
+	for (i = 0; i < BTM_MAX_TXN; i++) {
+		txn = &btfmcodec_dev->txn[i];
+		if (!txn->in_use)
+			continue;
+		WRITE_ONCE(txn->status, BTM_RSP_NOT_RECV_CLIENT_KILLED);
+		if (txn->complete)
+			btfmcodec_txn_detach(txn, &done[count++]);
+	}
+	spin_unlock_irqrestore(&btfmcodec_dev->txn_lock, flags);
+	wake_up_interruptible(&btfmcodec_dev->txn_wait_q);
+	btfmcodec_txn_run_done(done, count);
+}
+
+static void btfmcodec_rx_prepare_bearer(struct btfmcodec_char_device *btfmcodec_dev,
+					const struct btfmcodec_pkt_desc *desc,
+					uint8_t *data)
+{
+	uint8_t *bearer_switch_ind =
+		&btfmcodec_dev->status[BTM_PKT_TYPE_BEARER_SWITCH_IND];
+
+	if (!data)
+		return;
+
+	/* there are chances where bearer indication is not recevied,
+	 * So inform waiting thread to unblock itself and move to
+	 * previous state.
+	 */
+	if (*bearer_switch_ind == BTM_WAITING_RSP) {
+		BTFMCODEC_DBG("Notifying waiting beare indications");
+		*bearer_switch_ind = BTM_FAIL_RESP_RECV;
+		wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[BTM_PKT_TYPE_BEARER_SWITCH_IND]);
+	}
+	/* Reset bearer switch ind flag */
+	*bearer_switch_ind = BTM_WAITING_RSP;
+	btfmcodec_queue_prepare_bearer(btfmcodec_dev,
+		((struct btm_prepare_bearer_req *)(data - BTM_HEADER_LEN))->transport);
+}
+
+static void btfmcodec_rx_config_rsp(struct btfmcodec_char_device *btfmcodec_dev,
+				    const struct btfmcodec_pkt_desc *desc,
+				    uint8_t *data)
+{
+	struct btm_config_rsp *rsp;
+	uint8_t status = MSG_FAILED;
+
+	/* Responses echo the stream id, so they are matched against the
+	 * exact outstanding request. A malformed one fails every request
+	 * waiting on this opcode.
+	 */
+	if (data) {
+		rsp = (struct btm_config_rsp *)(data - BTM_HEADER_LEN);
+		status = rsp->status;
+		btfmcodec_txn_complete(btfmcodec_dev, desc->opcode, rsp->stream_id,
+				       status == MSG_SUCCESS ?
+				       BTM_RSP_RECV : BTM_FAIL_RESP_RECV);
+	} else {
+		btfmcodec_txn_complete(btfmcodec_dev, desc->opcode, -1,
+				       BTM_FAIL_RESP_RECV);
+	}
+	BTFMCODEC_INFO("Rx rsp %08x status:%d", desc->opcode, status);
+	if (desc->opcode != BTM_BTFMCODEC_CTRL_MASTER_SHUTDOWN_RSP)
+		return;
+
+	BTFMCODEC_INFO("%s: waiting to cancel prepare bearer wq", __func__);
+	cancel_delayed_work_sync(&btfmcodec_dev->wq_prepare_bearer);
+	BTFMCODEC_INFO("%s: prepare bearer wq canceled", __func__);
+}
+
+static void btfmcodec_rx_bearer_switch_ind(struct btfmcodec_char_device *btfmcodec_dev,
+					   const struct btfmcodec_pkt_desc *desc,
+					   uint8_t *data)
+{
+	uint8_t status = MSG_FAILED;
+
+	if (!btfmcodec_switch_ind_match(btfmcodec_dev)) {
+		BTFMCODEC_INFO("dropping indication no switch waits for");
+		return;
+	}
+
+	if (data)
+		status = ((struct btm_bearer_switch_ind *)(data - BTM_HEADER_LEN))->status;
+
+	btfmcodec_dev->status[desc->status_idx] = status == MSG_SUCCESS ?
+						  BTM_RSP_RECV : BTM_FAIL_RESP_RECV;
+	BTFMCODEC_INFO("Rx BTM_BTFMCODEC_BEARER_SWITCH_IND status:%d", status);
+	wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[desc->status_idx]);
+}
+
+static void btfmcodec_rx_log_lvl_ind(struct btfmcodec_char_device *btfmcodec_dev,
+				     const struct btfmcodec_pkt_desc *desc,
+				     uint8_t *data)
+{
+	if (data)
+		log_lvl = ((struct btm_log_lvl_ind *)(data - BTM_HEADER_LEN))->log_lvl;
+	BTFMCODEC_INFO("Rx BTM_BTFMCODEC_CTRL_LOG_LVL_IND status:%d", log_lvl);
+}
+
+static const struct btfmcodec_pkt_desc btfmcodec_rx_pkts[] = {
+	{ BTM_BTFMCODEC_PREPARE_AUDIO_BEARER_SWITCH_REQ,
+	  BTM_PAYLOAD_LEN(struct btm_prepare_bearer_req),
+	  BTM_PKT_TYPE_PREPARE_REQ, btfmcodec_rx_prepare_bearer },
+	{ BTM_BTFMCODEC_MASTER_CONFIG_RSP,
+	  BTM_PAYLOAD_LEN(struct btm_config_rsp),
+	  BTM_PKT_TYPE_MASTER_CONFIG_RSP, btfmcodec_rx_config_rsp },
+	{ BTM_BTFMCODEC_CODEC_CONFIG_DMA_RSP,
+	  BTM_PAYLOAD_LEN(struct btm_config_rsp),
+	  BTM_PKT_TYPE_DMA_CONFIG_RSP, btfmcodec_rx_config_rsp },
+	{ BTM_BTFMCODEC_CTRL_MASTER_SHUTDOWN_RSP,
+	  BTM_PAYLOAD_LEN(struct btm_config_rsp),
+	  BTM_PKT_TYPE_MASTER_SHUTDOWN_RSP, btfmcodec_rx_config_rsp },
+	{ BTM_BTFMCODEC_BEARER_SWITCH_IND,
+	  BTM_PAYLOAD_LEN(struct btm_bearer_switch_ind),
+	  BTM_PKT_TYPE_BEARER_SWITCH_IND, btfmcodec_rx_bearer_switch_ind },
+	{ BTM_BTFMCODEC_CTRL_LOG_LVL_IND,
+	  BTM_PAYLOAD_LEN(struct btm_log_lvl_ind),
+	  -1, btfmcodec_rx_log_lvl_ind },
+};
+
+/* Packed structs must match the lengths used on the wire */
+static void btfmcodec_pkt_check_layout(void)
+{
+	BUILD_BUG_ON(sizeof(btm_opcode) + sizeof(uint32_t) != BTM_HEADER_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_prepare_bearer_req) !=
+		     BTM_PREPARE_AUDIO_BEARER_SWITCH_REQ_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_config_rsp) !=
+		     BTM_MASTER_CONFIG_RSP_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_config_rsp) !=
+		     BTM_CODEC_CONFIG_DMA_RSP_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_bearer_switch_ind) !=
+		     BTM_BEARER_SWITCH_IND_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_log_lvl_ind) !=
+		     BTM_LOG_LVL_IND_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_ctrl_pkt) !=
+		     BTM_PREPARE_AUDIO_BEARER_SWITCH_RSP_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_master_config_req) !=
+		     BTM_MASTER_CONFIG_REQ_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_dma_config_req) !=
+		     BTM_CODEC_CONFIG_DMA_REQ_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_master_shutdown_req) !=
+		     BTM_MASTER_SHUTDOWN_REQ_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_adsp_state_ind) !=
+		     BTM_ADSP_STATE_IND_LEN);
+	BUILD_BUG_ON(BTM_PAYLOAD_LEN(struct btm_usecase_start_ind) !=
+		     BTM_USECASE_START_IND_LEN);
+	BUILD_BUG_ON(sizeof(struct btm_config_rsp) > BTM_MAX_PKT_LEN ||
+		     sizeof(struct btm_dma_config_req) > BTM_MAX_PKT_LEN ||
+		     sizeof(struct btm_master_config_req) > BTM_MAX_PKT_LEN);
+}
+
+static void btfmcodec_dev_process_pkt(struct btfmcodec_char_device *btfmcodec_dev,
+				      btm_opcode opcode, uint32_t len, uint8_t *data)
+{
+	const struct btfmcodec_pkt_desc *desc = NULL;
+	int i;
+
+	trace_btfmcodec_pkt_dispatch(opcode, len);
+	btfmcodec_observer_copy(btfmcodec_dev, BTM_OBSERVER_RX, opcode, data, len);
+	for (i = 0; i < ARRAY_SIZE(btfmcodec_rx_pkts); i++) {
+		if (btfmcodec_rx_pkts[i].opcode == opcode) {
+			desc = &btfmcodec_rx_pkts[i];
 			break;
-		case BTM_BTFMCODEC_BEARER_SWITCH_IND:
-			idx = BTM_PKT_TYPE_BEARER_SWITCH_IND;
-			if (len == BTM_BEARER_SWITCH_IND_LEN) {
-				status = skb->data[0];
-				if (status == MSG_SUCCESS)
-				  btfmcodec_dev->status[idx] = BTM_RSP_RECV;
-				else
-				  btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
-			} else {
-				BTFMCODEC_ERR("wrong packet format with len:%d", len);
-				btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
-			}
-			BTFMCODEC_INFO("Rx BTM_BTFMCODEC_BEARER_SWITCH_IND status:%d",
-				status);
-			wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[idx]);
+		}
+	}
+
+	if (!desc) {
+		BTFMCODEC_ERR("wrong opcode:%08x", opcode);
+		return;
+	}
+
+	if (len != desc->len) {
+		BTFMCODEC_ERR("wrong packet format for %08x with len:%d", opcode, len);
+		data = NULL;
+	}
+	desc->handler(btfmcodec_dev, desc, data);
+}
+
+/*
+ * btfmcodec_ring_put() - copy a packet into a shared ring
+ * ring:	ring in which the driver is the producer.
+ * buf:		packet to be copied.
+ * len:		length of the packet.
+ *
+ * Caller must hold tx_queue_lock. Returns -ENOSPC if the consumer has not
+ * released enough space yet.
+ */
+static int btfmcodec_ring_put(struct btfmcodec_ring *ring, const uint8_t *buf,
+			      uint32_t len)
+{
+	uint32_t head = ring->hdr->head;
+	uint32_t tail = smp_load_acquire(&ring->hdr->tail);
+	uint32_t off, chunk;
+
+	if (head - tail > BTM_RING_DATA_SIZE ||
+	    BTM_RING_DATA_SIZE - (head - tail) < len)
+		return -ENOSPC;
+
+	off = head & (BTM_RING_DATA_SIZE - 1);
+	chunk = min_t(uint32_t, len, BTM_RING_DATA_SIZE - off);
+	memcpy(ring->data + off, buf, chunk);
+	memcpy(ring->data, buf + chunk, len - chunk);
+	smp_store_release(&ring->hdr->head, head + len);
+	return 0;
+}
+
+static void btfmcodec_ring_copy(struct btfmcodec_ring *ring, uint32_t pos,
+				uint8_t *buf, uint32_t len)
+{
+	uint32_t off = pos & (BTM_RING_DATA_SIZE - 1);
+	uint32_t chunk = min_t(uint32_t, len, BTM_RING_DATA_SIZE - off);
+
+	memcpy(buf, ring->data + off, chunk);
+	memcpy(buf + chunk, ring->data, len - chunk);
+}
+
+static bool btfmcodec_ring_empty(struct btfmcodec_ring *ring)
+{
+	return READ_ONCE(ring->hdr->head) == READ_ONCE(ring->hdr->tail);
+}
+
+/*
+ * btfmcodec_ring_flush_txq() - move packets held back in txq to the tx ring
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ *
+ * Caller must hold tx_queue_lock. Stops at the first packet that doesn't
+ * fit, so packets reach the ring in the order they were queued.
+ */
+static void btfmcodec_ring_flush_txq(struct btfmcodec_char_device *btfmcodec_dev)
+{
+	struct btfmcodec_pkt *pkt, *tmp;
+
+	list_for_each_entry_safe(pkt, tmp, &btfmcodec_dev->txq, list) {
+		if (btfmcodec_ring_put(&btfmcodec_dev->tx_ring, pkt->data, pkt->len))
 			break;
-		case BTM_BTFMCODEC_CTRL_LOG_LVL_IND:
-			if (len == BTM_LOG_LVL_IND_LEN) {
-				log_lvl = skb->data[0];
-			} else {
-				BTFMCODEC_ERR("wrong packet format with len:%d", len);
-			}
-			BTFMCODEC_INFO("Rx BTM_BTFMCODEC_CTRL_LOG_LVL_IND status:%d",
-					log_lvl);
-			wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[idx]);
+		btfmcodec_txn_mark_read(btfmcodec_dev, pkt->data, pkt->len,
+					pkt->stamp);
+		list_del(&pkt->list);
+		btfmcodec_pkt_free(btfmcodec_dev, pkt);
+	}
+}
+
+/*
+ * btfmcodec_ring_rx_drain() - dispatch all packets produced by userspace
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ *
+ * Userspace is the producer of the rx ring, so indices and lengths read
+ * from it are validated before use. A corrupted ring is reset by dropping
+ * whatever is pending in it.
+ */
+static void btfmcodec_ring_rx_drain(struct btfmcodec_char_device *btfmcodec_dev)
+{
+	struct btfmcodec_ring *ring = &btfmcodec_dev->rx_ring;
+	uint8_t pkt[BTM_MAX_PKT_LEN];
+	uint32_t head, tail, len;
+
+	head = smp_load_acquire(&ring->hdr->head);
+	tail = ring->hdr->tail;
+	if (head - tail > BTM_RING_DATA_SIZE) {
+		BTFMCODEC_ERR("rx ring corrupted head:%u tail:%u", head, tail);
+		smp_store_release(&ring->hdr->tail, head);
+		return;
+	}
+
+	while (head - tail >= BTM_HEADER_LEN) {
+		btfmcodec_ring_copy(ring, tail, pkt, BTM_HEADER_LEN);
+		len = btfmcodec_buf_to_uint32(pkt + sizeof(btm_opcode));
+		if (len > BTM_MAX_PKT_LEN - BTM_HEADER_LEN) {
+			BTFMCODEC_ERR("dropping rx ring with bad len:%u", len);
+			tail = head;
 			break;
-		default:
-			BTFMCODEC_ERR("wrong opcode:%08x", opcode);
 		}
-		kfree_skb(skb);
+
+		if (head - tail < BTM_HEADER_LEN + len)
+			break;
+
+		btfmcodec_ring_copy(ring, tail + BTM_HEADER_LEN,
+				    pkt + BTM_HEADER_LEN, len);
+		tail += BTM_HEADER_LEN + len;
+		btfmcodec_dev_process_pkt(btfmcodec_dev,
+					  btfmcodec_buf_to_uint32(pkt), len,
+					  pkt + BTM_HEADER_LEN);
+	}
+
+	smp_store_release(&ring->hdr->tail, tail);
+}
+
+static void btfmcodec_dev_rxwork(struct work_struct *work)
+{
+	struct btfmcodec_char_device *btfmcodec_dev = container_of(work, struct btfmcodec_char_device, rx_work);
+	struct btfmcodec_pkt *pkt;
+	unsigned long flags;
+	LIST_HEAD(rxq);
+
+	BTFMCODEC_DBG("start");
+	spin_lock_irqsave(&btfmcodec_dev->rx_queue_lock, flags);
+	list_splice_init(&btfmcodec_dev->rxq, &rxq);
+	spin_unlock_irqrestore(&btfmcodec_dev->rx_queue_lock, flags);
+
+	/* write() has already split batches and validated the lengths */
+	while ((pkt = list_first_entry_or_null(&rxq, struct btfmcodec_pkt, list))) {
+		list_del(&pkt->list);
+		btfmcodec_lat_record(&btfmcodec_dev->rx_queue_lat, pkt->stamp);
+		btfmcodec_dev_process_pkt(btfmcodec_dev,
+			btfmcodec_buf_to_uint32(pkt->data),
+			btfmcodec_buf_to_uint32(pkt->data + sizeof(btm_opcode)),
+			pkt->data + BTM_HEADER_LEN);
+		btfmcodec_pkt_free(btfmcodec_dev, pkt);
 	}
+
+	if (READ_ONCE(btfmcodec_dev->ring_mapped))
+		btfmcodec_ring_rx_drain(btfmcodec_dev);
 	BTFMCODEC_DBG("end");
 }
 
@@ -271,14 +1217,19 @@ static void btfmcodec_dev_rxwork(struct work_struct *work)
  * This function is used to write the data to btfmcodec dev node when
  * userspace client do a write() system call. All input arguments are
  * validated by the virtual file system before calling this function.
+ * In batch mode the buffer may hold several concatenated packets.
+ * Packets are copied from userspace straight into pooled buffers.
  */
 static ssize_t btfmcodec_dev_write(struct file *file,
 			const char __user *buf, size_t count, loff_t *ppos)
 {
 	struct btfmcodec_data *btfmcodec = file->private_data;
 	struct btfmcodec_char_device *btfmcodec_dev= NULL;
-	struct sk_buff *skb;
-	void *kbuf;
+	struct btfmcodec_pkt *pkt;
+	unsigned long flags;
+	LIST_HEAD(pkts);
+	size_t off = 0;
+	uint32_t len;
 	int ret =  0;
 
 	if (!btfmcodec || !btfmcodec->btfmcodec_dev || refcount_read(&btfmcodec->btfmcodec_dev->active_clients) == 1) {
@@ -288,44 +1239,69 @@ static ssize_t btfmcodec_dev_write(struct file *file,
 		btfmcodec_dev = btfmcodec->btfmcodec_dev;
 	}
 
-	if (mutex_lock_interruptible(&btfmcodec_dev->lock)) {
-		ret = -ERESTARTSYS;
-		goto free_kbuf;
-	}
+	if (mutex_lock_interruptible(&btfmcodec_dev->lock))
+		return -ERESTARTSYS;
 
 	/* Hack for Now */
 	if (count < MIN_PKT_LEN) {
 		BTFMCODEC_ERR("minimum packet len should be greater than 3 bytes");
-		goto free_kbuf;
+		goto unlock;
 	}
 	if (refcount_read(&btfmcodec->btfmcodec_dev->active_clients) == 0) {
 		BTFMCODEC_WARN("Client disconnected");
 		ret = -ENETRESET;
-		goto free_kbuf;
+		goto unlock;
 	}
 
 	BTFMCODEC_DBG("begin to %s buffer_size %zu\n", btfmcodec_dev->dev_name, count);
-	kbuf = memdup_user(buf, count);
-	if (IS_ERR(kbuf)) {
-		ret = PTR_ERR(kbuf);
-		goto free_kbuf;
-	}
+	while (count - off >= BTM_HEADER_LEN) {
+		pkt = btfmcodec_pkt_alloc(btfmcodec_dev, GFP_KERNEL);
+		if (copy_from_user(pkt->data, buf + off, BTM_HEADER_LEN)) {
+			btfmcodec_pkt_free(btfmcodec_dev, pkt);
+			ret = -EFAULT;
+			break;
+		}
 
-	/* Check whether we need a dedicated chunk of memory for this driver */
-	skb = alloc_skb(count* sizeof(size_t), GFP_KERNEL);
-	if (!skb) {
-		BTFMCODEC_ERR("failed to allocate memory for recevied packet");
-		ret = -ENOMEM;
-		goto free_kbuf;
-	}
+		len = btfmcodec_buf_to_uint32(pkt->data + sizeof(btm_opcode));
+		if (len > count - off - BTM_HEADER_LEN ||
+		    len > BTM_MAX_PKT_LEN - BTM_HEADER_LEN) {
+			BTFMCODEC_ERR("truncated packet opcode:%08x len:%u",
+				      btfmcodec_buf_to_uint32(pkt->data), len);
+			btfmcodec_pkt_free(btfmcodec_dev, pkt);
+			ret = -EINVAL;
+			break;
+		}
 
-	skb_put_data(skb, (uint8_t *)kbuf, count);
-	skb_queue_tail(&btfmcodec_dev->rxq, skb);
-	schedule_work(&btfmcodec_dev->rx_work);
+		if (copy_from_user(pkt->data + BTM_HEADER_LEN,
+				   buf + off + BTM_HEADER_LEN, len)) {
+			btfmcodec_pkt_free(btfmcodec_dev, pkt);
+			ret = -EFAULT;
+			break;
+		}
 
-	kfree(kbuf);
+		pkt->len = BTM_HEADER_LEN + len;
+		off += pkt->len;
+		list_add_tail(&pkt->list, &pkts);
+		if (!btfmcodec_dev->batch_mode)
+			break;
+	}
+
+	if (ret < 0) {
+		btfmcodec_pkt_free_list(btfmcodec_dev, &pkts);
+		goto unlock;
+	}
 
-free_kbuf:
+	/* Every packet, bearer switch indications included, is dispatched
+	 * in write order by the high priority rx worker.
+	 */
+	list_for_each_entry(pkt, &pkts, list)
+		pkt->stamp = ktime_get();
+	spin_lock_irqsave(&btfmcodec_dev->rx_queue_lock, flags);
+	list_splice_tail(&pkts, &btfmcodec_dev->rxq);
+	spin_unlock_irqrestore(&btfmcodec_dev->rx_queue_lock, flags);
+	queue_work(btfmcodec_dev->rx_workqueue, &btfmcodec_dev->rx_work);
+
+unlock:
 	mutex_unlock(&btfmcodec_dev->lock);
 	BTFMCODEC_DBG("finish to %s ret %d\n", btfmcodec_dev->dev_name, ret);
 	return ret < 0 ? ret : count;
@@ -333,26 +1309,59 @@ free_kbuf:
 
 int btfmcodec_dev_enqueue_pkt(struct btfmcodec_char_device *btfmcodec_dev, void *buf, int len)
 {
-	struct sk_buff *skb;
+	struct btfmcodec_pkt *pkt;
 	unsigned long flags;
 	uint8_t *cmd = buf;
 
 	BTFMCODEC_DBG("start");
+	if (len > BTM_MAX_PKT_LEN) {
+		BTFMCODEC_ERR("packet len:%d exceeds %d", len, BTM_MAX_PKT_LEN);
+		return -EINVAL;
+	}
+
 	spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
 	if (refcount_read(&btfmcodec_dev->active_clients) == 1) {
 		BTFMCODEC_WARN("no active clients discarding the packet");
 		spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
 		return -EINVAL;
 	}
-	skb = alloc_skb(len, GFP_ATOMIC);
-	if (!skb) {
+
+	trace_btfmcodec_pkt_enqueue(btfmcodec_buf_to_uint32(cmd), len);
+	if (len >= BTM_HEADER_LEN)
+		btfmcodec_observer_copy(btfmcodec_dev, BTM_OBSERVER_TX,
+					btfmcodec_buf_to_uint32(cmd),
+					cmd + BTM_HEADER_LEN, len - BTM_HEADER_LEN);
+	/* Packets go through the shared ring when userspace has mapped it.
+	 * Fall back to txq only when the ring is full so nothing is lost.
+	 * Once a packet is held back in txq, later ones queue behind it until
+	 * the ring has room for all of them, which keeps requests and their
+	 * indications in order.
+	 */
+	if (btfmcodec_dev->ring_mapped) {
+		btfmcodec_ring_flush_txq(btfmcodec_dev);
+		if (list_empty(&btfmcodec_dev->txq) &&
+		    !btfmcodec_ring_put(&btfmcodec_dev->tx_ring, cmd, len)) {
+			btfmcodec_txn_mark_read(btfmcodec_dev, cmd, len, ktime_get());
+			wake_up_interruptible(&btfmcodec_dev->readq);
+			spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
+			BTFMCODEC_DBG("end");
+			return 0;
+		}
+	}
+
+	/* Falls back on the pool reserve when the slab can't be refilled */
+	pkt = btfmcodec_pkt_alloc(btfmcodec_dev, GFP_ATOMIC);
+	if (!pkt) {
 		BTFMCODEC_ERR("failed to allocate memory");
 		spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
 		return -ENOMEM;
 	}
 
-	skb_put_data(skb, cmd, len);
-	skb_queue_tail(&btfmcodec_dev->txq, skb);
+	memcpy(pkt->data, cmd, len);
+	pkt->len = len;
+	/* enqueue time, consumed by btfmcodec_txn_mark_read() */
+	pkt->stamp = ktime_get();
+	list_add_tail(&pkt->list, &btfmcodec_dev->txq);
 	wake_up_interruptible(&btfmcodec_dev->readq);
 	spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
 	BTFMCODEC_DBG("end");
@@ -395,8 +1404,13 @@ static __poll_t btfmcodec_dev_poll(struct file *file, poll_table *wait)
 	}
 
 	spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
+	/* Ring space released by userspace takes the held back packets */
+	if (btfmcodec_dev->ring_mapped)
+		btfmcodec_ring_flush_txq(btfmcodec_dev);
 	/* Set flags if data is avilable to read */
-	if (!skb_queue_empty(&btfmcodec_dev->txq))
+	if (!list_empty(&btfmcodec_dev->txq) ||
+	    (btfmcodec_dev->ring_mapped &&
+	     !btfmcodec_ring_empty(&btfmcodec_dev->tx_ring)))
 		mask |= POLLIN | POLLRDNORM;
 
 	spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
@@ -416,15 +1430,20 @@ static __poll_t btfmcodec_dev_poll(struct file *file, poll_table *wait)
  * This function is used to Read the data from btfmcodec pkt device when
  * userspace client do a read() system call. All input arguments are
  * validated by the virtual file system before calling this function.
+ * In batch mode every queued packet that fits in the userspace buffer is
+ * returned back to back, otherwise one packet is returned per call.
  */
 static ssize_t btfmcodec_dev_read(struct file *file,
 			char __user *buf, size_t count, loff_t *ppos)
 {
 	struct btfmcodec_data *btfmcodec = file->private_data;
 	struct btfmcodec_char_device *btfmcodec_dev= NULL;
+	struct btfmcodec_pkt *pkt, *tmp;
 	unsigned long flags;
-	struct sk_buff *skb;
-	int use;
+	LIST_HEAD(batch);
+	size_t total = 0;
+	int use = 0;
+	int len;
 
 	BTFMCODEC_DBG("start");
 	if (!btfmcodec || !btfmcodec->btfmcodec_dev || refcount_read(&btfmcodec->btfmcodec_dev->active_clients) == 1) {
@@ -436,7 +1455,7 @@ static ssize_t btfmcodec_dev_read(struct file *file,
 
 	spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
 	/* Wait for data in the queue */
-	if (skb_queue_empty(&btfmcodec_dev->txq)) {
+	if (list_empty(&btfmcodec_dev->txq)) {
 		spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
 
 		if (file->f_flags & O_NONBLOCK)
@@ -444,7 +1463,7 @@ static ssize_t btfmcodec_dev_read(struct file *file,
 
 		/* Wait until we get data*/
 		if (wait_event_interruptible(btfmcodec_dev->readq,
-					     !skb_queue_empty(&btfmcodec_dev->txq)))
+					     !list_empty(&btfmcodec_dev->txq)))
 			return -ERESTARTSYS;
 
 		/* We lost the client while waiting */
@@ -454,16 +1473,41 @@ static ssize_t btfmcodec_dev_read(struct file *file,
 		spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
 	}
 
-	skb = skb_dequeue(&btfmcodec_dev->txq);
+	list_for_each_entry_safe(pkt, tmp, &btfmcodec_dev->txq, list) {
+		if (total && (!btfmcodec_dev->batch_mode ||
+			      total + pkt->len > count))
+			break;
+		list_move_tail(&pkt->list, &batch);
+		total += pkt->len;
+	}
 	spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
-	if (!skb)
+	if (list_empty(&batch))
 		return -EFAULT;
 
-	use = min_t(size_t, count, skb->len);
-	if (copy_to_user(buf, skb->data, use))
-		use = -EFAULT;
+	list_for_each_entry_safe(pkt, tmp, &batch, list) {
+		len = min_t(size_t, count - use, pkt->len);
+		if (copy_to_user(buf + use, pkt->data, len))
+			break;
+		use += len;
+		trace_btfmcodec_pkt_dequeue(pkt->len >= BTM_HEADER_LEN ?
+					    btfmcodec_buf_to_uint32(pkt->data) : 0,
+					    pkt->len);
+		btfmcodec_txn_mark_read(btfmcodec_dev, pkt->data, pkt->len,
+					pkt->stamp);
+		list_del(&pkt->list);
+		btfmcodec_pkt_free(btfmcodec_dev, pkt);
+	}
 
-	kfree_skb(skb);
+	/* Packets that couldn't be copied go back to the head of txq, the
+	 * ones already copied are reported to userspace.
+	 */
+	if (!list_empty(&batch)) {
+		spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
+		list_splice(&batch, &btfmcodec_dev->txq);
+		spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
+		if (!use)
+			use = -EFAULT;
+	}
 
 	BTFMCODEC_DBG("end for %s by %s:%d ret[%d]\n", btfmcodec_dev->dev_name,
 		       current->comm, task_pid_nr(current), use);
@@ -471,6 +1515,70 @@ static ssize_t btfmcodec_dev_read(struct file *file,
 	return use;
 }
 
+/*
+ * btfmcodec_dev_mmap() - mmap() syscall for the btfmcodec dev node
+ * file:	Pointer to the file structure.
+ * vma:		Pointer to the virtual memory area to be mapped.
+ *
+ * This function maps the shared control rings (see BTM_RING_* layout)
+ * into the userspace client. Once mapped, packets towards userspace are
+ * placed in the tx ring and signalled through poll(), and packets from
+ * userspace are picked from the rx ring on BTM_RING_RX_KICK ioctl.
+ */
+static int btfmcodec_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct btfmcodec_data *btfmcodec = file->private_data;
+	struct btfmcodec_char_device *btfmcodec_dev;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long flags;
+	uint8_t *ring_buf;
+	int ret;
+
+	if (!btfmcodec || !btfmcodec->btfmcodec_dev)
+		return -EINVAL;
+
+	btfmcodec_dev = btfmcodec->btfmcodec_dev;
+	if (vma->vm_pgoff || size > PAGE_ALIGN(BTM_RING_MMAP_SIZE)) {
+		BTFMCODEC_ERR("invalid mmap request of size %lu", size);
+		return -EINVAL;
+	}
+
+	mutex_lock(&btfmcodec_dev->lock);
+	ring_buf = btfmcodec_dev->ring_buf;
+	if (!ring_buf) {
+		ring_buf = vmalloc_user(PAGE_ALIGN(BTM_RING_MMAP_SIZE));
+		if (!ring_buf) {
+			BTFMCODEC_ERR("failed to allocate memory for rings");
+			ret = -ENOMEM;
+			goto unlock;
+		}
+
+		btfmcodec_dev->tx_ring.hdr = (struct btm_ring_hdr *)
+					(ring_buf + BTM_RING_TX_HDR_OFFSET);
+		btfmcodec_dev->tx_ring.data = ring_buf + BTM_RING_TX_DATA_OFFSET;
+		btfmcodec_dev->tx_ring.hdr->size = BTM_RING_DATA_SIZE;
+		btfmcodec_dev->rx_ring.hdr = (struct btm_ring_hdr *)
+					(ring_buf + BTM_RING_RX_HDR_OFFSET);
+		btfmcodec_dev->rx_ring.data = ring_buf + BTM_RING_RX_DATA_OFFSET;
+		btfmcodec_dev->rx_ring.hdr->size = BTM_RING_DATA_SIZE;
+		btfmcodec_dev->ring_buf = ring_buf;
+	}
+
+	ret = remap_vmalloc_range(vma, ring_buf, 0);
+	if (ret) {
+		BTFMCODEC_ERR("failed to map rings ret:%d", ret);
+		goto unlock;
+	}
+
+	spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
+	WRITE_ONCE(btfmcodec_dev->ring_mapped, true);
+	spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
+	BTFMCODEC_INFO("mapped control rings for %s", btfmcodec_dev->dev_name);
+unlock:
+	mutex_unlock(&btfmcodec_dev->lock);
+	return ret;
+}
+
 bool isCpSupported(void)
 {
 	return is_cp_supported;
@@ -480,38 +1588,77 @@ static long btfmcodec_ioctl(struct file *file, unsigned int cmd, unsigned long a
 {
 	struct btfmcodec_data *btfmcodec = file->private_data;
 	struct hwep_data *hwep_info;
+	int i;
 
 	BTFMCODEC_INFO("%s: command %04x", __func__, cmd);
 
-	mutex_lock(&btfmcodec->hwep_drv_lock);
-	hwep_info = btfmcodec->hwep_info;
-	if (!hwep_info) {
-		BTFMCODEC_WARN("%s: HWEP is not registered with btfmcodec", __func__);
-		BTFMCODEC_WARN("%s: caching required info", __func__);
-		is_cp_supported = ((int)arg == 1) ? true : false;
-		mutex_unlock(&btfmcodec->hwep_drv_lock);
+	if (cmd == BTM_BATCH_MODE) {
+		btfmcodec->btfmcodec_dev->batch_mode = ((int)arg == 1);
+		BTFMCODEC_INFO("%s: batch mode %s", __func__,
+			       btfmcodec->btfmcodec_dev->batch_mode ? "enabled" : "disabled");
+		return 0;
+	}
+
+	if (cmd == BTM_DEFERRED_START) {
+		btfmcodec->deferred_start = ((int)arg == 1);
+		BTFMCODEC_INFO("%s: deferred start %s", __func__,
+			       btfmcodec->deferred_start ? "enabled" : "disabled");
+		return 0;
+	}
+
+	if (cmd == BTM_GET_STATS) {
+		struct btm_dai_stats *stats;
+		size_t size = sizeof(*stats) * BTM_MAX_STREAMS;
+		long ret = 0;
+
+		stats = kmalloc(size, GFP_KERNEL);
+		if (!stats)
+			return -ENOMEM;
+		btfmcodec_stats_read(btfmcodec, stats);
+		if (copy_to_user((void __user *)arg, stats, size))
+			ret = -EFAULT;
+		kfree(stats);
+		return ret;
+	}
+
+	if (cmd == BTM_SHUTDOWN_LINGER) {
+		/* Clamped as unsigned long, a 64-bit arg must not wrap */
+		WRITE_ONCE(btfmcodec->linger_ms, min_t(unsigned long, arg,
+						       BTM_MAX_LINGER_MS));
+		BTFMCODEC_INFO("%s: hwep shutdown linger %u ms", __func__,
+			       btfmcodec->linger_ms);
+		return 0;
+	}
+
+	if (cmd == BTM_WARM_STANDBY) {
+		btfmcodec->warm_standby = ((int)arg == 1);
+		BTFMCODEC_INFO("%s: warm standby %s", __func__,
+			       btfmcodec->warm_standby ? "enabled" : "disabled");
+		return 0;
+	}
+
+	/* Doorbell for packets produced in the rx ring */
+	if (cmd == BTM_RING_RX_KICK) {
+		if (!READ_ONCE(btfmcodec->btfmcodec_dev->ring_mapped))
+			return -EINVAL;
+		queue_work(btfmcodec->btfmcodec_dev->rx_workqueue,
+			   &btfmcodec->btfmcodec_dev->rx_work);
 		return 0;
 	}
 
-	mutex_unlock(&btfmcodec->hwep_drv_lock);
 	switch (cmd) {
 	case BTM_CP_UPDATE: {
-		if ((int)arg == 1) {
-			if (!strcmp(hwep_info->driver_name, "btfmslim"))
-				set_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags);
-			else if (!strcmp(hwep_info->driver_name, "btfmswr_slave"))
-				set_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags);
-			BTFMCODEC_INFO("%s: This target support CP hwep %s",
-					__func__, hwep_info->driver_name);
-		} else {
-			clear_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags);
-			clear_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags);
-			BTFMCODEC_INFO("%s: This target support doesn't CP", __func__);
+		mutex_lock(&btfmcodec->hwep_drv_lock);
+		/* Applied to hw eps registered later on as well */
+		is_cp_supported = ((int)arg == 1) ? true : false;
+		BTFMCODEC_INFO("%s: This target %s CP", __func__,
+			       is_cp_supported ? "supports" : "doesn't support");
+		for (i = 0; i < BTM_MAX_HWEP; i++) {
+			hwep_info = btfmcodec->hwep[i].hwep_info;
+			if (hwep_info)
+				btfmcodec_hwep_set_cp(hwep_info, is_cp_supported);
 		}
-
-	BTFMCODEC_INFO("%s: mastr %d dma codec %d", __func__,
-			(int)test_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags),
-			(int)test_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags));
+		mutex_unlock(&btfmcodec->hwep_drv_lock);
 		break;
 	} default: {
 		BTFMCODEC_ERR("%s unhandled cmd %04x", __func__, cmd);
@@ -527,6 +1674,7 @@ static const struct file_operations btfmcodec_fops = {
 	.write = btfmcodec_dev_write,
 	.poll = btfmcodec_dev_poll,
 	.read = btfmcodec_dev_read,
+	.mmap = btfmcodec_dev_mmap,
 	/* For Now add no hookups for below callbacks */
 	.unlocked_ioctl = btfmcodec_ioctl,
 	.compat_ioctl = btfmcodec_ioctl,
@@ -559,6 +1707,58 @@ static ssize_t btfmcodec_attributes_show(struct device *dev,
 	return 0;
 }
 
+static void btfmcodec_lat_show_hist(struct seq_file *s, const char *name,
+				    const char *stage,
+				    struct btfmcodec_lat_hist *hist)
+{
+	int count = atomic_read(&hist->count);
+	int i;
+
+	seq_printf(s, "%-14s %-7s %8d %10lld %10lld", name, stage, count,
+		   count ? div_s64(atomic64_read(&hist->sum_us), count) : 0,
+		   atomic64_read(&hist->max_us));
+	for (i = 0; i < BTM_LAT_BUCKETS; i++)
+		seq_printf(s, " %8d", atomic_read(&hist->bucket[i]));
+	seq_puts(s, "\n");
+}
+
+static void btfmcodec_lat_show_header(struct seq_file *s)
+{
+	int i;
+
+	seq_printf(s, "%-14s %-7s %8s %10s %10s", "name", "stage", "count",
+		   "avg_us", "max_us");
+	for (i = 0; i < BTM_LAT_BUCKETS - 1; i++)
+		seq_printf(s, " <%7u", btm_lat_bounds_us[i]);
+	seq_printf(s, " >=%6u\n", btm_lat_bounds_us[BTM_LAT_BUCKETS - 2]);
+}
+
+static int btfmcodec_latency_show(struct seq_file *s, void *unused)
+{
+	struct btfmcodec_data *btfmcodec = s->private;
+	struct btfmcodec_char_device *btfmcodec_dev = btfmcodec->btfmcodec_dev;
+	struct btfmcodec_state_machine *states = &btfmcodec->states;
+	int op, stage, state;
+
+	btfmcodec_lat_show_header(s);
+	for (op = 0; op < BTM_LAT_OP_MAX; op++) {
+		for (stage = 0; stage < BTM_LAT_STAGE_MAX; stage++)
+			btfmcodec_lat_show_hist(s, btm_lat_op_name[op],
+						btm_lat_stage_name[stage],
+						&btfmcodec_dev->lat[op][stage]);
+	}
+
+	btfmcodec_lat_show_hist(s, "rx_dispatch", "queue",
+				&btfmcodec_dev->rx_queue_lat);
+	btfmcodec_lat_show_hist(s, "ssr_recovery", "total",
+				&btfmcodec_dev->ssr_recovery_lat);
+	for (state = IDLE; state <= BTADV_AUDIO_Connected; state++)
+		btfmcodec_lat_show_hist(s, coverttostring(state), "dwell",
+					&states->dwell[state]);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(btfmcodec_latency);
+
 struct btfmcodec_data* btfm_get_btfmcodec(void)
 {
 	return btfmcodec;
@@ -567,6 +1767,75 @@ EXPORT_SYMBOL(btfm_get_btfmcodec);
 
 static DEVICE_ATTR_RW(btfmcodec_attributes);
 
+static ssize_t btfmcodec_stream_stats_show(struct device *dev,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct btfmcodec_data *btfmcodec = dev_to_btfmcodec(dev);
+	int id = (uintptr_t)container_of(attr, struct dev_ext_attribute, attr)->var;
+	struct btm_dai_stats *stats, *st;
+	ssize_t len = 0;
+	int state;
+
+	stats = kmalloc_array(BTM_MAX_STREAMS, sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	btfmcodec_stats_read(btfmcodec, stats);
+	st = &stats[id];
+	len += sysfs_emit_at(buf, len, "prepare_count: %u\n", st->prepare_cnt);
+	len += sysfs_emit_at(buf, len, "shutdown_count: %u\n", st->shutdown_cnt);
+	len += sysfs_emit_at(buf, len, "sample_rate: %u\n", st->sample_rate);
+	len += sysfs_emit_at(buf, len, "codec_type: %u\n", st->codectype);
+	len += sysfs_emit_at(buf, len, "bit_width: %u\n", st->bit_width);
+	for (state = IDLE; state <= BTADV_AUDIO_Connected; state++)
+		len += sysfs_emit_at(buf, len, "time_us %s: %llu\n",
+				     coverttostring(state),
+				     st->state_time_us[state]);
+	len += sysfs_emit_at(buf, len, "config_rtt_us min/avg/max: %u/%llu/%u\n",
+			     st->config_rtt_min_us,
+			     st->config_cnt ?
+			     div_u64(st->config_rtt_sum_us, st->config_cnt) : 0,
+			     st->config_rtt_max_us);
+	len += sysfs_emit_at(buf, len, "timeout_count: %u\n", st->timeout_cnt);
+	kfree(stats);
+
+	return len;
+}
+
+#define BTM_STREAM_STATS_ATTR(_id)					\
+	static struct dev_ext_attribute dev_attr_stream##_id = {	\
+		__ATTR(stream##_id, 0444, btfmcodec_stream_stats_show, NULL), \
+		(void *)_id						\
+	}
+
+BTM_STREAM_STATS_ATTR(0);
+BTM_STREAM_STATS_ATTR(1);
+BTM_STREAM_STATS_ATTR(2);
+BTM_STREAM_STATS_ATTR(3);
+BTM_STREAM_STATS_ATTR(4);
+BTM_STREAM_STATS_ATTR(5);
+BTM_STREAM_STATS_ATTR(6);
+BTM_STREAM_STATS_ATTR(7);
+
+static struct attribute *btfmcodec_stats_attrs[] = {
+	&dev_attr_stream0.attr.attr,
+	&dev_attr_stream1.attr.attr,
+	&dev_attr_stream2.attr.attr,
+	&dev_attr_stream3.attr.attr,
+	&dev_attr_stream4.attr.attr,
+	&dev_attr_stream5.attr.attr,
+	&dev_attr_stream6.attr.attr,
+	&dev_attr_stream7.attr.attr,
+	NULL,
+};
+static_assert(ARRAY_SIZE(btfmcodec_stats_attrs) == BTM_MAX_STREAMS + 1);
+
+static const struct attribute_group btfmcodec_stats_group = {
+	.name = "stats",
+	.attrs = btfmcodec_stats_attrs,
+};
+
 static int __init btfmcodec_init(void)
 {
 	struct btfmcodec_state_machine *states;
@@ -575,6 +1844,7 @@ static int __init btfmcodec_init(void)
 	int ret, i;
 
 	BTFMCODEC_INFO("starting up the module");
+	btfmcodec_pkt_check_layout();
 	btfmcodec = kzalloc(sizeof(struct btfmcodec_data), GFP_KERNEL);
 	if (!btfmcodec) {
 		BTFMCODEC_ERR("failed to allocate memory");
@@ -582,9 +1852,9 @@ static int __init btfmcodec_init(void)
 	}
 
 	mutex_init(&btfmcodec->hwep_drv_lock);
+	mutex_init(&btfmcodec->dai_lock);
 	states = &btfmcodec->states;
-	states->current_state = IDLE;
-	states->next_state = IDLE;
+	btfmcodec_reset_state(states);
 
 	BTFMCODEC_INFO("creating device node");
 	/* create device node for communication between userspace and kernel */
@@ -654,26 +1924,76 @@ static int __init btfmcodec_init(void)
 		goto free_device;
 	}
 
+	spin_lock_init(&btfmcodec->stats_lock);
+	ret = device_add_group(dev, &btfmcodec_stats_group);
+	if (ret) {
+		BTFMCODEC_ERR("Failed to create stats group: %s", btfmcodec_dev->dev_name);
+		device_remove_file(dev, &dev_attr_btfmcodec_attributes);
+		goto free_device;
+	}
+
 	BTFMCODEC_INFO("created a node at /dev/%s with %u:%u\n",
 		btfmcodec_dev->dev_name, dev_major, btfmcodec_dev->reuse_minor);
 
-	skb_queue_head_init(&btfmcodec_dev->rxq);
+	spin_lock_init(&btfmcodec_dev->rx_queue_lock);
+	INIT_LIST_HEAD(&btfmcodec_dev->rxq);
 	mutex_init(&btfmcodec_dev->lock);
 	INIT_WORK(&btfmcodec_dev->rx_work, btfmcodec_dev_rxwork);
 	init_waitqueue_head(&btfmcodec_dev->readq);
 	spin_lock_init(&btfmcodec_dev->tx_queue_lock);
-	skb_queue_head_init(&btfmcodec_dev->txq);
-	INIT_LIST_HEAD(&btfmcodec->config_head);
+	INIT_LIST_HEAD(&btfmcodec_dev->txq);
+	spin_lock_init(&btfmcodec_dev->observers_lock);
+	INIT_LIST_HEAD(&btfmcodec_dev->observers);
+	seqlock_init(&btfmcodec->config_lock);
 	for (i = 0; i < BTM_PKT_TYPE_MAX; i++) {
 		init_waitqueue_head(&btfmcodec_dev->rsp_wait_q[i]);
 	}
-	mutex_init(&states->state_machine_lock);
+	spin_lock_init(&btfmcodec_dev->txn_lock);
+	spin_lock_init(&btfmcodec_dev->switch_lock);
+	btfmcodec_switch_ind_reset(btfmcodec_dev);
+	init_waitqueue_head(&btfmcodec_dev->txn_wait_q);
+	INIT_DELAYED_WORK(&btfmcodec_dev->txn_timeout_work, btfmcodec_txn_timeout);
 	btfmcodec_dev->workqueue = alloc_ordered_workqueue("btfmcodec_wq", 0);
 	if (!btfmcodec_dev->workqueue) {
 		BTFMCODEC_ERR("btfmcodec_dev Workqueue not initialized properly");
 		ret = -ENOMEM;
 		goto free_device;
 	}
+
+	btfmcodec_dev->rx_workqueue = alloc_ordered_workqueue("btfmcodec_rx_wq",
+							      WQ_HIGHPRI);
+	if (!btfmcodec_dev->rx_workqueue) {
+		BTFMCODEC_ERR("btfmcodec_dev rx workqueue not initialized properly");
+		destroy_workqueue(btfmcodec_dev->workqueue);
+		ret = -ENOMEM;
+		goto free_device;
+	}
+
+	btfmcodec_dev->pkt_cache = kmem_cache_create("btfmcodec_pkt",
+				sizeof(struct btfmcodec_pkt), 0, 0, NULL);
+	if (btfmcodec_dev->pkt_cache)
+		btfmcodec_dev->pkt_pool = mempool_create_slab_pool(BTM_PKT_POOL_SIZE,
+						btfmcodec_dev->pkt_cache);
+	if (!btfmcodec_dev->pkt_pool) {
+		BTFMCODEC_ERR("failed to create packet pool");
+		kmem_cache_destroy(btfmcodec_dev->pkt_cache);
+		destroy_workqueue(btfmcodec_dev->rx_workqueue);
+		destroy_workqueue(btfmcodec_dev->workqueue);
+		ret = -ENOMEM;
+		goto free_device;
+	}
+
+	btfmcodec_dev->debugfs = debugfs_create_dir("btfmcodec", NULL);
+	debugfs_create_file("latency", 0444, btfmcodec_dev->debugfs, btfmcodec,
+			    &btfmcodec_latency_fops);
+	debugfs_create_atomic_t("switch_coalesced", 0444, btfmcodec_dev->debugfs,
+				&btfmcodec_dev->switch_coalesced);
+	debugfs_create_atomic_t("switch_avoided", 0444, btfmcodec_dev->debugfs,
+				&btfmcodec_dev->switch_avoided);
+	debugfs_create_atomic_t("linger_hit", 0444, btfmcodec_dev->debugfs,
+				&btfmcodec->linger_hit);
+	debugfs_create_atomic_t("linger_miss", 0444, btfmcodec_dev->debugfs,
+				&btfmcodec->linger_miss);
 	return ret;
 
 free_device:
@@ -704,6 +2024,7 @@ static void __exit btfmcodec_deinit(void)
 
 	dev = &btfmcodec->dev;
 
+	device_remove_group(dev, &btfmcodec_stats_group);
 	device_remove_file(dev, &dev_attr_btfmcodec_attributes);
 	put_device(dev);
 
@@ -713,7 +2034,17 @@ static void __exit btfmcodec_deinit(void)
 	}
 
 	btfmcodec_dev = btfmcodec->btfmcodec_dev;
-	skb_queue_purge(&btfmcodec_dev->rxq);
+	debugfs_remove_recursive(btfmcodec_dev->debugfs);
+	destroy_workqueue(btfmcodec_dev->rx_workqueue);
+	/* No response can come in anymore, fail what is still pending so the
+	 * timeout worker doesn't run on freed memory.
+	 */
+	btfmcodec_txn_abort_all(btfmcodec_dev);
+	cancel_delayed_work_sync(&btfmcodec_dev->txn_timeout_work);
+	btfmcodec_pkt_free_list(btfmcodec_dev, &btfmcodec_dev->rxq);
+	btfmcodec_pkt_free_list(btfmcodec_dev, &btfmcodec_dev->txq);
+	mempool_destroy(btfmcodec_dev->pkt_pool);
+	kmem_cache_destroy(btfmcodec_dev->pkt_cache);
 	idr_remove(&dev_minor, btfmcodec_dev->reuse_minor);
 	class_destroy(dev_class);
 	unregister_chrdev_region(MAJOR(dev_major), 0);
@@ -6,6 +6,7 @@
 #include "btfm_codec.h"
 #include "btfm_codec_pkt.h"
 #include "btfm_codec_btadv_interface.h"
+#include "btfm_codec_trace.h"
 
 void btfmcodec_initiate_hwep_shutdown(struct btfmcodec_char_device *btfmcodec_dev)
 {
@@ -38,54 +39,148 @@ void btfmcodec_initiate_hwep_shutdown(struct btfmcodec_char_device *btfmcodec_de
 	}
 }
 
+/* Forward transitions allowed by the state machine, indexed [from][to].
+ * Rolling back with btfmcodec_revert_current_state() restores a state
+ * that was already valid and is not checked against this table.
+ */
+static const bool btfmcodec_transitions[BTADV_AUDIO_Connected + 1]
+				       [BTADV_AUDIO_Connected + 1] = {
+	[IDLE] = {
+		[IDLE] = true,
+		[BT_Connecting] = true,
+		[BT_Connected] = true,
+		[BTADV_AUDIO_Connecting] = true,
+	},
+	[BT_Connecting] = {
+		[IDLE] = true,
+		[BT_Connecting] = true,
+		[BT_Connected] = true,
+		[BTADV_AUDIO_Connecting] = true,
+	},
+	[BT_Connected] = {
+		[IDLE] = true,
+		[BT_Connected] = true,
+		[BTADV_AUDIO_Connecting] = true,
+	},
+	[BTADV_AUDIO_Connecting] = {
+		[IDLE] = true,
+		[BT_Connecting] = true,
+		[BTADV_AUDIO_Connecting] = true,
+		[BTADV_AUDIO_Connected] = true,
+	},
+	[BTADV_AUDIO_Connected] = {
+		[IDLE] = true,
+		[BT_Connecting] = true,
+		[BTADV_AUDIO_Connected] = true,
+	},
+};
+
+static bool btfmcodec_is_valid_transition(btfmcodec_state from,
+					  btfmcodec_state to)
+{
+	if (from > BTADV_AUDIO_Connected || to > BTADV_AUDIO_Connected)
+		return false;
+
+	return btfmcodec_transitions[from][to];
+}
+
+static void btfmcodec_record_dwell(struct btfmcodec_state_machine *state,
+				   btfmcodec_state from, btfmcodec_state to)
+{
+	s64 entered;
+
+	if (from == to || from > BTADV_AUDIO_Connected)
+		return;
+
+	trace_btfmcodec_state_transition(from, to);
+	entered = atomic64_xchg(&state->entered_ns, ktime_get_ns());
+	btfmcodec_lat_record(&state->dwell[from], ns_to_ktime(entered));
+}
+
 void btfmcodec_move_to_next_state(struct btfmcodec_state_machine *state)
 {
-	mutex_lock(&state->state_machine_lock);
-	if (state->current_state == BT_Connecting ||
-	    state->current_state == BTADV_AUDIO_Connecting) {
-		state->current_state += 1;
-		BTFMCODEC_INFO("moving from %s to %s",
-				coverttostring(state->current_state -1 ),
-				coverttostring(state->current_state));
-	} else {
-		BTFMCODEC_ERR("State machine might have gone bad. reseting to default");
-		state->current_state = IDLE;
-	}
+	int old = atomic_read(&state->state_word);
+	int new;
+	btfmcodec_state current_state;
 
-	state->prev_state = IDLE;
-	mutex_unlock(&state->state_machine_lock);
+	do {
+		current_state = BTM_STATE_CUR(old);
+		if (current_state == BT_Connecting ||
+		    current_state == BTADV_AUDIO_Connecting) {
+			new = BTM_STATE_PACK(IDLE, current_state + 1,
+					     BTM_STATE_NEXT(old));
+		} else if (current_state == BT_Connected ||
+			   current_state == BTADV_AUDIO_Connected) {
+			/* hwep configuration already completed the move */
+			new = BTM_STATE_PACK(IDLE, current_state,
+					     BTM_STATE_NEXT(old));
+		} else {
+			new = BTM_STATE_PACK(IDLE, IDLE, BTM_STATE_NEXT(old));
+		}
+	} while (!atomic_try_cmpxchg(&state->state_word, &old, new));
+
+	btfmcodec_record_dwell(state, current_state, BTM_STATE_CUR(new));
+	if (BTM_STATE_CUR(new) == IDLE)
+		BTFMCODEC_ERR("State machine might have gone bad. reseting to default");
+	else
+		BTFMCODEC_INFO("moving from %s to %s",
+				coverttostring(current_state),
+				coverttostring(BTM_STATE_CUR(new)));
 }
 
 void btfmcodec_revert_current_state(struct btfmcodec_state_machine *state)
 {
-	mutex_lock(&state->state_machine_lock);
-	BTFMCODEC_INFO("reverting from %s to %s", coverttostring(state->current_state),
-					coverttostring(state->prev_state));
-	state->current_state = state->prev_state;
-	state->prev_state = IDLE;
-	mutex_unlock(&state->state_machine_lock);
+	int old = atomic_read(&state->state_word);
+	int new;
+
+	do {
+		new = BTM_STATE_PACK(IDLE, BTM_STATE_PREV(old),
+				     BTM_STATE_NEXT(old));
+	} while (!atomic_try_cmpxchg(&state->state_word, &old, new));
+
+	btfmcodec_record_dwell(state, BTM_STATE_CUR(old), BTM_STATE_CUR(new));
+	BTFMCODEC_INFO("reverting from %s to %s",
+		       coverttostring(BTM_STATE_CUR(old)),
+		       coverttostring(BTM_STATE_CUR(new)));
 }
 
-void btfmcodec_set_current_state(struct btfmcodec_state_machine *state,
+/*
+ * btfmcodec_set_current_state() - move the state machine to a new state
+ * state:		Pointer to the state machine.
+ * current_state:	state to move to.
+ *
+ * Returns false, leaving the state untouched, if btfmcodec_transitions
+ * doesn't allow the move. Callers must then not go ahead with whatever
+ * the new state stood for.
+ */
+bool btfmcodec_set_current_state(struct btfmcodec_state_machine *state,
 		btfmcodec_state current_state)
 {
-	mutex_lock(&state->state_machine_lock);
-	BTFMCODEC_INFO("moving from %s to %s", coverttostring(state->current_state),
+	int old = atomic_read(&state->state_word);
+	btfmcodec_state prev_state;
+
+	do {
+		prev_state = BTM_STATE_CUR(old);
+		if (!btfmcodec_is_valid_transition(prev_state, current_state)) {
+			BTFMCODEC_ERR("rejecting move from %s to %s",
+				      coverttostring(prev_state),
+				      coverttostring(current_state));
+			return false;
+		}
+	} while (!atomic_try_cmpxchg(&state->state_word, &old,
+				     BTM_STATE_PACK(prev_state, current_state,
+						    BTM_STATE_NEXT(old))));
+
+	btfmcodec_record_dwell(state, prev_state, current_state);
+	BTFMCODEC_INFO("moving from %s to %s", coverttostring(prev_state),
 					coverttostring(current_state));
-	state->prev_state = state->current_state;
-	state->current_state = current_state;
-	mutex_unlock(&state->state_machine_lock);
+	return true;
 }
 
 btfmcodec_state btfmcodec_get_current_transport(struct
 					btfmcodec_state_machine *state)
 {
-	btfmcodec_state current_state;
-
-	mutex_lock(&state->state_machine_lock);
-	current_state = state->current_state;
-	mutex_unlock(&state->state_machine_lock);
-	return current_state;
+	return BTM_STATE_CUR(atomic_read(&state->state_word));
 }
 
 int btfmcodec_frame_transport_switch_ind_pkt(struct btfmcodec_char_device *btfmcodec_dev,
@@ -116,22 +211,80 @@ int btfmcodec_frame_prepare_bearer_rsp_pkt(struct btfmcodec_char_device *btfmcod
 					BTM_HEADER_LEN));
 }
 
+/*
+ * btfmcodec_switch_ack() - ack a bearer switch request answered by an indication
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * active_transport:	transport reported in the ack.
+ *
+ * The ack is queued and the wait for its indication armed under
+ * switch_lock, so the indication can't be received before.
+ */
+static int btfmcodec_switch_ack(struct btfmcodec_char_device *btfmcodec_dev,
+				uint8_t active_transport)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&btfmcodec_dev->switch_lock, flags);
+	ret = btfmcodec_frame_prepare_bearer_rsp_pkt(btfmcodec_dev,
+						     active_transport, MSG_SUCCESS);
+	if (ret >= 0)
+		btfmcodec_dev->switch_ind_armed = true;
+	spin_unlock_irqrestore(&btfmcodec_dev->switch_lock, flags);
+	return ret;
+}
+
+/*
+ * btfmcodec_switch_ind_match() - check a received bearer switch indication
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ *
+ * Returns true for the first indication received once a wait is armed.
+ * Indications received while none is armed answer acks nobody waits for,
+ * like the ones of merged requests, and are dropped.
+ */
+bool btfmcodec_switch_ind_match(struct btfmcodec_char_device *btfmcodec_dev)
+{
+	unsigned long flags;
+	bool match;
+
+	spin_lock_irqsave(&btfmcodec_dev->switch_lock, flags);
+	match = btfmcodec_dev->switch_ind_armed;
+	btfmcodec_dev->switch_ind_armed = false;
+	spin_unlock_irqrestore(&btfmcodec_dev->switch_lock, flags);
+	return match;
+}
+
+/* Disarm the wait for an indication, a late one is dropped */
+void btfmcodec_switch_ind_reset(struct btfmcodec_char_device *btfmcodec_dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&btfmcodec_dev->switch_lock, flags);
+	btfmcodec_dev->switch_ind_armed = false;
+	spin_unlock_irqrestore(&btfmcodec_dev->switch_lock, flags);
+}
+
 int btfmcodec_wait_for_bearer_ind(struct btfmcodec_char_device *btfmcodec_dev)
 {
 	wait_queue_head_t *rsp_wait_q =
 		&btfmcodec_dev->rsp_wait_q[BTM_PKT_TYPE_BEARER_SWITCH_IND];
 	int ret;
 	uint8_t *status = &btfmcodec_dev->status[BTM_PKT_TYPE_BEARER_SWITCH_IND];
+	ktime_t start = ktime_get();
 
 	ret = wait_event_interruptible_timeout(*rsp_wait_q,
 		*status != BTM_WAITING_RSP,
 		msecs_to_jiffies(BTM_MASTER_CONFIG_RSP_TIMEOUT));
 
+	/* Whatever ended the wait, a later indication doesn't answer it */
+	btfmcodec_switch_ind_reset(btfmcodec_dev);
 	if (ret == 0) {
 		BTFMCODEC_ERR("failed to recevie BTM_BEARER_SWITCH_IND");
 		ret = -MSG_INTERNAL_TIMEOUT;
 	} else {
 		if (*status == BTM_RSP_RECV) {
+			btfmcodec_lat_record(&btfmcodec_dev->lat[BTM_LAT_OP_BEARER_IND][BTM_LAT_RTT],
+					     start);
 			ret = 0;
 		} else if (*status == BTM_FAIL_RESP_RECV) {
 			BTFMCODEC_ERR("Rx BTM_BEARER_SWITCH_IND with failure status");
@@ -237,6 +390,16 @@ void btfmcodec_prepare_bearer(struct btfmcodec_char_device *btfmcodec_dev,
 		transport_type_text[new_transport - 1]);
 
 	current_state = btfmcodec_get_current_transport(state);
+	if (atomic_xchg(&btfmcodec_dev->switch_merged, 0)) {
+		if ((new_transport == BT && (current_state == BT_Connected ||
+					     current_state == BT_Connecting)) ||
+		    (new_transport == BTADV &&
+		     (current_state == BTADV_AUDIO_Connected ||
+		      current_state == BTADV_AUDIO_Connecting))) {
+			atomic_inc(&btfmcodec_dev->switch_avoided);
+			BTFMCODEC_INFO("merged requests left transport unchanged");
+		}
+	}
 	if (new_transport == BT) {
 		/* If BT is already active. send +ve ack to BTADV Audio Manager */
 		if (current_state == BT_Connected ||
@@ -249,7 +412,12 @@ void btfmcodec_prepare_bearer(struct btfmcodec_char_device *btfmcodec_dev,
 			   current_state == IDLE) {
 			if (btfmcodec_is_valid_cache_avb(btfmcodec)) {
 				BTFMCODEC_INFO("detected BTADV audio Gaming usecase to BT usecase");
-				btfmcodec_set_current_state(state, BT_Connecting);
+				if (!btfmcodec_set_current_state(state, BT_Connecting)) {
+					btfmcodec_frame_prepare_bearer_rsp_pkt(btfmcodec_dev,
+						btfmcodec_get_current_transport(state),
+						MSG_FAILED);
+					return;
+				}
 				btfmcodec_configure_hwep(btfmcodec_dev);
 			} else {
 				if (current_state != IDLE)
@@ -272,15 +440,20 @@ void btfmcodec_prepare_bearer(struct btfmcodec_char_device *btfmcodec_dev,
 				(uint8_t)current_state, MSG_SUCCESS);
 			return;
 		} else {
-			btfmcodec_set_current_state(state, BTADV_AUDIO_Connecting);
+			if (!btfmcodec_set_current_state(state, BTADV_AUDIO_Connecting)) {
+				btfmcodec_frame_prepare_bearer_rsp_pkt(btfmcodec_dev,
+					btfmcodec_get_current_transport(state),
+					MSG_FAILED);
+				return;
+			}
 			if (btfmcodec_is_valid_cache_avb(btfmcodec)) {
 				BTFMCODEC_INFO("detected BT to BTADV audio Gaming usecase");
 			} else {
 				BTFMCODEC_INFO("detected IDLE to BTADV audio lossless usecase");
 			}
 
-			ret = btfmcodec_frame_prepare_bearer_rsp_pkt(btfmcodec_dev,
-						BTADV_AUDIO_Connecting, MSG_SUCCESS);
+			ret = btfmcodec_switch_ack(btfmcodec_dev,
+						   BTADV_AUDIO_Connecting);
 			if (ret < 0)
 				return;
 
@@ -301,6 +474,10 @@ void btfmcodec_prepare_bearer(struct btfmcodec_char_device *btfmcodec_dev,
 				return;
 
 			if (btfmcodec_is_valid_cache_avb(btfmcodec)) {
+				if (btfmcodec_hwep_enter_standby(btfmcodec)) {
+					BTFMCODEC_INFO("BT ports kept in warm standby");
+					return;
+				}
 				BTFMCODEC_INFO("Initiating BT port close...");
 				btfmcodec_initiate_hwep_shutdown(btfmcodec_dev);
 			}
@@ -315,9 +492,49 @@ void btfmcodec_prepare_bearer(struct btfmcodec_char_device *btfmcodec_dev,
 	}
 }
 
+/*
+ * btfmcodec_queue_prepare_bearer() - schedule a bearer switch request
+ * btfmcodec_dev:	Pointer to the btfmcodec char device.
+ * new_transport:	transport requested by BTADV audio manager.
+ *
+ * A request arriving shortly after the previous one is held back for
+ * BTM_SWITCH_COALESCE_MS. If another request comes in meanwhile, the held
+ * one is acked with the current transport and only the latest is acted
+ * upon, so BT <-> BTADV flapping doesn't reconfigure the hwep each time.
+ */
+void btfmcodec_queue_prepare_bearer(struct btfmcodec_char_device *btfmcodec_dev,
+				    uint8_t new_transport)
+{
+	struct btfmcodec_data *btfmcodec = (struct btfmcodec_data *)btfmcodec_dev->btfmcodec;
+	int idx = BTM_PKT_TYPE_PREPARE_REQ;
+	ktime_t now = ktime_get();
+	unsigned long delay = 0;
+
+	if (ktime_ms_delta(now, btfmcodec_dev->last_switch_req) < BTM_SWITCH_COALESCE_MS)
+		delay = msecs_to_jiffies(BTM_SWITCH_COALESCE_MS);
+	btfmcodec_dev->last_switch_req = now;
+
+	if (delayed_work_pending(&btfmcodec_dev->wq_prepare_bearer)) {
+		BTFMCODEC_INFO("merging transport %d into pending %d", new_transport,
+			       btfmcodec_dev->status[idx]);
+		atomic_inc(&btfmcodec_dev->switch_coalesced);
+		atomic_set(&btfmcodec_dev->switch_merged, 1);
+		/* Not waited for, an indication answering this ack is dropped
+		 * as long as the request replacing it hasn't armed its wait.
+		 */
+		btfmcodec_frame_prepare_bearer_rsp_pkt(btfmcodec_dev,
+			btfmcodec_get_current_transport(&btfmcodec->states),
+			MSG_SUCCESS);
+	}
+
+	btfmcodec_dev->status[idx] = new_transport;
+	mod_delayed_work(btfmcodec_dev->workqueue, &btfmcodec_dev->wq_prepare_bearer,
+			 delay);
+}
+
 void btfmcodec_wq_prepare_bearer(struct work_struct *work)
 {
-	struct btfmcodec_char_device *btfmcodec_dev = container_of(work,
+	struct btfmcodec_char_device *btfmcodec_dev = container_of(to_delayed_work(work),
 						struct btfmcodec_char_device,
 						wq_prepare_bearer);
 	int idx = BTM_PKT_TYPE_PREPARE_REQ;
@@ -10,7 +10,8 @@ int btfmcodec_register_hw_ep (struct hwep_data *ep_info)
 {
 	struct btfmcodec_data *btfmcodec;
 	struct hwep_data *hwep_info;
-	int ret = 0;
+	unsigned long ids = 0;
+	int ret = 0, i, base, slot = -1;
 
 	btfmcodec = btfm_get_btfmcodec();
 	mutex_lock(&btfmcodec->hwep_drv_lock);
@@ -27,13 +28,40 @@ int btfmcodec_register_hw_ep (struct hwep_data *ep_info)
 
 	}
 
-	hwep_info = btfmcodec->hwep_info;
-	if (hwep_info) {
-		BTFMCODEC_ERR("driver already holds hardware endpoint info");
-		ret = -EPERM;
+	for (i = 0; i < BTM_MAX_HWEP; i++) {
+		hwep_info = btfmcodec->hwep[i].hwep_info;
+		if (!hwep_info) {
+			if (slot < 0)
+				slot = i;
+		} else if (!strncmp(hwep_info->driver_name, ep_info->driver_name,
+				    DEVICE_NAME_MAX_LEN)) {
+			BTFMCODEC_ERR("%s is already registered", ep_info->driver_name);
+			ret = -EPERM;
+			goto end;
+		}
+	}
+
+	if (slot < 0) {
+		BTFMCODEC_ERR("can't register more than %d hardware endpoints",
+			      BTM_MAX_HWEP);
+		ret = -EBUSY;
 		goto end;
 	}
 
+	/* DAI ids only need to be unique within a hw ep, each slot has its
+	 * own range of stream indices.
+	 */
+	base = slot * BTM_HWEP_MAX_DAI;
+	for (i = 0; i < ep_info->num_dai; i++) {
+		if (ep_info->dai_drv[i].id >= BTM_HWEP_MAX_DAI ||
+		    __test_and_set_bit(ep_info->dai_drv[i].id, &ids)) {
+			BTFMCODEC_ERR("dai id:%u of %s is invalid or used twice",
+				      ep_info->dai_drv[i].id, ep_info->driver_name);
+			ret = -EINVAL;
+			goto end;
+		}
+	}
+
 	hwep_info = kzalloc(sizeof(struct hwep_data), GFP_KERNEL);
 	if (!hwep_info) {
 		BTFMCODEC_ERR("%s: failed to allocate memory\n", __func__);
@@ -41,15 +69,30 @@ int btfmcodec_register_hw_ep (struct hwep_data *ep_info)
 		goto end;
 	}
 
-	btfmcodec->hwep_info = hwep_info;
+	btfmcodec->hwep[slot].hwep_info = hwep_info;
+	btfmcodec->hwep[slot].base = base;
 	memcpy(hwep_info, ep_info, sizeof(struct hwep_data));
 
 	BTFMCODEC_INFO("Below driver registered with btfm codec\n");
 	BTFMCODEC_INFO("Driver name: %s\n", hwep_info->driver_name);
 	BTFMCODEC_INFO("Num of dai: %d supported", hwep_info->num_dai);
-	BTFMCODEC_INFO("Master config enabled: %u\n", test_bit(BTADV_AUDIO_MASTER_CONFIG,
-		&hwep_info->flags));
-	ret = btfm_register_codec(hwep_info);
+	BTFMCODEC_INFO("Master config capable: %u dma config capable: %u\n",
+		test_bit(BTADV_CAP_MASTER_CONFIG, &hwep_info->flags),
+		test_bit(BTADV_CAP_CONFIGURE_DMA, &hwep_info->flags));
+	/* Registering the component may probe it right away, the DAIs must
+	 * already resolve to this hw ep.
+	 */
+	for (i = 0; i < hwep_info->num_dai; i++)
+		WRITE_ONCE(btfmcodec->dai_hwep[base + hwep_info->dai_drv[i].id],
+			   hwep_info);
+	ret = btfm_register_codec(&btfmcodec->hwep[slot]);
+	if (ret < 0) {
+		for (i = 0; i < hwep_info->num_dai; i++)
+			WRITE_ONCE(btfmcodec->dai_hwep[base + hwep_info->dai_drv[i].id],
+				   NULL);
+		btfmcodec->hwep[slot].hwep_info = NULL;
+		kfree(hwep_info);
+	}
 end:
 	mutex_unlock(&btfmcodec->hwep_drv_lock);
 	return ret;
@@ -58,8 +101,8 @@ end:
 int btfmcodec_unregister_hw_ep (char *driver_name)
 {
 	struct btfmcodec_data *btfmcodec;
-	struct hwep_data *hwep_info;
-	int ret;
+	struct hwep_data *hwep_info = NULL;
+	int ret, i, id;
 
 	btfmcodec = btfm_get_btfmcodec();
 	mutex_lock(&btfmcodec->hwep_drv_lock);
@@ -69,24 +112,29 @@ int btfmcodec_unregister_hw_ep (char *driver_name)
 		goto end;
 	}
 
-	hwep_info = btfmcodec->hwep_info;
-	if (!hwep_info) {
-		BTFMCODEC_ERR("%s: no active hardware endpoint registered\n", __func__);
-		ret = -EPERM;
-		goto end;
+	for (i = 0; i < BTM_MAX_HWEP; i++) {
+		hwep_info = btfmcodec->hwep[i].hwep_info;
+		if (hwep_info && !strncmp(hwep_info->driver_name, driver_name,
+					  DEVICE_NAME_MAX_LEN))
+			break;
 	}
 
-	if(!strncmp(hwep_info->driver_name, driver_name, DEVICE_NAME_MAX_LEN)) {
-		btfm_unregister_codec();
-		kfree(hwep_info);
-		BTFMCODEC_INFO("%s: deleted %s hardware endpoint\n", __func__, driver_name);
-		ret = -1;
-		goto end;
-	} else {
+	if (i == BTM_MAX_HWEP) {
 		BTFMCODEC_ERR("%s: No hardware endpoint registered with %s\n", __func__, driver_name);
 		ret = -1;
 		goto end;
 	}
+
+	/* Lingering ports are shut down through the dai lookup */
+	btfm_unregister_codec(&btfmcodec->hwep[i]);
+	for (id = 0; id < BTM_MAX_STREAMS; id++) {
+		if (btfmcodec->dai_hwep[id] == hwep_info)
+			WRITE_ONCE(btfmcodec->dai_hwep[id], NULL);
+	}
+	btfmcodec->hwep[i].hwep_info = NULL;
+	kfree(hwep_info);
+	BTFMCODEC_INFO("%s: deleted %s hardware endpoint\n", __func__, driver_name);
+	ret = 0;
 end:
 	mutex_unlock(&btfmcodec->hwep_drv_lock);
 	return ret;
@@ -10,23 +10,38 @@
 #include "btfm_codec_interface.h"
 #include "btfm_codec_pkt.h"
 #include "btfm_codec_btadv_interface.h"
+#include "btfm_codec_trace.h"
 
-static struct snd_soc_dai_driver *btfmcodec_dai_info;
 uint32_t bits_per_second;
 uint8_t num_channels;
 
+/* Each hw ep registers its own component, found through its DAIs */
+static struct hwep_data *btfmcodec_component_hwep(struct snd_soc_component *codec)
+{
+	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(codec);
+	struct snd_soc_dai *dai;
+
+	for_each_component_dais(codec, dai)
+		return btfmcodec_dai_to_hwep(btfmcodec, dai->id);
+	return NULL;
+}
+
 static int btfm_codec_get_mixer_control(struct snd_kcontrol *kcontrol,
 					struct snd_ctl_elem_value *ucontrol)
 {
 	struct snd_soc_component *codec = kcontrol->private_data;
-	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(codec);
-	struct hwep_data *hwepinfo = btfmcodec->hwep_info;
-	struct snd_kcontrol_new *mixer_ctrl = hwepinfo->mixer_ctrl;
+	struct hwep_data *hwepinfo = btfmcodec_component_hwep(codec);
+	struct snd_kcontrol_new *mixer_ctrl;
 	struct snd_ctl_elem_id id = kcontrol->id;
-	int num_mixer_ctrl = hwepinfo->num_mixer_ctrl;
+	int num_mixer_ctrl;
 	int i = 0;
 
 	BTFMCODEC_DBG("");
+	if (!hwepinfo)
+		return 0;
+
+	mixer_ctrl = hwepinfo->mixer_ctrl;
+	num_mixer_ctrl = hwepinfo->num_mixer_ctrl;
 	for (; i < num_mixer_ctrl ; i++) {
 		BTFMCODEC_DBG("checking mixer_ctrl:%s and current mixer:%s",
 			id.name, mixer_ctrl[i].name);
@@ -46,14 +61,18 @@ static int btfmcodec_put_mixer_control(struct snd_kcontrol *kcontrol,
 				     struct snd_ctl_elem_value *ucontrol)
 {
 	struct snd_soc_component *codec = kcontrol->private_data;
-	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(codec);
-	struct hwep_data *hwepinfo = btfmcodec->hwep_info;
-	struct snd_kcontrol_new *mixer_ctrl = hwepinfo->mixer_ctrl;
+	struct hwep_data *hwepinfo = btfmcodec_component_hwep(codec);
+	struct snd_kcontrol_new *mixer_ctrl;
 	struct snd_ctl_elem_id id = kcontrol->id;
-	int num_mixer_ctrl = hwepinfo->num_mixer_ctrl;
+	int num_mixer_ctrl;
 	int i = 0;
 
 	BTFMCODEC_DBG("");
+	if (!hwepinfo)
+		return 0;
+
+	mixer_ctrl = hwepinfo->mixer_ctrl;
+	num_mixer_ctrl = hwepinfo->num_mixer_ctrl;
 	for (; i < num_mixer_ctrl ; i++) {
 		BTFMCODEC_DBG("checking mixer_ctrl:%s and current mixer:%s",
 			id.name, mixer_ctrl[i].name);
@@ -72,10 +91,14 @@ static int btfmcodec_codec_probe(struct snd_soc_component *codec)
 {
 	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(codec);
 	struct btfmcodec_state_machine *state = &btfmcodec->states;
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
-	int num_mixer_ctrl = hwep_info->num_mixer_ctrl;
+	struct hwep_data *hwep_info = btfmcodec_component_hwep(codec);
+	int num_mixer_ctrl;
 	BTFMCODEC_DBG("");
 
+	if (!hwep_info)
+		return -ENODEV;
+
+	num_mixer_ctrl = hwep_info->num_mixer_ctrl;
 	// ToDo: check Whether probe has to allowed when state if different
 	if (btfmcodec_get_current_transport(state)!= IDLE) {
 		BTFMCODEC_WARN("Received probe when state is :%s",
@@ -115,9 +138,12 @@ static void btfmcodec_codec_remove(struct snd_soc_component *codec)
 {
 	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(codec);
 	struct btfmcodec_state_machine *state = &btfmcodec->states;
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_component_hwep(codec);
 	BTFMCODEC_DBG("");
 
+	if (!hwep_info)
+		return;
+
 	// ToDo: check whether remove has to allowed when state if different
 	if (btfmcodec_get_current_transport(state)!= IDLE) {
 		BTFMCODEC_WARN("Received probe when state is :%s",
@@ -132,9 +158,12 @@ static int btfmcodec_codec_write(struct snd_soc_component *codec,
 {
 	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(codec);
 	struct btfmcodec_state_machine *state = &btfmcodec->states;
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_component_hwep(codec);
 	BTFMCODEC_DBG("");
 
+	if (!hwep_info)
+		return 0;
+
 	// ToDo: check whether write has to allowed when state if different
 	if (btfmcodec_get_current_transport(state)!= IDLE) {
 		BTFMCODEC_WARN("Received probe when state is :%s",
@@ -151,9 +180,12 @@ static unsigned int btfmcodec_codec_read(struct snd_soc_component *codec,
 {
 	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(codec);
 	struct btfmcodec_state_machine *state = &btfmcodec->states;
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_component_hwep(codec);
 	BTFMCODEC_DBG("");
 
+	if (!hwep_info)
+		return 0;
+
 	// ToDo: check whether read has to allowed when state if different
 	if (btfmcodec_get_current_transport(state)!= IDLE) {
 		BTFMCODEC_WARN("Received probe when state is :%s",
@@ -179,51 +211,152 @@ static inline void * btfmcodec_get_dai_drvdata(struct hwep_data *hwep_info)
 	return hwep_info->dai_drv;
 }
 
-int btfmcodec_hwep_startup(struct btfmcodec_data *btfmcodec)
+bool btfmcodec_is_valid_cache_avb(struct btfmcodec_data *btfmcodec)
+{
+	return READ_ONCE(btfmcodec->config_mask) != 0;
+}
+
+/*
+ * btfmcodec_get_cached_config() - snapshot the cached config of a stream
+ * btfmcodec:	Pointer to the btfmcodec data.
+ * id:		stream id.
+ * config:	filled with a consistent copy of the cached config.
+ *
+ * Lockless, retries only if the entry was updated while being copied.
+ */
+static bool btfmcodec_get_cached_config(struct btfmcodec_data *btfmcodec,
+					uint8_t id, struct hwep_configurations *config)
+{
+	unsigned int seq;
+	bool valid;
+
+	if (id >= BTM_MAX_STREAMS)
+		return false;
+
+	do {
+		seq = read_seqbegin(&btfmcodec->config_lock);
+		valid = test_bit(id, &btfmcodec->config_mask);
+		*config = btfmcodec->configs[id];
+	} while (read_seqretry(&btfmcodec->config_lock, seq));
+
+	return valid;
+}
+
+static int btfmcodec_check_and_cache_configs(struct btfmcodec_data *btfmcodec,
+				   uint32_t sampling_rate, uint32_t direction,
+				   int id, uint8_t codectype)
 {
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_configurations *hwep_configs;
+
+	if (id < 0 || id >= BTM_MAX_STREAMS) {
+		BTFMCODEC_ERR("can't cache configs for dai id:%d", id);
+		return -EINVAL;
+	}
+
+	hwep_configs = &btfmcodec->configs[id];
+	write_seqlock(&btfmcodec->config_lock);
+	if (test_bit(id, &btfmcodec->config_mask))
+		BTFMCODEC_WARN("previous entry for %d is already available", id);
+
+	hwep_configs->btfmcodec = btfmcodec;
+	hwep_configs->stream_id = id; /* Stream identifier */
+	hwep_configs->sample_rate = sampling_rate;
+	hwep_configs->bit_width = bits_per_second;
+	hwep_configs->codectype = codectype;
+	hwep_configs->direction = direction;
+	hwep_configs->num_channels = num_channels;
+	set_bit(id, &btfmcodec->config_mask);
+	write_sequnlock(&btfmcodec->config_lock);
+
+	BTFMCODEC_INFO("added dai id:%d to list with sampling_rate :%u, direction:%u", id, sampling_rate, direction);
+	return 1;
+}
+
+static int btfmcodec_delete_configs(struct btfmcodec_data *btfmcodec, uint8_t id)
+{
+	int ret = -1;
+
+	if (id >= BTM_MAX_STREAMS)
+		return ret;
+
+	write_seqlock(&btfmcodec->config_lock);
+	if (test_and_clear_bit(id, &btfmcodec->config_mask)) {
+		BTFMCODEC_INFO("deleting configs with id %d", id);
+		ret = 1;
+	}
+	write_sequnlock(&btfmcodec->config_lock);
+
+	return ret;
+}
+
+int btfmcodec_hwep_startup(struct btfmcodec_data *btfmcodec, int id)
+{
+	struct hwep_data *hwep_info = btfmcodec_dai_to_hwep(btfmcodec, id);
 	struct hwep_dai_driver *dai_drv = (struct hwep_dai_driver *)
 					      btfmcodec_get_dai_drvdata(hwep_info);
 
 	if (dai_drv && dai_drv->dai_ops && dai_drv->dai_ops->hwep_startup) {
-		return dai_drv->dai_ops->hwep_startup((void *)btfmcodec->hwep_info);
+		return dai_drv->dai_ops->hwep_startup((void *)hwep_info);
 	} else {
 		return -1;
 	}
 }
 
+/*
+ * btfmcodec_linger_claim() - stop the linger timer of a reopened stream
+ * btfmcodec:	Pointer to the btfmcodec data.
+ * id:		stream id being opened.
+ *
+ * Called with dai_lock held. Returns true if the ports are still up,
+ * prepare then decides whether they can be reused.
+ */
+static bool btfmcodec_linger_claim(struct btfmcodec_data *btfmcodec, int id)
+{
+	if (id < 0 || id >= BTM_MAX_STREAMS ||
+	    !test_bit(id, &btfmcodec->linger_ids))
+		return false;
+
+	/* An expiry already running waits on dai_lock and backs off */
+	cancel_delayed_work(&btfmcodec->linger[id].work);
+	btfmcodec->linger[id].claimed = true;
+	return true;
+}
+
 static int btfmcodec_dai_startup(struct snd_pcm_substream *substream,
 		struct snd_soc_dai *dai)
 {
 	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(dai->component);
 	struct btfmcodec_state_machine *state = &btfmcodec->states;
+	int ret = 0;
 
 	BTFMCODEC_DBG("substream = %s  stream = %d dai->name = %s",
 		 substream->name, substream->stream, dai->name);
+	trace_btfmcodec_dai_startup(dai->id, substream->stream,
+				    btfmcodec_get_current_transport(state));
 
+	mutex_lock(&btfmcodec->dai_lock);
 	if (btfmcodec_get_current_transport(state) != IDLE &&
 		btfmcodec_get_current_transport(state) != BT_Connected) {
 		BTFMCODEC_DBG("Not allowing as state is:%s",
 			coverttostring(btfmcodec_get_current_transport(state)));
-	} else {
-		return btfmcodec_hwep_startup(btfmcodec);
+	} else if (!btfmcodec_linger_claim(btfmcodec, dai->id)) {
+		ret = btfmcodec_hwep_startup(btfmcodec, dai->id);
 	}
+	mutex_unlock(&btfmcodec->dai_lock);
 
-	return 0;
+	return ret;
 }
 
 int btfmcodec_hwep_shutdown(struct btfmcodec_data *btfmcodec, int id,
 			    bool disable_master)
 {
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_dai_to_hwep(btfmcodec, id);
 	struct btfmcodec_char_device *btfmcodec_dev = btfmcodec->btfmcodec_dev;
 	struct hwep_dai_driver *dai_drv = (struct hwep_dai_driver *)
 					      btfmcodec_get_dai_drvdata(hwep_info);
 	struct btfmcodec_state_machine *state = &btfmcodec->states;
 	struct btm_master_shutdown_req shutdown_req;
-	wait_queue_head_t *rsp_wait_q =
-			&btfmcodec_dev->rsp_wait_q[BTM_PKT_TYPE_MASTER_SHUTDOWN_RSP];
-	uint8_t *status = &btfmcodec_dev->status[BTM_PKT_TYPE_MASTER_SHUTDOWN_RSP];
+	struct btfmcodec_txn *txn;
 	int ret = 0;
 
 	/* for master configurations failure cases, we don't need to send
@@ -233,23 +366,23 @@ int btfmcodec_hwep_shutdown(struct btfmcodec_data *btfmcodec, int id,
 		BTFMCODEC_DBG("sending master shutdown request..");
 		shutdown_req.opcode = BTM_BTFMCODEC_MASTER_SHUTDOWN_REQ;
 		shutdown_req.len = BTM_MASTER_SHUTDOWN_REQ_LEN;
-		shutdown_req.stream_id = id;
-		/* See if we need to protect below with lock */
-		*status = BTM_WAITING_RSP;
-		btfmcodec_dev_enqueue_pkt(btfmcodec_dev, &shutdown_req, (shutdown_req.len +
-					BTM_HEADER_LEN));
-
-		ret = wait_event_interruptible_timeout(*rsp_wait_q,
-			(*status) != BTM_WAITING_RSP,
-			msecs_to_jiffies(BTM_MASTER_CONFIG_RSP_TIMEOUT));
-		if (ret == 0) {
-			BTFMCODEC_ERR("failed to recevie response from BTADV audio Manager");
+		shutdown_req.stream_id = btfmcodec_hwep_dai_id(id);
+		txn = btfmcodec_txn_start(btfmcodec_dev,
+					  BTM_BTFMCODEC_CTRL_MASTER_SHUTDOWN_RSP,
+					  shutdown_req.stream_id, id);
+		if (!txn) {
+			ret = -EBUSY;
+		} else if (btfmcodec_dev_enqueue_pkt(btfmcodec_dev, &shutdown_req,
+				(shutdown_req.len + BTM_HEADER_LEN)) < 0) {
+			/* No client to answer, nothing to wait for */
+			btfmcodec_txn_release(btfmcodec_dev, txn);
 		} else {
-			if (*status == BTM_RSP_RECV)
+			ret = btfmcodec_txn_wait(btfmcodec_dev, txn,
+						 BTM_MASTER_CONFIG_RSP_TIMEOUT);
+			if (ret == -ETIMEDOUT) {
+				BTFMCODEC_ERR("failed to recevie response from BTADV audio Manager");
 				ret = 0;
-			else if (*status == BTM_FAIL_RESP_RECV ||
-				 *status == BTM_RSP_NOT_RECV_CLIENT_KILLED)
-				ret = -1;
+			}
 		}
 	} else {
 		if (!disable_master)
@@ -260,35 +393,169 @@ int btfmcodec_hwep_shutdown(struct btfmcodec_data *btfmcodec, int id,
 	}
 
 	if (dai_drv && dai_drv->dai_ops && dai_drv->dai_ops->hwep_shutdown) {
-		dai_drv->dai_ops->hwep_shutdown((void *)btfmcodec->hwep_info, id);
+		dai_drv->dai_ops->hwep_shutdown((void *)hwep_info,
+						btfmcodec_hwep_dai_id(id));
 	}
 
 	return ret;
 }
 
+/*
+ * btfmcodec_linger_start() - defer the hwep shutdown of a closed stream
+ * btfmcodec:	Pointer to the btfmcodec data.
+ * id:		stream id being closed.
+ *
+ * Returns true if the ports are left up, they are shut down once linger_ms
+ * expires unless the stream is prepared again with the same config.
+ */
+static bool btfmcodec_linger_start(struct btfmcodec_data *btfmcodec, int id)
+{
+	struct btfmcodec_char_device *btfmcodec_dev = btfmcodec->btfmcodec_dev;
+	struct btfmcodec_linger *linger;
+	unsigned int linger_ms = READ_ONCE(btfmcodec->linger_ms);
+
+	if (id < 0 || id >= BTM_MAX_STREAMS)
+		return false;
+
+	linger = &btfmcodec->linger[id];
+	/* Reopened but closed again before prepare, ports still hold config */
+	if (test_bit(id, &btfmcodec->linger_ids)) {
+		linger->claimed = false;
+		queue_delayed_work(btfmcodec_dev->workqueue, &linger->work,
+				   msecs_to_jiffies(linger_ms));
+		return true;
+	}
+
+	if (!linger_ms || !btfmcodec_get_cached_config(btfmcodec, id, &linger->config))
+		return false;
+
+	linger->claimed = false;
+	set_bit(id, &btfmcodec->linger_ids);
+	queue_delayed_work(btfmcodec_dev->workqueue, &linger->work,
+			   msecs_to_jiffies(linger_ms));
+	BTFMCODEC_INFO("dai id:%d lingering for %u ms", id, linger_ms);
+	return true;
+}
+
+static void btfmcodec_linger_expire(struct work_struct *work)
+{
+	struct btfmcodec_linger *linger = container_of(to_delayed_work(work),
+						struct btfmcodec_linger, work);
+	struct btfmcodec_data *btfmcodec = linger->config.btfmcodec;
+	int id = linger->config.stream_id;
+
+	/* Serialize with the DAI ops running on the same hw ep */
+	mutex_lock(&btfmcodec->dai_lock);
+	if (linger->claimed || !test_and_clear_bit(id, &btfmcodec->linger_ids))
+		goto unlock;
+
+	BTFMCODEC_INFO("linger expired, shutting down dai id:%d", id);
+	atomic_inc(&btfmcodec->linger_miss);
+	btfmcodec_hwep_shutdown(btfmcodec, id, false);
+unlock:
+	mutex_unlock(&btfmcodec->dai_lock);
+}
+
+/*
+ * btfmcodec_linger_flush() - shut down all lingering ports right away
+ * btfmcodec:	Pointer to the btfmcodec data.
+ *
+ * Used when the ports can't be reused anymore, like on a bearer switch or
+ * an ADSP restart. Called with dai_lock held, an expiry waiting on it
+ * finds the bit cleared.
+ */
+static void btfmcodec_linger_flush(struct btfmcodec_data *btfmcodec)
+{
+	int id;
+
+	for (id = 0; id < BTM_MAX_STREAMS; id++) {
+		if (!test_and_clear_bit(id, &btfmcodec->linger_ids))
+			continue;
+		cancel_delayed_work(&btfmcodec->linger[id].work);
+		atomic_inc(&btfmcodec->linger_miss);
+		btfmcodec_hwep_shutdown(btfmcodec, id, false);
+	}
+}
+
+static int btfmcodec_hwep_standby(struct btfmcodec_data *btfmcodec, int id,
+				  bool standby)
+{
+	struct hwep_data *hwep_info = btfmcodec_dai_to_hwep(btfmcodec, id);
+	struct hwep_dai_driver *dai_drv = (struct hwep_dai_driver *)
+					      btfmcodec_get_dai_drvdata(hwep_info);
+
+	if (dai_drv && dai_drv->dai_ops && dai_drv->dai_ops->hwep_standby) {
+		return dai_drv->dai_ops->hwep_standby((void *)hwep_info,
+						      btfmcodec_hwep_dai_id(id),
+						      standby);
+	} else {
+		return -EOPNOTSUPP;
+	}
+}
+
+/*
+ * btfmcodec_hwep_enter_standby() - park BT hwep while BTADV audio is active
+ * btfmcodec:	Pointer to the btfmcodec data.
+ *
+ * With warm standby enabled, cached streams are only disabled on the hwep
+ * so that switching back to BT just re-enables them. Returns false if the
+ * streams have to be shut down the regular way.
+ */
+bool btfmcodec_hwep_enter_standby(struct btfmcodec_data *btfmcodec)
+{
+	unsigned long mask;
+	bool parked = true;
+	int ret, id;
+
+	if (!btfmcodec->warm_standby)
+		return false;
+
+	mutex_lock(&btfmcodec->dai_lock);
+	mask = READ_ONCE(btfmcodec->config_mask);
+	for_each_set_bit(id, &mask, BTM_MAX_STREAMS) {
+		ret = btfmcodec_hwep_standby(btfmcodec, id, true);
+		if (ret < 0) {
+			BTFMCODEC_ERR("failed to park dai id:%d in standby ret:%d",
+				      id, ret);
+			/* regular shutdown closes the parked streams as well */
+			btfmcodec->standby_ids = 0;
+			parked = false;
+			break;
+		}
+		set_bit(id, &btfmcodec->standby_ids);
+		BTFMCODEC_INFO("dai id:%d in warm standby", id);
+	}
+	mutex_unlock(&btfmcodec->dai_lock);
+
+	return parked;
+}
+
 void btfmcodec_wq_hwep_shutdown(struct work_struct *work)
 {
 	struct btfmcodec_char_device *btfmcodec_dev = container_of(work,
 						struct btfmcodec_char_device,
 						wq_hwep_shutdown);
 	struct btfmcodec_data *btfmcodec = (struct btfmcodec_data *)btfmcodec_dev->btfmcodec;
-	struct list_head *head = &btfmcodec->config_head;
-	struct hwep_configurations *hwep_configs = NULL, *tmp;
+	unsigned long mask;
 	int ret = -1;
-	int idx = BTM_PKT_TYPE_HWEP_SHUTDOWN;
+	int id, idx = BTM_PKT_TYPE_HWEP_SHUTDOWN;
 
 	BTFMCODEC_INFO(" starting shutdown");
+	mutex_lock(&btfmcodec->dai_lock);
+	btfmcodec_linger_flush(btfmcodec);
+	mask = READ_ONCE(btfmcodec->config_mask);
 	/* Just check if first Rx has to be closed first or
 	 * any order should be ok.
 	 */
-	list_for_each_entry_safe(hwep_configs, tmp, head, dai_list) {
-		BTFMCODEC_INFO("shuting down dai id:%d", hwep_configs->stream_id);
-		ret = btfmcodec_hwep_shutdown(btfmcodec, hwep_configs->stream_id, true);
+	for_each_set_bit(id, &mask, BTM_MAX_STREAMS) {
+		BTFMCODEC_INFO("shuting down dai id:%d", id);
+		ret = btfmcodec_hwep_shutdown(btfmcodec, id, true);
 		if (ret < 0) {
-			BTFMCODEC_ERR("failed to shutdown master with id %d", hwep_configs->stream_id);
+			BTFMCODEC_ERR("failed to shutdown master with id %d", id);
 			break;
 		}
 	}
+	mutex_unlock(&btfmcodec->dai_lock);
 
 	if (ret < 0)
 		btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
@@ -298,24 +565,6 @@ void btfmcodec_wq_hwep_shutdown(struct work_struct *work)
 	wake_up_interruptible(&btfmcodec_dev->rsp_wait_q[idx]);
 }
 
-static int btfmcodec_delete_configs(struct btfmcodec_data *btfmcodec, uint8_t id)
-{
-	struct list_head *head = &btfmcodec->config_head;
-	struct hwep_configurations *hwep_configs, *tmp;
-	int ret = -1;
-
-	list_for_each_entry_safe(hwep_configs, tmp, head, dai_list) {
-		if (hwep_configs->stream_id == id) {
-			BTFMCODEC_INFO("deleting configs with id %d", id);
-			list_del(&hwep_configs->dai_list);
-			ret = 1;
-			break;
-		}
-	}
-
-	return ret;
-}
-
 static void btfmcodec_dai_shutdown(struct snd_pcm_substream *substream,
 				 struct snd_soc_dai *dai)
 {
@@ -324,16 +573,27 @@ static void btfmcodec_dai_shutdown(struct snd_pcm_substream *substream,
 
 	BTFMCODEC_DBG("dai->name: %s, dai->id: %d, dai->rate: %d", dai->name,
 		dai->id, dai->rate);
+	trace_btfmcodec_dai_shutdown(dai->id, substream->stream,
+				     btfmcodec_get_current_transport(state));
+	btfmcodec_stats_close(btfmcodec, dai->id);
 
+	mutex_lock(&btfmcodec->dai_lock);
+	if (dai->id < BTM_MAX_STREAMS)
+		btfmcodec->substream[dai->id] = NULL;
 	if (btfmcodec_get_current_transport(state) != IDLE &&
 	    btfmcodec_get_current_transport(state) != BT_Connected) {
 		BTFMCODEC_WARN("not allowing shutdown as state is:%s",
 			coverttostring(btfmcodec_get_current_transport(state)));
+		/* Release ports held in warm standby for this stream */
+		if (dai->id < BTM_MAX_STREAMS &&
+		    test_and_clear_bit(dai->id, &btfmcodec->standby_ids))
+			btfmcodec_hwep_shutdown(btfmcodec, dai->id, false);
 		/* Delete stored configs */
 		btfmcodec_delete_configs(btfmcodec, dai->id);
 	} else {
 		/* first master shutdown has to done */
-		btfmcodec_hwep_shutdown(btfmcodec, dai->id, false);
+		if (!btfmcodec_linger_start(btfmcodec, dai->id))
+			btfmcodec_hwep_shutdown(btfmcodec, dai->id, false);
 		btfmcodec_delete_configs(btfmcodec, dai->id);
 		if (!btfmcodec_is_valid_cache_avb(btfmcodec))
 			btfmcodec_set_current_state(state, IDLE);
@@ -342,17 +602,18 @@ static void btfmcodec_dai_shutdown(struct snd_pcm_substream *substream,
 			btfmcodec_set_current_state(state, BT_Connected);
 		}
 	}
+	mutex_unlock(&btfmcodec->dai_lock);
 }
 
 int btfmcodec_hwep_hw_params (struct btfmcodec_data *btfmcodec, uint32_t bps,
-			      uint32_t direction, uint8_t num_channels)
+			      uint32_t direction, uint8_t num_channels, int id)
 {
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_dai_to_hwep(btfmcodec, id);
 	struct hwep_dai_driver *dai_drv = (struct hwep_dai_driver *)
 					      btfmcodec_get_dai_drvdata(hwep_info);
 
 	if (dai_drv && dai_drv->dai_ops && dai_drv->dai_ops->hwep_hw_params) {
-		return dai_drv->dai_ops->hwep_hw_params((void *)btfmcodec->hwep_info,
+		return dai_drv->dai_ops->hwep_hw_params((void *)hwep_info,
 							bps, direction,
 							num_channels);
 	} else {
@@ -367,89 +628,55 @@ static int btfmcodec_dai_hw_params(struct snd_pcm_substream *substream,
 	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(dai->component);
 	struct btfmcodec_state_machine *state = &btfmcodec->states;
 	uint32_t direction = substream->stream;
+	int ret = 0;
 
 	BTFMCODEC_DBG("dai->name = %s DAI-ID %x rate %d bps %d num_ch %d",
 		dai->name, dai->id, params_rate(params), params_width(params),
 		params_channels(params));
+	trace_btfmcodec_dai_hw_params(dai->id, direction,
+				      btfmcodec_get_current_transport(state));
 
+	mutex_lock(&btfmcodec->dai_lock);
 	bits_per_second = params_width(params);
 	num_channels = params_channels(params);
 	if (btfmcodec_get_current_transport(state) != IDLE &&
 		btfmcodec_get_current_transport(state) != BT_Connected) {
 		BTFMCODEC_WARN("caching bps and num_channels as state is :%s",
 			coverttostring(btfmcodec_get_current_transport(state)));
+	} else if (dai->id < BTM_MAX_STREAMS &&
+		   test_bit(dai->id, &btfmcodec->linger_ids)) {
+		/* Lingering ports are checked against these on prepare */
+		BTFMCODEC_DBG("dai id:%d is lingering", dai->id);
 	} else {
-		return btfmcodec_hwep_hw_params(btfmcodec, bits_per_second,
-						direction, num_channels);
+		ret = btfmcodec_hwep_hw_params(btfmcodec, bits_per_second,
+					       direction, num_channels, dai->id);
 	}
+	mutex_unlock(&btfmcodec->dai_lock);
 
-	return 0;
-}
-
-bool btfmcodec_is_valid_cache_avb(struct btfmcodec_data *btfmcodec)
-{
-	struct list_head *head = &btfmcodec->config_head;
-	struct hwep_configurations *hwep_configs, *tmp;
-	bool cache_avb = false;
-
-	list_for_each_entry_safe(hwep_configs, tmp, head, dai_list) {
-		cache_avb = true;
-		break;
-	}
-
-	return cache_avb;
-}
-
-static int btfmcodec_check_and_cache_configs(struct btfmcodec_data *btfmcodec,
-				   uint32_t sampling_rate, uint32_t direction,
-				   int id, uint8_t codectype)
-{
-	struct list_head *head = &btfmcodec->config_head;
-	struct hwep_configurations *hwep_configs, *tmp;
-
-	list_for_each_entry_safe(hwep_configs, tmp, head, dai_list) {
-		if (hwep_configs->stream_id == id) {
-			BTFMCODEC_WARN("previous entry for %d is already available",
-				id);
-			list_del(&hwep_configs->dai_list);
-		}
-	}
-
-	hwep_configs = kzalloc(sizeof(struct hwep_configurations),
-				GFP_KERNEL);
-	if (!hwep_configs) {
-		BTFMCODEC_ERR("failed to allocate memory");
-		return -ENOMEM;
-	}
-
-	hwep_configs->stream_id = id; /* Stream identifier */
-	hwep_configs->sample_rate = sampling_rate;
-	hwep_configs->bit_width = bits_per_second;
-	hwep_configs->codectype = codectype;
-	hwep_configs->direction = direction;
-	hwep_configs->num_channels = num_channels;
-
-	list_add(&hwep_configs->dai_list, head);
-	BTFMCODEC_INFO("added dai id:%d to list with sampling_rate :%u, direction:%u", id, sampling_rate, direction);
-	return 1;
+	return ret;
 }
 
-static int btfmcodec_configure_master(struct btfmcodec_data *btfmcodec, uint8_t id)
+/*
+ * btfmcodec_send_master_config() - send master config request for a stream
+ * btfmcodec:	Pointer to the btfmcodec data.
+ * id:		stream id to configure.
+ * txn:		filled with the transaction to wait on when the request is sent.
+ */
+static int btfmcodec_send_master_config(struct btfmcodec_data *btfmcodec, uint8_t id,
+					struct btfmcodec_txn **txn)
 {
 	struct btfmcodec_char_device *btfmcodec_dev = btfmcodec->btfmcodec_dev;
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_dai_to_hwep(btfmcodec, id);
 	struct master_hwep_configurations hwep_configs;
 	struct btm_master_config_req config_req;
 	struct hwep_dai_driver *dai_drv = (struct hwep_dai_driver *)
 					      btfmcodec_get_dai_drvdata(hwep_info);
-	wait_queue_head_t *rsp_wait_q =
-		&btfmcodec_dev->rsp_wait_q[BTM_PKT_TYPE_MASTER_CONFIG_RSP];
-	uint8_t *status = &btfmcodec_dev->status[BTM_PKT_TYPE_MASTER_CONFIG_RSP];
 	int ret = 0;
 
 	if (dai_drv && dai_drv->dai_ops && dai_drv->dai_ops->hwep_get_configs) {
-		dai_drv->dai_ops->hwep_get_configs((void *)btfmcodec->hwep_info,
-						   &hwep_configs, id);
+		dai_drv->dai_ops->hwep_get_configs((void *)hwep_info,
+						   &hwep_configs,
+						   btfmcodec_hwep_dai_id(id));
 	} else {
 		BTFMCODEC_ERR("No hwep_get_configs is set by hw ep driver");
 		return -1;
@@ -475,43 +702,36 @@ static int btfmcodec_configure_master(struct btfmcodec_data *btfmcodec, uint8_t
 	BTFMCODEC_DBG("dma_config_req.channel_num :%d", config_req.channel_num);
 	BTFMCODEC_DBG("dma_config_req.codec_id :%d", config_req.codec_id);
 	BTFMCODEC_DBG("================================================\n");
-	/* See if we need to protect below with lock */
-	*status = BTM_WAITING_RSP;
-	btfmcodec_dev_enqueue_pkt(btfmcodec_dev, &config_req, (config_req.len +
+	*txn = btfmcodec_txn_start(btfmcodec_dev, BTM_BTFMCODEC_MASTER_CONFIG_RSP,
+				   config_req.stream_id, id);
+	if (!*txn)
+		return -EBUSY;
+
+	ret = btfmcodec_dev_enqueue_pkt(btfmcodec_dev, &config_req, (config_req.len +
 				BTM_HEADER_LEN));
-	ret = wait_event_interruptible_timeout(*rsp_wait_q,
-		(*status) != BTM_WAITING_RSP,
-		msecs_to_jiffies(BTM_MASTER_CONFIG_RSP_TIMEOUT));
-	if (ret == 0) {
-		BTFMCODEC_ERR("failed to recevie response from BTADV audio Manager");
-		ret = -ETIMEDOUT;
-	} else {
-		if (*status == BTM_RSP_RECV)
-			return 0;
-		else if (*status == BTM_FAIL_RESP_RECV ||
-			 *status == BTM_RSP_NOT_RECV_CLIENT_KILLED)
-			return -1;
+	if (ret < 0) {
+		btfmcodec_txn_release(btfmcodec_dev, *txn);
+		*txn = NULL;
 	}
 
 	return ret;
 }
 
-static int btfmcodec_configure_dma(struct btfmcodec_data *btfmcodec, uint8_t id)
+static int btfmcodec_send_dma_config(struct btfmcodec_data *btfmcodec, uint8_t id,
+				     struct btfmcodec_txn **txn)
 {
 	struct btfmcodec_char_device *btfmcodec_dev = btfmcodec->btfmcodec_dev;
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_dai_to_hwep(btfmcodec, id);
 	struct hwep_dma_configurations dma_config;
 	struct btm_dma_config_req dma_config_req;
 	struct hwep_dai_driver *dai_drv = (struct hwep_dai_driver *)
 					      btfmcodec_get_dai_drvdata(hwep_info);
-	wait_queue_head_t *rsp_wait_q =
-		&btfmcodec_dev->rsp_wait_q[BTM_PKT_TYPE_DMA_CONFIG_RSP];
-	uint8_t *status = &btfmcodec_dev->status[BTM_PKT_TYPE_DMA_CONFIG_RSP];
 	int ret = 0;
 
 	if (dai_drv && dai_drv->dai_ops && dai_drv->dai_ops->hwep_get_configs) {
-		dai_drv->dai_ops->hwep_get_configs((void *)btfmcodec->hwep_info,
-						   &dma_config, id);
+		dai_drv->dai_ops->hwep_get_configs((void *)hwep_info,
+						   &dma_config,
+						   btfmcodec_hwep_dai_id(id));
 	} else {
 		BTFMCODEC_ERR("No hwep_get_configs is set by hw ep driver");
 		return -1;
@@ -541,68 +761,194 @@ static int btfmcodec_configure_dma(struct btfmcodec_data *btfmcodec, uint8_t id)
 	BTFMCODEC_DBG("dma_config_req.active_channel_mask :%d", dma_config_req.active_channel_mask);
 	BTFMCODEC_DBG("================================================\n");
 
-	*status = BTM_WAITING_RSP;
-	btfmcodec_dev_enqueue_pkt(btfmcodec_dev, &dma_config_req, (dma_config_req.len +
+	*txn = btfmcodec_txn_start(btfmcodec_dev, BTM_BTFMCODEC_CODEC_CONFIG_DMA_RSP,
+				   dma_config_req.stream_id, id);
+	if (!*txn)
+		return -EBUSY;
+
+	ret = btfmcodec_dev_enqueue_pkt(btfmcodec_dev, &dma_config_req, (dma_config_req.len +
 				BTM_HEADER_LEN));
+	if (ret < 0) {
+		btfmcodec_txn_release(btfmcodec_dev, *txn);
+		*txn = NULL;
+	}
+
+	return ret;
+}
+
+/* BTADV audio manager configures the stream when CP is supported by hwep */
+static bool btfmcodec_hwep_needs_config(struct hwep_data *hwep_info, int id)
+{
+	if (!hwep_info)
+		return false;
+	if (test_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags))
+		return true;
+	/* Don't send request to cp for fm as it is non cp */
+	if (test_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags) &&
+	    btfmcodec_hwep_dai_id(id) != 0)
+		return true;
+	return false;
+}
+
+static int btfmcodec_send_hwep_config(struct btfmcodec_data *btfmcodec, uint8_t id,
+				      struct btfmcodec_txn **txn)
+{
+	*txn = NULL;
+	if (test_bit(BTADV_AUDIO_MASTER_CONFIG,
+		     &btfmcodec_dai_to_hwep(btfmcodec, id)->flags))
+		return btfmcodec_send_master_config(btfmcodec, id, txn);
+	return btfmcodec_send_dma_config(btfmcodec, id, txn);
+}
 
-	ret = wait_event_interruptible_timeout(*rsp_wait_q,
-		(*status) != BTM_WAITING_RSP,
-		msecs_to_jiffies(BTM_MASTER_DMA_CONFIG_RSP_TIMEOUT));
+static unsigned int btfmcodec_config_rsp_timeout(struct btfmcodec_txn *txn)
+{
+	if (txn->rsp_opcode == BTM_BTFMCODEC_CODEC_CONFIG_DMA_RSP)
+		return BTM_MASTER_DMA_CONFIG_RSP_TIMEOUT;
+	return BTM_MASTER_CONFIG_RSP_TIMEOUT;
+}
+
+static int btfmcodec_wait_config_rsp(struct btfmcodec_data *btfmcodec,
+				     struct btfmcodec_txn *txn)
+{
+	int ret;
 
-	if (ret == 0) {
+	ret = btfmcodec_txn_wait(btfmcodec->btfmcodec_dev, txn,
+				 btfmcodec_config_rsp_timeout(txn));
+	if (ret == -ETIMEDOUT)
 		BTFMCODEC_ERR("failed to recevie response from BTADV audio Manager");
-		ret = -ETIMEDOUT;
-	} else {
-		if (*status == BTM_RSP_RECV)
-			return 0;
-		else if (*status == BTM_FAIL_RESP_RECV ||
-			 *status == BTM_RSP_NOT_RECV_CLIENT_KILLED)
-			return -1;
-	}
 
 	return ret;
 }
 
-int btfmcodec_hwep_prepare(struct btfmcodec_data *btfmcodec, uint32_t sampling_rate,
-			uint32_t direction, int id)
+static int btfmcodec_hwep_dai_prepare(struct btfmcodec_data *btfmcodec,
+				      uint32_t sampling_rate, uint32_t direction, int id)
 {
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_dai_to_hwep(btfmcodec, id);
 	struct hwep_dai_driver *dai_drv = (struct hwep_dai_driver *)
 					      btfmcodec_get_dai_drvdata(hwep_info);
-	struct btfmcodec_state_machine *state = &btfmcodec->states;
-
 	int ret;
+
 	if (dai_drv && dai_drv->dai_ops && dai_drv->dai_ops->hwep_prepare) {
 		ret = dai_drv->dai_ops->hwep_prepare((void *)hwep_info, sampling_rate,
-						      direction, id);
+						      direction,
+						      btfmcodec_hwep_dai_id(id));
 		BTFMCODEC_ERR("%s: hwep info %d", __func__, hwep_info->flags);
-		if (ret == 0 && test_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags)) {
-			ret = btfmcodec_configure_master(btfmcodec, (uint8_t)id);
-			if (ret < 0) {
-				BTFMCODEC_ERR("failed to configure master error %d", ret);
-				btfmcodec_set_current_state(state, IDLE);
-			} else {
-				btfmcodec_set_current_state(state, BT_Connected);
-			}
-		} else if (ret == 0 && test_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags)) {
-                        /* Don't send request to cp for fm as it is non cp */
-			if (id == 0)
-				return  ret;
-			ret  = btfmcodec_configure_dma(btfmcodec, (uint8_t)id);
-			if (ret < 0) {
-				BTFMCODEC_ERR("failed to configure Codec DMA %d", ret);
-				btfmcodec_set_current_state(state, IDLE);
-			} else {
-				btfmcodec_set_current_state(state, BT_Connected);
-			}
-		}
+		return ret;
 	} else {
 		return -1;
 	}
+}
+
+/* Completion of a config request sent in deferred start mode. Runs from
+ * the rx worker, so failures are handed to wq_config_failed which can
+ * take dai_lock.
+ */
+static void btfmcodec_deferred_config_done(void *priv, uint8_t id, int ret)
+{
+	struct btfmcodec_data *btfmcodec = priv;
+	struct btfmcodec_char_device *btfmcodec_dev = btfmcodec->btfmcodec_dev;
+
+	/* Stream was closed while the response was pending */
+	if (id >= BTM_MAX_STREAMS || !test_bit(id, &btfmcodec->config_mask))
+		return;
+
+	if (ret < 0) {
+		BTFMCODEC_ERR("failed to configure hwep %d error %d", id, ret);
+		set_bit(id, &btfmcodec->config_fail_ids);
+		queue_work(btfmcodec_dev->workqueue, &btfmcodec_dev->wq_config_failed);
+	} else if (!btfmcodec_set_current_state(&btfmcodec->states, BT_Connected)) {
+		/* Bearer switch away from BT shuts the ports down itself */
+		BTFMCODEC_ERR("dropping late config of hwep %d", id);
+	}
+}
+
+/* Send the config request of a prepared stream to BTADV audio manager */
+static int btfmcodec_hwep_start_config(struct btfmcodec_data *btfmcodec, int id)
+{
+	struct btfmcodec_state_machine *state = &btfmcodec->states;
+	struct btfmcodec_txn *txn;
+	int ret;
+
+	if (!btfmcodec_hwep_needs_config(btfmcodec_dai_to_hwep(btfmcodec, id), id))
+		return 0;
+
+	ret = btfmcodec_send_hwep_config(btfmcodec, (uint8_t)id, &txn);
+	if (ret == 0 && btfmcodec->deferred_start) {
+		/* Let ALSA go ahead, the response settles the state later */
+		btfmcodec_txn_wait_async(btfmcodec->btfmcodec_dev, txn,
+					 btfmcodec_config_rsp_timeout(txn),
+					 btfmcodec_deferred_config_done, btfmcodec);
+		return 0;
+	}
+	if (ret == 0)
+		ret = btfmcodec_wait_config_rsp(btfmcodec, txn);
+
+	if (ret < 0) {
+		BTFMCODEC_ERR("failed to configure hwep %d error %d", id, ret);
+		btfmcodec_set_current_state(state, IDLE);
+	} else if (!btfmcodec_set_current_state(state, BT_Connected)) {
+		/* Bearer switched away from BT while waiting for the response */
+		BTFMCODEC_ERR("not starting hwep %d as state is:%s", id,
+			coverttostring(btfmcodec_get_current_transport(state)));
+		ret = -EBUSY;
+	}
 
 	return ret;
 }
 
+int btfmcodec_hwep_prepare(struct btfmcodec_data *btfmcodec, uint32_t sampling_rate,
+			uint32_t direction, int id)
+{
+	int ret;
+
+	ret = btfmcodec_hwep_dai_prepare(btfmcodec, sampling_rate, direction, id);
+	if (ret != 0)
+		return ret;
+
+	return btfmcodec_hwep_start_config(btfmcodec, id);
+}
+
+/*
+ * btfmcodec_linger_reuse() - check the lingering ports of a stream on prepare
+ * btfmcodec:	Pointer to the btfmcodec data.
+ * id:		stream id being prepared.
+ * config:	config the stream is prepared with.
+ *
+ * Returns true if the ports are set up with the same config and can be
+ * used as is. Otherwise they are shut down and brought up again with
+ * the new hw params.
+ */
+static bool btfmcodec_linger_reuse(struct btfmcodec_data *btfmcodec, int id,
+				   struct hwep_configurations *config)
+{
+	struct hwep_configurations *live;
+
+	if (id < 0 || id >= BTM_MAX_STREAMS ||
+	    !test_and_clear_bit(id, &btfmcodec->linger_ids))
+		return false;
+
+	live = &btfmcodec->linger[id].config;
+	if (live->sample_rate == config->sample_rate &&
+	    live->codectype == config->codectype &&
+	    live->direction == config->direction &&
+	    live->bit_width == config->bit_width &&
+	    live->num_channels == config->num_channels) {
+		BTFMCODEC_INFO("reusing lingering ports of dai id:%d", id);
+		atomic_inc(&btfmcodec->linger_hit);
+		return true;
+	}
+
+	BTFMCODEC_INFO("config of dai id:%d changed, restarting hwep", id);
+	atomic_inc(&btfmcodec->linger_miss);
+	btfmcodec_hwep_shutdown(btfmcodec, id, false);
+	if (btfmcodec_hwep_startup(btfmcodec, id) < 0)
+		BTFMCODEC_ERR("failed to startup hwep %d", id);
+	else
+		btfmcodec_hwep_hw_params(btfmcodec, config->bit_width,
+					 config->direction, config->num_channels, id);
+	return false;
+}
+
 static int btfmcodec_notify_usecase_start(struct btfmcodec_data *btfmcodec,
 					  uint8_t transport)
 {
@@ -621,25 +967,41 @@ static int btfmcodec_dai_prepare(struct snd_pcm_substream *substream,
 {
 	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(dai->component);
 	struct btfmcodec_state_machine *state = &btfmcodec->states;
-	struct hwep_data *hwep_info = btfmcodec->hwep_info;
+	struct hwep_data *hwep_info = btfmcodec_dai_to_hwep(btfmcodec, dai->id);
 	struct hwep_dai_driver *dai_drv = (struct hwep_dai_driver *)
 					      btfmcodec_get_dai_drvdata(hwep_info);
-	uint8_t *codectype = dai_drv->dai_ops->hwep_codectype;
+	struct hwep_configurations config;
+	uint8_t *codectype;
 	uint32_t sampling_rate = dai->rate;
 	uint32_t direction = substream->stream;
 	int id = dai->id;
 	int ret ;
 
+	if (!dai_drv || !dai_drv->dai_ops)
+		return -ENODEV;
+	codectype = dai_drv->dai_ops->hwep_codectype;
+
 	BTFMCODEC_INFO("dai->name: %s, dai->id: %d, dai->rate: %d direction: %d",
 		dai->name, id, sampling_rate, direction);
+	trace_btfmcodec_dai_prepare(id, direction,
+				    btfmcodec_get_current_transport(state));
 
+	mutex_lock(&btfmcodec->dai_lock);
 	ret = btfmcodec_check_and_cache_configs(btfmcodec, sampling_rate,
 						direction, id, *codectype);
+	if (ret > 0)
+		btfmcodec->substream[id] = substream;
+	btfmcodec_stats_open(btfmcodec, id, sampling_rate, *codectype,
+			     bits_per_second);
 	if (btfmcodec_get_current_transport(state) != IDLE &&
 	    btfmcodec_get_current_transport(state) != BT_Connected) {
 		BTFMCODEC_WARN("cached required info as state is:%s",
 			coverttostring(btfmcodec_get_current_transport(state)));
 		btfmcodec_notify_usecase_start(btfmcodec, BTADV);
+	} else if (btfmcodec_get_cached_config(btfmcodec, id, &config) &&
+		   btfmcodec_linger_reuse(btfmcodec, id, &config)) {
+		/* Ports are live with this config, only BTADV needs it again */
+		ret = btfmcodec_hwep_start_config(btfmcodec, id);
 	} else {
 	        ret = btfmcodec_hwep_prepare(btfmcodec, sampling_rate, direction, id);
 /*		if (ret >= 0) {
@@ -647,6 +1009,7 @@ static int btfmcodec_dai_prepare(struct snd_pcm_substream *substream,
 						id, *codectype);
 		}
 */	}
+	mutex_unlock(&btfmcodec->dai_lock);
 
 	return ret;
 }
@@ -673,14 +1036,16 @@ static int btfmcodec_dai_set_channel_map(struct snd_soc_dai *dai,
 				unsigned int rx_num, unsigned int *rx_slot)
 {
 	struct btfmcodec_data *btfmcodec = snd_soc_component_get_drvdata(dai->component);
-	struct btfmcodec_state_machine states = btfmcodec->states;
+	struct btfmcodec_state_machine *state = &btfmcodec->states;
+	btfmcodec_state current_state = btfmcodec_get_current_transport(state);
 
 	BTFMCODEC_DBG("");
 	// ToDo: check whether hw_params has to allowed when state if different
-	if (states.current_state != IDLE) {
-		BTFMCODEC_WARN("Received probe when state is :%s", coverttostring(states.current_state));
+	if (current_state != IDLE) {
+		BTFMCODEC_WARN("Received probe when state is :%s", coverttostring(current_state));
 	} else {
-		return btfmcodec_hwep_set_channel_map((void *)btfmcodec->hwep_info, tx_num,
+		return btfmcodec_hwep_set_channel_map((void *)btfmcodec_dai_to_hwep(btfmcodec, dai->id),
+						   tx_num,
 						   tx_slot, rx_num, rx_slot);
 	}
 
@@ -716,47 +1081,127 @@ static int btfmcodec_dai_get_channel_map(struct snd_soc_dai *dai,
 /*	if (states.current_state != IDLE) {
 		BTFMCODEC_WARN("Received probe when state is :%s", coverttostring(states.current_state));
 	} else {
-*/		return btfmcodec_hwep_get_channel_map((void *)btfmcodec->hwep_info,
+*/		return btfmcodec_hwep_get_channel_map((void *)btfmcodec_dai_to_hwep(btfmcodec, dai->id),
 						   tx_num, tx_slot, rx_num,
-						   rx_slot, dai->id);
+						   rx_slot, btfmcodec_hwep_dai_id(dai->id));
 //	}
 
 	return 0;
 }
 
-void btfmcodec_wq_hwep_configure(struct work_struct *work)
+/*
+ * btfmcodec_configure_streams() - configure hwep for cached streams
+ * btfmcodec:	Pointer to the btfmcodec data.
+ * mask:	stream ids to configure.
+ *
+ * Every stream is brought up and its config request is sent before
+ * waiting on any response, so all streams are configured in a single round
+ * trip to BTADV audio manager. Streams held in warm standby are only
+ * re-enabled. If any stream fails, all streams brought up here are shut
+ * down again.
+ */
+static int btfmcodec_configure_streams(struct btfmcodec_data *btfmcodec,
+				       unsigned long mask)
 {
-	struct btfmcodec_char_device *btfmcodec_dev = container_of(work,
-						struct btfmcodec_char_device,
-						wq_hwep_configure);
-	struct btfmcodec_data *btfmcodec = (struct btfmcodec_data *)btfmcodec_dev->btfmcodec;
-	struct list_head *head = &btfmcodec->config_head;
-	struct hwep_configurations *hwep_configs = NULL, *tmp;
-	int ret;
-	int idx = BTM_PKT_TYPE_HWEP_CONFIG;
+	struct btfmcodec_state_machine *state = &btfmcodec->states;
+	struct hwep_configurations hwep_configs;
+	struct btfmcodec_txn *txn[BTM_MAX_STREAMS];
+	uint8_t stream_id[BTM_MAX_STREAMS];
+	bool need_config = false;
+	int ret = 0, err, i, started = 0;
 	uint32_t sample_rate, direction;
-	uint8_t id, bit_width, codectype, num_channels;
-
-	list_for_each_entry_safe(hwep_configs, tmp, head, dai_list) {
-		id = hwep_configs->stream_id;
-		sample_rate = hwep_configs->sample_rate;
-		bit_width = hwep_configs->bit_width;
-		codectype = hwep_configs->codectype;
-		direction = hwep_configs->direction;
-		num_channels = hwep_configs->num_channels;
+	uint8_t bit_width, codectype, num_channels;
+	int id;
+
+	for_each_set_bit(id, &mask, BTM_MAX_STREAMS) {
+		if (!btfmcodec_get_cached_config(btfmcodec, id, &hwep_configs))
+			continue;
+
+		sample_rate = hwep_configs.sample_rate;
+		bit_width = hwep_configs.bit_width;
+		codectype = hwep_configs.codectype;
+		direction = hwep_configs.direction;
+		num_channels = hwep_configs.num_channels;
+
+		if (test_and_clear_bit(id, &btfmcodec->standby_ids)) {
+			ret = btfmcodec_hwep_standby(btfmcodec, id, false);
+			if (ret == 0) {
+				BTFMCODEC_INFO("resumed dai id:%d from warm standby", id);
+				txn[started] = NULL;
+				stream_id[started++] = id;
+				continue;
+			}
+			BTFMCODEC_ERR("failed to resume dai id:%d, reconfiguring", id);
+			btfmcodec_hwep_shutdown(btfmcodec, id, false);
+		}
 
 		BTFMCODEC_INFO("configuring dai id:%d with sampling rate:%d bit_width:%d", id, sample_rate, bit_width);
-		ret = btfmcodec_hwep_startup(btfmcodec);
-		if (ret >= 0)
-			ret = btfmcodec_hwep_hw_params(btfmcodec, bit_width, direction, num_channels);
+		ret = btfmcodec_hwep_startup(btfmcodec, id);
+		if (ret < 0) {
+			BTFMCODEC_ERR("failed to startup hwep %d", id);
+			break;
+		}
+
+		txn[started] = NULL;
+		stream_id[started++] = id;
+		ret = btfmcodec_hwep_hw_params(btfmcodec, bit_width, direction,
+					       num_channels, id);
 		if (ret >= 0)
-			ret = btfmcodec_hwep_prepare(btfmcodec, sample_rate, direction, id);
+			ret = btfmcodec_hwep_dai_prepare(btfmcodec, sample_rate, direction, id);
+		if (ret == 0 && btfmcodec_hwep_needs_config(btfmcodec_dai_to_hwep(btfmcodec, id), id)) {
+			need_config = true;
+			ret = btfmcodec_send_hwep_config(btfmcodec, id, &txn[started - 1]);
+		}
 		if (ret < 0) {
-			BTFMCODEC_ERR("failed to configure hwep %d", hwep_configs->stream_id);
+			BTFMCODEC_ERR("failed to configure hwep %d", id);
 			break;
 		}
 	}
 
+	/* Collect every response, even after a failure, to free the slots */
+	for (i = 0; i < started; i++) {
+		if (!txn[i])
+			continue;
+		err = btfmcodec_wait_config_rsp(btfmcodec, txn[i]);
+		if (err < 0) {
+			BTFMCODEC_ERR("failed to configure hwep %d error %d",
+				      stream_id[i], err);
+			if (ret >= 0)
+				ret = err;
+		}
+	}
+
+	if (need_config) {
+		if (ret < 0)
+			btfmcodec_set_current_state(state, IDLE);
+		else if (!btfmcodec_set_current_state(state, BT_Connected))
+			/* State moved on meanwhile, ports can't be left up */
+			ret = -EBUSY;
+	}
+
+	if (ret < 0) {
+		for (i = 0; i < started; i++) {
+			BTFMCODEC_INFO("rolling back dai id:%d", stream_id[i]);
+			btfmcodec_hwep_shutdown(btfmcodec, stream_id[i], false);
+		}
+	}
+
+	return ret;
+}
+
+void btfmcodec_wq_hwep_configure(struct work_struct *work)
+{
+	struct btfmcodec_char_device *btfmcodec_dev = container_of(work,
+						struct btfmcodec_char_device,
+						wq_hwep_configure);
+	struct btfmcodec_data *btfmcodec = (struct btfmcodec_data *)btfmcodec_dev->btfmcodec;
+	int idx = BTM_PKT_TYPE_HWEP_CONFIG;
+	int ret;
+
+	mutex_lock(&btfmcodec->dai_lock);
+	ret = btfmcodec_configure_streams(btfmcodec,
+					  READ_ONCE(btfmcodec->config_mask));
+	mutex_unlock(&btfmcodec->dai_lock);
 	if (ret < 0)
 		btfmcodec_dev->status[idx] = BTM_FAIL_RESP_RECV;
 	else
@@ -773,6 +1218,100 @@ static struct snd_soc_dai_ops btfmcodec_dai_ops = {
 	.get_channel_map = btfmcodec_dai_get_channel_map,
 };
 
+/*
+ * btfmcodec_wq_config_failed() - stop streams whose deferred config failed
+ * work:	Pointer to the wq_config_failed work.
+ *
+ * Prepare already returned for these streams, so ALSA is told by moving
+ * them to XRUN. Like a failed synchronous prepare, the ports are left to
+ * the next prepare or the close of the stream.
+ */
+static void btfmcodec_wq_config_failed(struct work_struct *work)
+{
+	struct btfmcodec_char_device *btfmcodec_dev = container_of(work,
+						struct btfmcodec_char_device,
+						wq_config_failed);
+	struct btfmcodec_data *btfmcodec = (struct btfmcodec_data *)btfmcodec_dev->btfmcodec;
+	unsigned long mask = xchg(&btfmcodec->config_fail_ids, 0);
+	struct snd_pcm_substream *substream;
+	unsigned long flags;
+	int id;
+
+	mutex_lock(&btfmcodec->dai_lock);
+	for_each_set_bit(id, &mask, BTM_MAX_STREAMS) {
+		substream = btfmcodec->substream[id];
+		/* Closed meanwhile, shutdown took care of the ports */
+		if (!substream || !test_bit(id, &btfmcodec->config_mask))
+			continue;
+
+		btfmcodec_set_current_state(&btfmcodec->states, IDLE);
+		BTFMCODEC_ERR("stopping dai id:%d after late config failure", id);
+		snd_pcm_stream_lock_irqsave(substream, flags);
+		if (substream->runtime)
+			snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
+		snd_pcm_stream_unlock_irqrestore(substream, flags);
+	}
+	mutex_unlock(&btfmcodec->dai_lock);
+}
+
+/*
+ * btfmcodec_wq_ssr_recovery() - replay BT streams lost in an ADSP restart
+ * work:	Pointer to the wq_ssr_recovery work.
+ *
+ * Streams that were active on BT when LPASS went down and are still open
+ * are shut down and brought up again from the config cache, including the
+ * config request to BTADV audio manager, without waiting for userspace to
+ * re-drive the prepare sequence.
+ */
+static void btfmcodec_wq_ssr_recovery(struct work_struct *work)
+{
+	struct btfmcodec_char_device *btfmcodec_dev = container_of(work,
+						struct btfmcodec_char_device,
+						wq_ssr_recovery);
+	struct btfmcodec_data *btfmcodec = (struct btfmcodec_data *)btfmcodec_dev->btfmcodec;
+	struct btfmcodec_state_machine *state = &btfmcodec->states;
+	unsigned long mask = xchg(&btfmcodec->ssr_mask, 0);
+	int ret, id;
+
+	mutex_lock(&btfmcodec->dai_lock);
+	/* Lingering ports lost their setup as well */
+	btfmcodec_linger_flush(btfmcodec);
+	if (mask && btfmcodec_get_current_transport(state) != BT_Connected) {
+		BTFMCODEC_WARN("not recovering streams as state is:%s",
+			coverttostring(btfmcodec_get_current_transport(state)));
+		goto unlock;
+	}
+
+	/* Ports still hold the pre-SSR setup. Streams closed by ALSA since
+	 * the notification are already shut down, leave them alone.
+	 */
+	for_each_set_bit(id, &mask, BTM_MAX_STREAMS) {
+		if (!test_bit(id, &btfmcodec->config_mask)) {
+			__clear_bit(id, &mask);
+			continue;
+		}
+		btfmcodec_hwep_shutdown(btfmcodec, id, false);
+	}
+
+	if (!mask) {
+		BTFMCODEC_INFO("no streams to recover after SSR");
+		goto unlock;
+	}
+
+	ret = btfmcodec_configure_streams(btfmcodec, mask);
+	if (ret < 0) {
+		BTFMCODEC_ERR("failed to recover streams %lx after SSR error %d",
+			      mask, ret);
+		goto unlock;
+	}
+
+	btfmcodec_lat_record(&btfmcodec_dev->ssr_recovery_lat, btfmcodec->ssr_start);
+	BTFMCODEC_INFO("recovered streams %lx %lld ms after SSR", mask,
+		       ktime_ms_delta(ktime_get(), btfmcodec->ssr_start));
+unlock:
+	mutex_unlock(&btfmcodec->dai_lock);
+}
+
 static int btfmcodec_adsp_ssr_notify(struct notifier_block *nb,
 				    unsigned long action, void *data)
 {
@@ -784,6 +1323,12 @@ static int btfmcodec_adsp_ssr_notify(struct notifier_block *nb,
 	switch (action) {
 	case QCOM_SSR_BEFORE_SHUTDOWN: {
 		BTFMCODEC_WARN("LPASS SSR triggered");
+		/* Remember the streams configured on BT to replay them */
+		btfmcodec->ssr_start = ktime_get();
+		if (btfmcodec_get_current_transport(&btfmcodec->states) == BT_Connected)
+			WRITE_ONCE(btfmcodec->ssr_mask, READ_ONCE(btfmcodec->config_mask));
+		else
+			WRITE_ONCE(btfmcodec->ssr_mask, 0);
 		break;
 	} case QCOM_SSR_AFTER_SHUTDOWN: {
 		BTFMCODEC_WARN("LPASS SSR Completed");
@@ -799,6 +1344,9 @@ static int btfmcodec_adsp_ssr_notify(struct notifier_block *nb,
 		btfmcodec_dev_enqueue_pkt(btfmcodec_dev, &state_ind,
 				(state_ind.len +
 				BTM_HEADER_LEN));
+		if (READ_ONCE(btfmcodec->ssr_mask) || READ_ONCE(btfmcodec->linger_ids))
+			queue_work(btfmcodec_dev->workqueue,
+				   &btfmcodec_dev->wq_ssr_recovery);
 		break;
 	} default:
 		BTFMCODEC_WARN("unhandled action id %lu", action);
@@ -807,10 +1355,29 @@ static int btfmcodec_adsp_ssr_notify(struct notifier_block *nb,
 	return 0;
 }
 
-int btfm_register_codec(struct hwep_data *hwep_info)
+void btfmcodec_hwep_set_cp(struct hwep_data *hwep_info, bool cp)
 {
+	if (cp) {
+		if (test_bit(BTADV_CAP_MASTER_CONFIG, &hwep_info->flags))
+			set_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags);
+		else if (test_bit(BTADV_CAP_CONFIGURE_DMA, &hwep_info->flags))
+			set_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags);
+	} else {
+		clear_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags);
+		clear_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags);
+	}
+
+	BTFMCODEC_INFO("%s: master %d dma codec %d", hwep_info->driver_name,
+			(int)test_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags),
+			(int)test_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags));
+}
+
+int btfm_register_codec(struct btfmcodec_hwep *hwep)
+{
+	struct hwep_data *hwep_info = hwep->hwep_info;
 	struct btfmcodec_data *btfmcodec;
 	struct btfmcodec_char_device *btfmcodec_dev;
+	struct snd_soc_dai_driver *dai_info;
 	struct device *dev;
 	struct hwep_dai_driver *dai_drv;
 	int i, ret;
@@ -819,66 +1386,97 @@ int btfm_register_codec(struct hwep_data *hwep_info)
 	btfmcodec_dev = btfmcodec->btfmcodec_dev;
 	dev = &btfmcodec->dev;
 
-	btfmcodec->notifier.nb.notifier_call = btfmcodec_adsp_ssr_notify;
-	btfmcodec->notifier.notifier = qcom_register_ssr_notifier("lpass",
-					&btfmcodec->notifier.nb);
-	if (IS_ERR(btfmcodec->notifier.notifier)) {
-		ret = PTR_ERR(btfmcodec->notifier.notifier);
-		BTFMCODEC_ERR("Failed to register SSR notification: %d\n", ret);
-		return ret;
+	/* SSR notifier and works are shared by all hw eps */
+	if (!btfmcodec->notifier.notifier) {
+		btfmcodec->notifier.nb.notifier_call = btfmcodec_adsp_ssr_notify;
+		btfmcodec->notifier.notifier = qcom_register_ssr_notifier("lpass",
+						&btfmcodec->notifier.nb);
+		if (IS_ERR(btfmcodec->notifier.notifier)) {
+			ret = PTR_ERR(btfmcodec->notifier.notifier);
+			btfmcodec->notifier.notifier = NULL;
+			BTFMCODEC_ERR("Failed to register SSR notification: %d\n", ret);
+			return ret;
+		}
+
+		INIT_WORK(&btfmcodec_dev->wq_hwep_shutdown, btfmcodec_wq_hwep_shutdown);
+		INIT_DELAYED_WORK(&btfmcodec_dev->wq_prepare_bearer, btfmcodec_wq_prepare_bearer);
+		INIT_WORK(&btfmcodec_dev->wq_hwep_configure, btfmcodec_wq_hwep_configure);
+		INIT_WORK(&btfmcodec_dev->wq_ssr_recovery, btfmcodec_wq_ssr_recovery);
+		INIT_WORK(&btfmcodec_dev->wq_config_failed, btfmcodec_wq_config_failed);
+		for (i = 0; i < BTM_MAX_STREAMS; i++)
+			INIT_DELAYED_WORK(&btfmcodec->linger[i].work,
+					  btfmcodec_linger_expire);
 	}
 
-	btfmcodec_dai_info = kzalloc((sizeof(struct snd_soc_dai_driver) * hwep_info->num_dai), GFP_KERNEL);
-	if (!btfmcodec_dai_info) {
+	/* Own copy of the component driver so it can be unregistered alone */
+	hwep->comp_drv = kmemdup(&btfmcodec_codec_component,
+				 sizeof(btfmcodec_codec_component), GFP_KERNEL);
+	dai_info = kzalloc((sizeof(struct snd_soc_dai_driver) * hwep_info->num_dai), GFP_KERNEL);
+	if (!hwep->comp_drv || !dai_info) {
 		BTFMCODEC_ERR("failed to allocate memory");
+		kfree(hwep->comp_drv);
+		kfree(dai_info);
+		hwep->comp_drv = NULL;
 		return -ENOMEM;
 	}
+	/* All hw eps share the btfmcodec device, tell their components apart */
+	hwep->comp_drv->name = hwep_info->driver_name;
+#ifdef CONFIG_DEBUG_FS
+	hwep->comp_drv->debugfs_prefix = hwep_info->driver_name;
+#endif
 
 	for (i = 0; i < hwep_info->num_dai; i++) {
 		dai_drv = &hwep_info->dai_drv[i];
-		btfmcodec_dai_info[i].name = dai_drv->dai_name;
-		btfmcodec_dai_info[i].id = dai_drv->id;
-		btfmcodec_dai_info[i].capture = dai_drv->capture;
-		btfmcodec_dai_info[i].playback = dai_drv->playback;
-		btfmcodec_dai_info[i].ops = &btfmcodec_dai_ops;
-	}
-
-	BTFMCODEC_INFO("Adding %d dai support to codec", hwep_info->num_dai);
-	BTFMCODEC_INFO("slim bus driver name:%s", dev->driver->name);
-	ret = snd_soc_register_component(dev, &btfmcodec_codec_component,
-					btfmcodec_dai_info, hwep_info->num_dai);
-	BTFMCODEC_INFO("Dev node address: %p", dev);
-	BTFMCODEC_INFO("btfmcodec address :%p", btfmcodec);
-	BTFMCODEC_INFO("HWEPINFO address:%p", hwep_info);
-	BTFMCODEC_INFO("btfmcodec_dev INFO address:%p", btfmcodec->btfmcodec_dev);
-	BTFMCODEC_INFO("before wq_hwep_shutdown:%p", btfmcodec_dev->wq_hwep_shutdown);
-	BTFMCODEC_INFO("before wq_prepare_bearer:%p", btfmcodec_dev->wq_prepare_bearer);
-	INIT_WORK(&btfmcodec_dev->wq_hwep_shutdown, btfmcodec_wq_hwep_shutdown);
-	INIT_WORK(&btfmcodec_dev->wq_prepare_bearer, btfmcodec_wq_prepare_bearer);
-	INIT_WORK(&btfmcodec_dev->wq_hwep_configure, btfmcodec_wq_hwep_configure);
-	BTFMCODEC_INFO("after wq_hwep_shutdown:%p", btfmcodec_dev->wq_hwep_shutdown);
-	BTFMCODEC_INFO("after wq_prepare_bearer:%p", btfmcodec_dev->wq_prepare_bearer);
-	BTFMCODEC_INFO("btfmcodec_wq_prepare_bearer:%p", btfmcodec_wq_prepare_bearer);
-	BTFMCODEC_INFO("btfmcodec_wq_hwep_shutdown:%p", btfmcodec_wq_hwep_shutdown);
-
-	if (isCpSupported()) {
-		if (!strcmp(hwep_info->driver_name, "btfmslim"))
-			set_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags);
-		else if (!strcmp(hwep_info->driver_name, "btfmswr_slave"))
-			set_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags);
-
-	BTFMCODEC_INFO("%s: master %d dma codec %d", __func__,
-			(int)test_bit(BTADV_AUDIO_MASTER_CONFIG, &hwep_info->flags),
-			(int)test_bit(BTADV_CONFIGURE_DMA, &hwep_info->flags));
+		dai_info[i].name = dai_drv->dai_name;
+		dai_info[i].id = hwep->base + dai_drv->id;
+		dai_info[i].capture = dai_drv->capture;
+		dai_info[i].playback = dai_drv->playback;
+		dai_info[i].ops = &btfmcodec_dai_ops;
 	}
+	hwep->dai_info = dai_info;
+
+	BTFMCODEC_INFO("Adding %d dai support to codec for %s", hwep_info->num_dai,
+		       hwep_info->driver_name);
+	ret = snd_soc_register_component(dev, hwep->comp_drv, dai_info,
+					 hwep_info->num_dai);
+	if (ret < 0) {
+		BTFMCODEC_ERR("failed to register component for %s: %d",
+			      hwep_info->driver_name, ret);
+		kfree(hwep->comp_drv);
+		kfree(hwep->dai_info);
+		hwep->comp_drv = NULL;
+		hwep->dai_info = NULL;
+		return ret;
+	}
+
+	if (isCpSupported())
+		btfmcodec_hwep_set_cp(hwep_info, true);
 
 	return ret;
 }
 
-void btfm_unregister_codec(void)
+void btfm_unregister_codec(struct btfmcodec_hwep *hwep)
 {
+	struct hwep_data *hwep_info = hwep->hwep_info;
 	struct btfmcodec_data *btfmcodec;
+	int i, id;
 
 	btfmcodec = btfm_get_btfmcodec();
-	snd_soc_unregister_component(&btfmcodec->dev);
+	/* Ports can't be left lingering once the hw ep is gone */
+	mutex_lock(&btfmcodec->dai_lock);
+	for (i = 0; i < hwep_info->num_dai; i++) {
+		id = hwep->base + hwep_info->dai_drv[i].id;
+		if (id < 0 || id >= BTM_MAX_STREAMS)
+			continue;
+		if (!test_and_clear_bit(id, &btfmcodec->linger_ids))
+			continue;
+		cancel_delayed_work(&btfmcodec->linger[id].work);
+		btfmcodec_hwep_shutdown(btfmcodec, id, false);
+	}
+	mutex_unlock(&btfmcodec->dai_lock);
+	snd_soc_unregister_component_by_driver(&btfmcodec->dev, hwep->comp_drv);
+	kfree(hwep->comp_drv);
+	kfree(hwep->dai_info);
+	hwep->comp_drv = NULL;
+	hwep->dai_info = NULL;
 }
@@ -0,0 +1,1023 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ */
+
+/*
+ * KUnit tests for the btfmcodec driver. A fake hw ep is registered through
+ * btfmcodec_register_hw_ep() and a fake BTADV audio manager opens the char
+ * device and answers the driver from a script. The fake client works on
+ * the packet queues read() and write() go through, as KUnit has no
+ * userspace buffers to hand them.
+ */
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/completion.h>
+#include "btfm_codec.h"
+#include "btfm_codec_pkt.h"
+#include "btfm_codec_btadv_interface.h"
+
+#define BTM_TEST_HWEP_NAME	"btfmcodec-kunit"
+/* Same DAI ids as the slimbus hw ep, which may be registered as well */
+#define BTM_TEST_DAI_TX		1
+#define BTM_TEST_DAI_RX		2
+#define BTM_TEST_NUM_DAI	2
+#define BTM_TEST_DEVICE_ID	0x5a
+#define BTM_TEST_RATE		48000
+#define BTM_TEST_MAX_STEPS	8
+#define BTM_TEST_MAX_RECS	16
+/* Bound on waiting for the fake client, well below the driver timeouts */
+#define BTM_TEST_WAIT_MS	1000
+#define BTM_TEST_TIMEOUT_MS	100
+
+/* Calls made by the driver into the fake hw ep */
+struct btfmcodec_test_hwep {
+	atomic_t startup;
+	atomic_t hw_params;
+	atomic_t prepare;
+	atomic_t shutdown;
+	/* DAI ids the last prepare and shutdown were called with */
+	int prepare_id;
+	int shutdown_id;
+};
+
+static struct btfmcodec_test_hwep test_hwep;
+static uint8_t btfmcodec_test_codectype;
+
+static int btfmcodec_test_hwep_startup(void *hwep_info)
+{
+	atomic_inc(&test_hwep.startup);
+	return 0;
+}
+
+static void btfmcodec_test_hwep_shutdown(void *hwep_info, int id)
+{
+	WRITE_ONCE(test_hwep.shutdown_id, id);
+	atomic_inc(&test_hwep.shutdown);
+}
+
+static int btfmcodec_test_hwep_hw_params(void *hwep_info, uint32_t bps,
+					 uint32_t direction, uint8_t num_channels)
+{
+	atomic_inc(&test_hwep.hw_params);
+	return 0;
+}
+
+static int btfmcodec_test_hwep_prepare(void *hwep_info, uint32_t sampling_rate,
+				       uint32_t direction, int id)
+{
+	WRITE_ONCE(test_hwep.prepare_id, id);
+	atomic_inc(&test_hwep.prepare);
+	return 0;
+}
+
+static int btfmcodec_test_hwep_get_configs(void *hwep_info, void *data, uint8_t id)
+{
+	struct master_hwep_configurations *config = data;
+
+	config->stream_id = id;
+	config->device_id = BTM_TEST_DEVICE_ID;
+	config->sample_rate = BTM_TEST_RATE;
+	config->bit_width = 16;
+	config->num_channels = 1;
+	config->chan_num = 1;
+	config->codectype = btfmcodec_test_codectype;
+	config->direction = id == BTM_TEST_DAI_TX ? SNDRV_PCM_STREAM_CAPTURE :
+						    SNDRV_PCM_STREAM_PLAYBACK;
+	return 0;
+}
+
+static struct hwep_dai_ops btfmcodec_test_dai_ops = {
+	.hwep_startup = btfmcodec_test_hwep_startup,
+	.hwep_shutdown = btfmcodec_test_hwep_shutdown,
+	.hwep_hw_params = btfmcodec_test_hwep_hw_params,
+	.hwep_prepare = btfmcodec_test_hwep_prepare,
+	.hwep_get_configs = btfmcodec_test_hwep_get_configs,
+	.hwep_codectype = &btfmcodec_test_codectype,
+};
+
+static struct hwep_dai_driver btfmcodec_test_dai_driver[BTM_TEST_NUM_DAI] = {
+	{
+		.dai_name = "btfmcodec_kunit_tx",
+		.id = BTM_TEST_DAI_TX,
+		.capture = {
+			.stream_name = "BT KUnit Tx Capture",
+			.rates = SNDRV_PCM_RATE_48000,
+			.formats = SNDRV_PCM_FMTBIT_S16_LE,
+			.rate_max = BTM_TEST_RATE,
+			.rate_min = BTM_TEST_RATE,
+			.channels_min = 1,
+			.channels_max = 1,
+		},
+		.dai_ops = &btfmcodec_test_dai_ops,
+	},
+	{
+		.dai_name = "btfmcodec_kunit_rx",
+		.id = BTM_TEST_DAI_RX,
+		.playback = {
+			.stream_name = "BT KUnit Rx Playback",
+			.rates = SNDRV_PCM_RATE_48000,
+			.formats = SNDRV_PCM_FMTBIT_S16_LE,
+			.rate_max = BTM_TEST_RATE,
+			.rate_min = BTM_TEST_RATE,
+			.channels_min = 1,
+			.channels_max = 1,
+		},
+		.dai_ops = &btfmcodec_test_dai_ops,
+	},
+};
+
+static struct hwep_data btfmcodec_test_hwep_data = {
+	.driver_name = BTM_TEST_HWEP_NAME,
+	.dai_drv = btfmcodec_test_dai_driver,
+	.num_dai = BTM_TEST_NUM_DAI,
+	.flags = BIT(BTADV_CAP_MASTER_CONFIG),
+};
+
+enum btfmcodec_test_action {
+	/* answer with the reply packet */
+	BTM_TEST_REPLY = 0,
+	/* never answer */
+	BTM_TEST_DROP,
+	/* close the char device as if the client got killed */
+	BTM_TEST_KILL,
+};
+
+/*
+ * struct btfmcodec_test_step - how the fake client handles a packet
+ * opcode:	packet from the driver the step is for.
+ * action:	what the client does with it.
+ * reply:	opcode of the answer sent for BTM_TEST_REPLY.
+ * status:	status carried by the answer.
+ * delay_ms:	time the client takes before acting.
+ *
+ * Steps are used once, in order, by the packets with their opcode.
+ * Packets no step is left for are only recorded.
+ */
+struct btfmcodec_test_step {
+	btm_opcode opcode;
+	enum btfmcodec_test_action action;
+	btm_opcode reply;
+	uint8_t status;
+	unsigned int delay_ms;
+};
+
+/* Packet received by the fake client */
+struct btfmcodec_test_rec {
+	btm_opcode opcode;
+	/* first payload bytes: stream id, or transport and status */
+	uint8_t arg[2];
+	ktime_t stamp;
+};
+
+struct btfmcodec_test_client {
+	struct btfmcodec_data *btfmcodec;
+	struct btfmcodec_char_device *btfmcodec_dev;
+	/* what open() and release() get from the VFS */
+	struct inode inode;
+	struct file file;
+	bool open;
+	struct task_struct *task;
+	wait_queue_head_t wait;
+	/* protects the script and the records */
+	spinlock_t lock;
+	struct btfmcodec_test_step script[BTM_TEST_MAX_STEPS];
+	int nr_steps;
+	unsigned long used_steps;
+	struct btfmcodec_test_rec recs[BTM_TEST_MAX_RECS];
+	int nr_recs;
+	/* hw ep slot the fake hw ep got and its stream index base */
+	int slot;
+	int base;
+	/* ALSA side of the fake DAIs, indexed by DAI id */
+	const struct snd_soc_dai_ops *ops;
+	struct snd_soc_component component;
+	struct snd_soc_dai *dai[BTM_TEST_NUM_DAI + 1];
+	struct snd_pcm_substream *substream[BTM_TEST_NUM_DAI + 1];
+	/* driver settings changed for the test, restored on exit */
+	bool warm_standby;
+	unsigned int linger_ms;
+};
+
+static void btfmcodec_test_script(struct btfmcodec_test_client *client,
+				  const struct btfmcodec_test_step *steps, int nr_steps)
+{
+	spin_lock(&client->lock);
+	memcpy(client->script, steps, nr_steps * sizeof(*steps));
+	client->nr_steps = nr_steps;
+	client->used_steps = 0;
+	spin_unlock(&client->lock);
+}
+
+/*
+ * btfmcodec_test_send() - hand a packet to the driver
+ * client:	Pointer to the fake client.
+ * buf:		packet, header included.
+ * len:		length of the packet.
+ *
+ * Queues the packet for the rx worker the same way write() does.
+ */
+static int btfmcodec_test_send(struct btfmcodec_test_client *client, void *buf,
+			       uint32_t len)
+{
+	struct btfmcodec_char_device *btfmcodec_dev = client->btfmcodec_dev;
+	struct btfmcodec_pkt *pkt;
+	unsigned long flags;
+
+	if (!READ_ONCE(client->open) || len > BTM_MAX_PKT_LEN)
+		return -EINVAL;
+
+	pkt = mempool_alloc(btfmcodec_dev->pkt_pool, GFP_KERNEL);
+	if (!pkt)
+		return -ENOMEM;
+
+	memcpy(pkt->data, buf, len);
+	pkt->len = len;
+	pkt->stamp = ktime_get();
+	spin_lock_irqsave(&btfmcodec_dev->rx_queue_lock, flags);
+	list_add_tail(&pkt->list, &btfmcodec_dev->rxq);
+	spin_unlock_irqrestore(&btfmcodec_dev->rx_queue_lock, flags);
+	queue_work(btfmcodec_dev->rx_workqueue, &btfmcodec_dev->rx_work);
+	return 0;
+}
+
+static void btfmcodec_test_reply(struct btfmcodec_test_client *client,
+				 const struct btfmcodec_test_step *step,
+				 uint8_t stream_id)
+{
+	struct btm_bearer_switch_ind ind;
+	struct btm_config_rsp rsp;
+
+	if (step->reply == BTM_BTFMCODEC_BEARER_SWITCH_IND) {
+		ind.opcode = step->reply;
+		ind.len = BTM_PAYLOAD_LEN(struct btm_bearer_switch_ind);
+		ind.status = step->status;
+		btfmcodec_test_send(client, &ind, sizeof(ind));
+		return;
+	}
+
+	/* Config and shutdown responses echo the stream id */
+	rsp.opcode = step->reply;
+	rsp.len = BTM_PAYLOAD_LEN(struct btm_config_rsp);
+	rsp.stream_id = stream_id;
+	rsp.status = step->status;
+	btfmcodec_test_send(client, &rsp, sizeof(rsp));
+}
+
+static int btfmcodec_test_open(struct btfmcodec_test_client *client)
+{
+	int ret;
+
+	client->inode.i_cdev = &client->btfmcodec_dev->cdev;
+	client->file.f_mode = FMODE_READ | FMODE_WRITE;
+	ret = client->btfmcodec_dev->cdev.ops->open(&client->inode, &client->file);
+	if (!ret)
+		WRITE_ONCE(client->open, true);
+	return ret;
+}
+
+static void btfmcodec_test_close(struct btfmcodec_test_client *client)
+{
+	if (!client->open)
+		return;
+
+	client->btfmcodec_dev->cdev.ops->release(&client->inode, &client->file);
+	WRITE_ONCE(client->open, false);
+	wake_up(&client->wait);
+}
+
+static struct btfmcodec_pkt *btfmcodec_test_pop(struct btfmcodec_char_device *btfmcodec_dev)
+{
+	struct btfmcodec_pkt *pkt;
+	unsigned long flags;
+
+	spin_lock_irqsave(&btfmcodec_dev->tx_queue_lock, flags);
+	pkt = list_first_entry_or_null(&btfmcodec_dev->txq, struct btfmcodec_pkt, list);
+	if (pkt)
+		list_del(&pkt->list);
+	spin_unlock_irqrestore(&btfmcodec_dev->tx_queue_lock, flags);
+	return pkt;
+}
+
+static void btfmcodec_test_rx(struct btfmcodec_test_client *client,
+			      struct btfmcodec_pkt *pkt)
+{
+	struct btfmcodec_test_step step = {};
+	struct btfmcodec_test_rec *rec;
+	btm_opcode opcode;
+	bool found = false;
+	int i;
+
+	memcpy(&opcode, pkt->data, sizeof(opcode));
+	spin_lock(&client->lock);
+	if (client->nr_recs < BTM_TEST_MAX_RECS) {
+		rec = &client->recs[client->nr_recs++];
+		rec->opcode = opcode;
+		rec->arg[0] = pkt->data[BTM_HEADER_LEN];
+		rec->arg[1] = pkt->data[BTM_HEADER_LEN + 1];
+		rec->stamp = ktime_get();
+	}
+	for (i = 0; i < client->nr_steps; i++) {
+		if (test_bit(i, &client->used_steps) ||
+		    client->script[i].opcode != opcode)
+			continue;
+		__set_bit(i, &client->used_steps);
+		step = client->script[i];
+		found = true;
+		break;
+	}
+	spin_unlock(&client->lock);
+	wake_up(&client->wait);
+
+	if (!found)
+		return;
+
+	if (step.delay_ms)
+		msleep(step.delay_ms);
+
+	switch (step.action) {
+	case BTM_TEST_REPLY:
+		btfmcodec_test_reply(client, &step, pkt->data[BTM_HEADER_LEN]);
+		break;
+	case BTM_TEST_KILL:
+		btfmcodec_test_close(client);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Reads packets the driver queues for userspace and plays the script */
+static int btfmcodec_test_client_thread(void *data)
+{
+	struct btfmcodec_test_client *client = data;
+	struct btfmcodec_char_device *btfmcodec_dev = client->btfmcodec_dev;
+	struct btfmcodec_pkt *pkt;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(btfmcodec_dev->readq,
+			kthread_should_stop() || !list_empty(&btfmcodec_dev->txq));
+		while ((pkt = btfmcodec_test_pop(btfmcodec_dev))) {
+			btfmcodec_test_rx(client, pkt);
+			mempool_free(pkt, btfmcodec_dev->pkt_pool);
+		}
+	}
+
+	return 0;
+}
+
+/* nth packet with opcode received by the client, counting from 0 */
+static const struct btfmcodec_test_rec *btfmcodec_test_find(struct btfmcodec_test_client *client,
+							    btm_opcode opcode, int nth)
+{
+	const struct btfmcodec_test_rec *rec = NULL;
+	int i;
+
+	spin_lock(&client->lock);
+	for (i = 0; i < client->nr_recs; i++) {
+		if (client->recs[i].opcode == opcode && nth-- == 0) {
+			rec = &client->recs[i];
+			break;
+		}
+	}
+	spin_unlock(&client->lock);
+	return rec;
+}
+
+static const struct btfmcodec_test_rec *btfmcodec_test_wait(struct btfmcodec_test_client *client,
+							    btm_opcode opcode, int nth)
+{
+	const struct btfmcodec_test_rec *rec = NULL;
+
+	wait_event_timeout(client->wait,
+			   (rec = btfmcodec_test_find(client, opcode, nth)),
+			   msecs_to_jiffies(BTM_TEST_WAIT_MS));
+	return rec;
+}
+
+static void btfmcodec_test_wait_closed(struct btfmcodec_test_client *client)
+{
+	wait_event_timeout(client->wait, !READ_ONCE(client->open),
+			   msecs_to_jiffies(BTM_TEST_WAIT_MS));
+}
+
+/* Master config request for a stream of the fake hw ep, as sent on prepare */
+static int btfmcodec_test_config_req(struct btfmcodec_test_client *client,
+				     uint8_t dai_id)
+{
+	struct btm_master_config_req req = {
+		.opcode = BTM_BTFMCODEC_MASTER_CONFIG_REQ,
+		.len = BTM_MASTER_CONFIG_REQ_LEN,
+		.stream_id = dai_id,
+		.device_id = BTM_TEST_DEVICE_ID,
+		.sample_rate = BTM_TEST_RATE,
+		.bit_width = 16,
+		.num_channels = 1,
+		.channel_num = 1,
+	};
+
+	return btfmcodec_dev_enqueue_pkt(client->btfmcodec_dev, &req,
+					 req.len + BTM_HEADER_LEN);
+}
+
+/*
+ * btfmcodec_test_switch() - request a bearer switch as BTADV audio manager
+ * client:	Pointer to the fake client.
+ * transport:	transport to switch to.
+ *
+ * Returns the time in us until the driver is done with the switch,
+ * indication and hw ep reconfiguration included.
+ */
+static s64 btfmcodec_test_switch(struct btfmcodec_test_client *client,
+				 uint8_t transport)
+{
+	struct btfmcodec_char_device *btfmcodec_dev = client->btfmcodec_dev;
+	struct btm_prepare_bearer_req req;
+	ktime_t start;
+
+	req.opcode = BTM_BTFMCODEC_PREPARE_AUDIO_BEARER_SWITCH_REQ;
+	req.len = BTM_PAYLOAD_LEN(struct btm_prepare_bearer_req);
+	req.transport = transport;
+
+	start = ktime_get();
+	if (btfmcodec_test_send(client, &req, sizeof(req)) < 0)
+		return -EINVAL;
+	/* Dispatch queues the switch, which is then run without coalescing */
+	flush_work(&btfmcodec_dev->rx_work);
+	flush_delayed_work(&btfmcodec_dev->wq_prepare_bearer);
+	return ktime_us_delta(ktime_get(), start);
+}
+
+static struct snd_pcm_hw_params *btfmcodec_test_hw_params(struct kunit *test)
+{
+	struct snd_pcm_hw_params *params;
+	struct snd_mask *format;
+
+	params = kunit_kzalloc(test, sizeof(*params), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, params);
+
+	_snd_pcm_hw_params_any(params);
+	format = hw_param_mask(params, SNDRV_PCM_HW_PARAM_FORMAT);
+	snd_mask_none(format);
+	snd_mask_set_format(format, SNDRV_PCM_FORMAT_S16_LE);
+	hw_param_interval(params, SNDRV_PCM_HW_PARAM_CHANNELS)->min = 1;
+	hw_param_interval(params, SNDRV_PCM_HW_PARAM_CHANNELS)->max = 1;
+	hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE)->min = BTM_TEST_RATE;
+	hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE)->max = BTM_TEST_RATE;
+	return params;
+}
+
+/* Runs the ALSA startup, hw_params and prepare sequence on a fake DAI */
+static int btfmcodec_test_stream_open(struct kunit *test, int dai_id)
+{
+	struct btfmcodec_test_client *client = test->priv;
+	struct snd_pcm_substream *substream = client->substream[dai_id];
+	struct snd_soc_dai *dai = client->dai[dai_id];
+
+	KUNIT_ASSERT_EQ(test, client->ops->startup(substream, dai), 0);
+	KUNIT_ASSERT_EQ(test, client->ops->hw_params(substream,
+				btfmcodec_test_hw_params(test), dai), 0);
+	return client->ops->prepare(substream, dai);
+}
+
+static void btfmcodec_test_stream_close(struct btfmcodec_test_client *client,
+					int dai_id)
+{
+	client->ops->shutdown(client->substream[dai_id], client->dai[dai_id]);
+}
+
+static uint32_t btfmcodec_test_stats(struct btfmcodec_test_client *client,
+				     int dai_id, bool timeouts)
+{
+	struct btfmcodec_data *btfmcodec = client->btfmcodec;
+	struct btm_dai_stats *st = &btfmcodec->dai_stats[client->base + dai_id].stats;
+	uint32_t cnt;
+
+	spin_lock_irq(&btfmcodec->stats_lock);
+	cnt = timeouts ? st->timeout_cnt : st->config_cnt;
+	spin_unlock_irq(&btfmcodec->stats_lock);
+	return cnt;
+}
+
+static int btfmcodec_test_hwep_slot(struct btfmcodec_data *btfmcodec)
+{
+	struct hwep_data *hwep_info;
+	int i;
+
+	for (i = 0; i < BTM_MAX_HWEP; i++) {
+		hwep_info = btfmcodec->hwep[i].hwep_info;
+		if (hwep_info && !strncmp(hwep_info->driver_name, BTM_TEST_HWEP_NAME,
+					  DEVICE_NAME_MAX_LEN))
+			return i;
+	}
+	return -1;
+}
+
+static int btfmcodec_test_init(struct kunit *test)
+{
+	struct btfmcodec_data *btfmcodec = btfm_get_btfmcodec();
+	struct btfmcodec_char_device *btfmcodec_dev;
+	struct btfmcodec_test_client *client;
+	struct snd_soc_dai *dai;
+	int ret, i, id;
+
+	if (!btfmcodec || !btfmcodec->btfmcodec_dev)
+		kunit_skip(test, "btfmcodec is not initialized");
+	btfmcodec_dev = btfmcodec->btfmcodec_dev;
+	if (refcount_read(&btfmcodec_dev->active_clients) > 1)
+		kunit_skip(test, "BTADV audio manager is connected");
+	if (btfmcodec_get_current_transport(&btfmcodec->states) != IDLE ||
+	    READ_ONCE(btfmcodec->config_mask))
+		kunit_skip(test, "audio streams are active");
+
+	client = kunit_kzalloc(test, sizeof(*client), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, client);
+	client->btfmcodec = btfmcodec;
+	client->btfmcodec_dev = btfmcodec_dev;
+	init_waitqueue_head(&client->wait);
+	spin_lock_init(&client->lock);
+	/* DAI ops find btfmcodec through the drvdata of the component device */
+	client->component.dev = &btfmcodec->dev;
+	for (i = 0; i < BTM_TEST_NUM_DAI; i++) {
+		id = btfmcodec_test_dai_driver[i].id;
+		client->dai[id] = kunit_kzalloc(test, sizeof(*dai), GFP_KERNEL);
+		client->substream[id] = kunit_kzalloc(test,
+					sizeof(struct snd_pcm_substream), GFP_KERNEL);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, client->dai[id]);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, client->substream[id]);
+	}
+
+	memset(&test_hwep, 0, sizeof(test_hwep));
+	ret = btfmcodec_register_hw_ep(&btfmcodec_test_hwep_data);
+	if (ret == -EBUSY)
+		kunit_skip(test, "no free hw ep slot");
+	KUNIT_ASSERT_EQ(test, ret, 0);
+
+	client->slot = btfmcodec_test_hwep_slot(btfmcodec);
+	client->base = btfmcodec->hwep[client->slot].base;
+	client->ops = btfmcodec->hwep[client->slot].dai_info[0].ops;
+	for (i = 0; i < BTM_TEST_NUM_DAI; i++) {
+		id = btfmcodec_test_dai_driver[i].id;
+		dai = client->dai[id];
+		dai->name = btfmcodec_test_dai_driver[i].dai_name;
+		dai->id = client->base + id;
+		dai->rate = BTM_TEST_RATE;
+		dai->component = &client->component;
+		client->substream[id]->stream = id == BTM_TEST_DAI_TX ?
+			SNDRV_PCM_STREAM_CAPTURE : SNDRV_PCM_STREAM_PLAYBACK;
+	}
+
+	ret = btfmcodec_test_open(client);
+	if (ret) {
+		btfmcodec_unregister_hw_ep(btfmcodec_test_hwep_data.driver_name);
+		KUNIT_ASSERT_EQ(test, ret, 0);
+	}
+
+	client->task = kthread_run(btfmcodec_test_client_thread, client,
+				   "btfmcodec_kunit");
+	if (IS_ERR(client->task)) {
+		btfmcodec_test_close(client);
+		btfmcodec_unregister_hw_ep(btfmcodec_test_hwep_data.driver_name);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, client->task);
+	}
+
+	/* Streams are shut down right away and on every switch to BTADV */
+	client->warm_standby = btfmcodec->warm_standby;
+	client->linger_ms = btfmcodec->linger_ms;
+	btfmcodec->warm_standby = false;
+	WRITE_ONCE(btfmcodec->linger_ms, 0);
+	test->priv = client;
+	return 0;
+}
+
+static void btfmcodec_test_exit(struct kunit *test)
+{
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_data *btfmcodec;
+	int i, id;
+
+	if (!client)
+		return;
+
+	btfmcodec = client->btfmcodec;
+	kthread_stop(client->task);
+	/* Streams left open by a failed test */
+	for (i = 0; i < BTM_TEST_NUM_DAI; i++) {
+		id = btfmcodec_test_dai_driver[i].id;
+		if (test_bit(client->base + id, &btfmcodec->config_mask))
+			btfmcodec_test_stream_close(client, id);
+	}
+	btfmcodec_test_close(client);
+	btfmcodec_unregister_hw_ep(btfmcodec_test_hwep_data.driver_name);
+	btfmcodec->warm_standby = client->warm_standby;
+	WRITE_ONCE(btfmcodec->linger_ms, client->linger_ms);
+}
+
+static void btfmcodec_test_hwep_register(struct kunit *test)
+{
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_data *btfmcodec = client->btfmcodec;
+	struct btfmcodec_hwep *hwep = &btfmcodec->hwep[client->slot];
+	struct hwep_dai_driver dai_drv[BTM_TEST_NUM_DAI];
+	struct hwep_data dup = btfmcodec_test_hwep_data;
+	bool free_slot = false;
+	int i, ret;
+
+	KUNIT_EXPECT_EQ(test, client->base, client->slot * BTM_HWEP_MAX_DAI);
+	for (i = 0; i < BTM_TEST_NUM_DAI; i++) {
+		/* Stream index of the ALSA DAI maps back to the hw ep DAI id */
+		KUNIT_EXPECT_EQ(test, (int)hwep->dai_info[i].id,
+				client->base + btfmcodec_test_dai_driver[i].id);
+		KUNIT_EXPECT_PTR_EQ(test, btfmcodec_dai_to_hwep(btfmcodec,
+					hwep->dai_info[i].id), hwep->hwep_info);
+		KUNIT_EXPECT_EQ(test, btfmcodec_hwep_dai_id(hwep->dai_info[i].id),
+				(int)btfmcodec_test_dai_driver[i].id);
+	}
+
+	KUNIT_EXPECT_EQ(test, btfmcodec_register_hw_ep(&dup), -EPERM);
+
+	for (i = 0; i < BTM_MAX_HWEP; i++)
+		free_slot |= !btfmcodec->hwep[i].hwep_info;
+
+	/* DAI ids must be unique within a hw ep and fit its range */
+	strlcpy(dup.driver_name, BTM_TEST_HWEP_NAME "-dup", DEVICE_NAME_MAX_LEN);
+	memcpy(dai_drv, btfmcodec_test_dai_driver, sizeof(dai_drv));
+	dai_drv[1].id = dai_drv[0].id;
+	dup.dai_drv = dai_drv;
+	ret = btfmcodec_register_hw_ep(&dup);
+	KUNIT_EXPECT_EQ(test, ret, free_slot ? -EINVAL : -EBUSY);
+	if (!ret)
+		btfmcodec_unregister_hw_ep(dup.driver_name);
+
+	dai_drv[1].id = BTM_HWEP_MAX_DAI;
+	ret = btfmcodec_register_hw_ep(&dup);
+	KUNIT_EXPECT_EQ(test, ret, free_slot ? -EINVAL : -EBUSY);
+	if (!ret)
+		btfmcodec_unregister_hw_ep(dup.driver_name);
+}
+
+static void btfmcodec_test_dev_open(struct kunit *test)
+{
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_char_device *btfmcodec_dev = client->btfmcodec_dev;
+	struct inode *inode;
+	struct file *file;
+
+	inode = kunit_kzalloc(test, sizeof(*inode), GFP_KERNEL);
+	file = kunit_kzalloc(test, sizeof(*file), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, file);
+
+	/* Only one audio manager at a time, the error is returned positive */
+	inode->i_cdev = &btfmcodec_dev->cdev;
+	file->f_mode = FMODE_READ | FMODE_WRITE;
+	KUNIT_EXPECT_EQ(test, btfmcodec_dev->cdev.ops->open(inode, file), EACCES);
+	KUNIT_EXPECT_EQ(test, refcount_read(&btfmcodec_dev->active_clients), 2U);
+
+	/* Nothing is queued once the client is gone */
+	btfmcodec_test_close(client);
+	KUNIT_EXPECT_EQ(test, refcount_read(&btfmcodec_dev->active_clients), 1U);
+	KUNIT_EXPECT_EQ(test, btfmcodec_test_config_req(client, BTM_TEST_DAI_RX),
+			-EINVAL);
+}
+
+static void btfmcodec_test_txn_match(struct kunit *test)
+{
+	static const struct btfmcodec_test_step script[] = {
+		{ BTM_BTFMCODEC_MASTER_CONFIG_REQ, BTM_TEST_REPLY,
+		  BTM_BTFMCODEC_MASTER_CONFIG_RSP, MSG_FAILED },
+		{ BTM_BTFMCODEC_MASTER_CONFIG_REQ, BTM_TEST_REPLY,
+		  BTM_BTFMCODEC_MASTER_CONFIG_RSP, MSG_SUCCESS },
+	};
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_char_device *btfmcodec_dev = client->btfmcodec_dev;
+	struct btfmcodec_txn *rx, *tx;
+	uint32_t config_cnt = btfmcodec_test_stats(client, BTM_TEST_DAI_TX, false);
+
+	btfmcodec_test_script(client, script, ARRAY_SIZE(script));
+	rx = btfmcodec_txn_start(btfmcodec_dev, BTM_BTFMCODEC_MASTER_CONFIG_RSP,
+				 BTM_TEST_DAI_RX, client->base + BTM_TEST_DAI_RX);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, rx);
+	tx = btfmcodec_txn_start(btfmcodec_dev, BTM_BTFMCODEC_MASTER_CONFIG_RSP,
+				 BTM_TEST_DAI_TX, client->base + BTM_TEST_DAI_TX);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, tx);
+	/* One request per response opcode and stream id in flight */
+	KUNIT_EXPECT_PTR_EQ(test, btfmcodec_txn_start(btfmcodec_dev,
+				BTM_BTFMCODEC_MASTER_CONFIG_RSP, BTM_TEST_DAI_RX, 0),
+			    (struct btfmcodec_txn *)NULL);
+
+	/* Each response completes the request of the stream id it echoes */
+	KUNIT_ASSERT_EQ(test, btfmcodec_test_config_req(client, BTM_TEST_DAI_RX), 0);
+	KUNIT_ASSERT_EQ(test, btfmcodec_test_config_req(client, BTM_TEST_DAI_TX), 0);
+	KUNIT_EXPECT_EQ(test, btfmcodec_txn_wait(btfmcodec_dev, tx, BTM_TEST_WAIT_MS), 0);
+	KUNIT_EXPECT_EQ(test, btfmcodec_txn_wait(btfmcodec_dev, rx, BTM_TEST_WAIT_MS), -1);
+	KUNIT_EXPECT_EQ(test, btfmcodec_test_stats(client, BTM_TEST_DAI_TX, false),
+			config_cnt + 1);
+}
+
+struct btfmcodec_test_async {
+	struct completion done;
+	uint8_t id;
+	int ret;
+};
+
+static void btfmcodec_test_async_done(void *priv, uint8_t id, int ret)
+{
+	struct btfmcodec_test_async *async = priv;
+
+	async->id = id;
+	async->ret = ret;
+	complete(&async->done);
+}
+
+static void btfmcodec_test_txn_timeout(struct kunit *test)
+{
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_char_device *btfmcodec_dev = client->btfmcodec_dev;
+	int id = client->base + BTM_TEST_DAI_RX;
+	uint32_t timeouts = btfmcodec_test_stats(client, BTM_TEST_DAI_RX, true);
+	struct btfmcodec_test_async *async;
+	struct btfmcodec_txn *txn;
+
+	/* No script, requests are never answered */
+	txn = btfmcodec_txn_start(btfmcodec_dev, BTM_BTFMCODEC_MASTER_CONFIG_RSP,
+				  BTM_TEST_DAI_RX, id);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, txn);
+	KUNIT_ASSERT_EQ(test, btfmcodec_test_config_req(client, BTM_TEST_DAI_RX), 0);
+	KUNIT_EXPECT_EQ(test, btfmcodec_txn_wait(btfmcodec_dev, txn, BTM_TEST_TIMEOUT_MS),
+			-ETIMEDOUT);
+	KUNIT_EXPECT_NOT_ERR_OR_NULL(test,
+		btfmcodec_test_find(client, BTM_BTFMCODEC_MASTER_CONFIG_REQ, 0));
+
+	/* Deferred waits time out from the txn timeout worker. A failed test
+	 * has the callback run on release, before async is freed.
+	 */
+	async = kunit_kzalloc(test, sizeof(*async), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, async);
+	init_completion(&async->done);
+	txn = btfmcodec_txn_start(btfmcodec_dev, BTM_BTFMCODEC_MASTER_CONFIG_RSP,
+				  BTM_TEST_DAI_RX, id);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, txn);
+	KUNIT_ASSERT_EQ(test, btfmcodec_test_config_req(client, BTM_TEST_DAI_RX), 0);
+	btfmcodec_txn_wait_async(btfmcodec_dev, txn, BTM_TEST_TIMEOUT_MS,
+				 btfmcodec_test_async_done, async);
+	KUNIT_ASSERT_NE(test, wait_for_completion_timeout(&async->done,
+				msecs_to_jiffies(BTM_TEST_WAIT_MS)), 0UL);
+	KUNIT_EXPECT_EQ(test, async->ret, -ETIMEDOUT);
+	KUNIT_EXPECT_EQ(test, (int)async->id, id);
+	KUNIT_EXPECT_EQ(test, btfmcodec_test_stats(client, BTM_TEST_DAI_RX, true),
+			timeouts + 2);
+}
+
+static void btfmcodec_test_txn_killed(struct kunit *test)
+{
+	static const struct btfmcodec_test_step script[] = {
+		{ BTM_BTFMCODEC_MASTER_CONFIG_REQ, BTM_TEST_KILL, 0, 0, 20 },
+	};
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_char_device *btfmcodec_dev = client->btfmcodec_dev;
+	struct btfmcodec_txn *txn;
+	ktime_t start;
+
+	btfmcodec_test_script(client, script, ARRAY_SIZE(script));
+	txn = btfmcodec_txn_start(btfmcodec_dev, BTM_BTFMCODEC_MASTER_CONFIG_RSP,
+				  BTM_TEST_DAI_RX, client->base + BTM_TEST_DAI_RX);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, txn);
+	KUNIT_ASSERT_EQ(test, btfmcodec_test_config_req(client, BTM_TEST_DAI_RX), 0);
+
+	/* Release aborts the wait instead of letting it time out */
+	start = ktime_get();
+	KUNIT_EXPECT_EQ(test, btfmcodec_txn_wait(btfmcodec_dev, txn,
+			BTM_MASTER_CONFIG_RSP_TIMEOUT), -1);
+	KUNIT_EXPECT_LT(test, ktime_ms_delta(ktime_get(), start),
+			(s64)BTM_MASTER_CONFIG_RSP_TIMEOUT);
+	btfmcodec_test_wait_closed(client);
+	KUNIT_EXPECT_FALSE(test, READ_ONCE(client->open));
+	KUNIT_EXPECT_EQ(test, refcount_read(&btfmcodec_dev->active_clients), 1U);
+}
+
+static void btfmcodec_test_dai_prepare(struct kunit *test)
+{
+	static const struct btfmcodec_test_step script[] = {
+		{ BTM_BTFMCODEC_MASTER_CONFIG_REQ, BTM_TEST_REPLY,
+		  BTM_BTFMCODEC_MASTER_CONFIG_RSP, MSG_SUCCESS },
+	};
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_data *btfmcodec = client->btfmcodec;
+	int id = client->base + BTM_TEST_DAI_RX;
+	const struct btfmcodec_test_rec *rec;
+
+	if (!isCpSupported())
+		kunit_skip(test, "streams are not configured by BTADV audio manager");
+
+	btfmcodec_test_script(client, script, ARRAY_SIZE(script));
+	KUNIT_ASSERT_EQ(test, btfmcodec_test_stream_open(test, BTM_TEST_DAI_RX), 0);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			BT_Connected);
+	KUNIT_EXPECT_TRUE(test, test_bit(id, &btfmcodec->config_mask));
+	KUNIT_EXPECT_EQ(test, atomic_read(&test_hwep.startup), 1);
+	KUNIT_EXPECT_EQ(test, atomic_read(&test_hwep.hw_params), 1);
+	KUNIT_EXPECT_EQ(test, atomic_read(&test_hwep.prepare), 1);
+	/* hw ep and BTADV audio manager only know the DAI id */
+	KUNIT_EXPECT_EQ(test, READ_ONCE(test_hwep.prepare_id), BTM_TEST_DAI_RX);
+	rec = btfmcodec_test_find(client, BTM_BTFMCODEC_MASTER_CONFIG_REQ, 0);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, rec);
+	KUNIT_EXPECT_EQ(test, (int)rec->arg[0], BTM_TEST_DAI_RX);
+
+	btfmcodec_test_stream_close(client, BTM_TEST_DAI_RX);
+	KUNIT_EXPECT_EQ(test, atomic_read(&test_hwep.shutdown), 1);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(test_hwep.shutdown_id), BTM_TEST_DAI_RX);
+	KUNIT_EXPECT_FALSE(test, test_bit(id, &btfmcodec->config_mask));
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			IDLE);
+}
+
+static void btfmcodec_test_dai_prepare_killed(struct kunit *test)
+{
+	static const struct btfmcodec_test_step script[] = {
+		{ BTM_BTFMCODEC_MASTER_CONFIG_REQ, BTM_TEST_KILL },
+	};
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_data *btfmcodec = client->btfmcodec;
+
+	if (!isCpSupported())
+		kunit_skip(test, "streams are not configured by BTADV audio manager");
+
+	btfmcodec_test_script(client, script, ARRAY_SIZE(script));
+	KUNIT_EXPECT_LT(test, btfmcodec_test_stream_open(test, BTM_TEST_DAI_RX), 0);
+	btfmcodec_test_wait_closed(client);
+	KUNIT_EXPECT_FALSE(test, READ_ONCE(client->open));
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			IDLE);
+
+	btfmcodec_test_stream_close(client, BTM_TEST_DAI_RX);
+	KUNIT_EXPECT_EQ(test, atomic_read(&test_hwep.shutdown), 1);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(btfmcodec->config_mask), 0UL);
+}
+
+static void btfmcodec_test_bearer_switch(struct kunit *test)
+{
+	static const struct btfmcodec_test_step script[] = {
+		{ BTM_BTFMCODEC_MASTER_CONFIG_REQ, BTM_TEST_REPLY,
+		  BTM_BTFMCODEC_MASTER_CONFIG_RSP, MSG_SUCCESS },
+		{ BTM_BTFMCODEC_PREPARE_AUDIO_BEARER_SWITCH_RSP, BTM_TEST_REPLY,
+		  BTM_BTFMCODEC_BEARER_SWITCH_IND, MSG_SUCCESS },
+		{ BTM_BTFMCODEC_MASTER_CONFIG_REQ, BTM_TEST_REPLY,
+		  BTM_BTFMCODEC_MASTER_CONFIG_RSP, MSG_SUCCESS },
+	};
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_data *btfmcodec = client->btfmcodec;
+	struct btfmcodec_lat_hist *ind_lat =
+		&client->btfmcodec_dev->lat[BTM_LAT_OP_BEARER_IND][BTM_LAT_RTT];
+	int id = client->base + BTM_TEST_DAI_RX;
+	const struct btfmcodec_test_rec *rec;
+	int ind_cnt = atomic_read(&ind_lat->count);
+	s64 us;
+
+	if (!isCpSupported())
+		kunit_skip(test, "streams are not configured by BTADV audio manager");
+
+	btfmcodec_test_script(client, script, ARRAY_SIZE(script));
+	KUNIT_ASSERT_EQ(test, btfmcodec_test_stream_open(test, BTM_TEST_DAI_RX), 0);
+	KUNIT_ASSERT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			BT_Connected);
+
+	/* BT ports are closed once the indication confirms the switch */
+	us = btfmcodec_test_switch(client, BTADV);
+	KUNIT_EXPECT_GE(test, us, 0LL);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			BTADV_AUDIO_Connected);
+	rec = btfmcodec_test_wait(client, BTM_BTFMCODEC_PREPARE_AUDIO_BEARER_SWITCH_RSP, 0);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, rec);
+	KUNIT_EXPECT_EQ(test, (int)rec->arg[0], BTADV_AUDIO_Connecting);
+	KUNIT_EXPECT_EQ(test, (int)rec->arg[1], MSG_SUCCESS);
+	KUNIT_EXPECT_EQ(test, atomic_read(&ind_lat->count), ind_cnt + 1);
+	KUNIT_EXPECT_EQ(test, atomic_read(&test_hwep.shutdown), 1);
+	KUNIT_EXPECT_TRUE(test, test_bit(id, &btfmcodec->config_mask));
+	kunit_info(test, "BT -> BTADV switch took %lld us\n", us);
+
+	/* Switching back replays the cached stream config */
+	us = btfmcodec_test_switch(client, BT);
+	KUNIT_EXPECT_GE(test, us, 0LL);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			BT_Connected);
+	KUNIT_EXPECT_EQ(test, atomic_read(&test_hwep.startup), 2);
+	KUNIT_EXPECT_EQ(test, atomic_read(&test_hwep.prepare), 2);
+	rec = btfmcodec_test_wait(client, BTM_BTFMCODEC_MASTER_CONFIG_REQ, 1);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, rec);
+	KUNIT_EXPECT_EQ(test, (int)rec->arg[0], BTM_TEST_DAI_RX);
+	rec = btfmcodec_test_wait(client, BTM_BTFMCODEC_PREPARE_AUDIO_BEARER_SWITCH_RSP, 1);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, rec);
+	KUNIT_EXPECT_EQ(test, (int)rec->arg[0], BT_Connected);
+	kunit_info(test, "BTADV -> BT switch took %lld us\n", us);
+
+	btfmcodec_test_stream_close(client, BTM_TEST_DAI_RX);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			IDLE);
+}
+
+static void btfmcodec_test_bearer_switch_killed(struct kunit *test)
+{
+	static const struct btfmcodec_test_step script[] = {
+		{ BTM_BTFMCODEC_PREPARE_AUDIO_BEARER_SWITCH_RSP, BTM_TEST_KILL },
+	};
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_data *btfmcodec = client->btfmcodec;
+	s64 us;
+
+	btfmcodec_test_script(client, script, ARRAY_SIZE(script));
+	us = btfmcodec_test_switch(client, BTADV);
+	btfmcodec_test_wait_closed(client);
+	KUNIT_EXPECT_FALSE(test, READ_ONCE(client->open));
+	KUNIT_EXPECT_LT(test, us, BTM_MASTER_CONFIG_RSP_TIMEOUT * 1000LL);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			IDLE);
+}
+
+static void btfmcodec_test_bearer_switch_timeout(struct kunit *test)
+{
+	struct btfmcodec_test_client *client = test->priv;
+	struct btfmcodec_data *btfmcodec = client->btfmcodec;
+	const struct btfmcodec_test_rec *rec;
+	s64 us;
+
+	/* No script, the indication never comes */
+	us = btfmcodec_test_switch(client, BTADV);
+	kunit_info(test, "BT -> BTADV switch gave up after %lld us\n", us);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(&btfmcodec->states),
+			IDLE);
+	rec = btfmcodec_test_wait(client, BTM_BTFMCODEC_TRANSPORT_SWITCH_FAILED_IND, 0);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, rec);
+	KUNIT_EXPECT_EQ(test, (int)rec->arg[0], BTADV);
+	KUNIT_EXPECT_EQ(test, (int)rec->arg[1], MSG_INTERNAL_TIMEOUT);
+}
+
+static void btfmcodec_test_state_transitions(struct kunit *test)
+{
+	struct btfmcodec_state_machine *state;
+
+	state = kunit_kzalloc(test, sizeof(*state), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, state);
+	btfmcodec_reset_state(state);
+
+	KUNIT_EXPECT_TRUE(test, btfmcodec_set_current_state(state, BT_Connected));
+	/* Refused moves leave the state untouched */
+	KUNIT_EXPECT_FALSE(test, btfmcodec_set_current_state(state, BT_Connecting));
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(state), BT_Connected);
+
+	KUNIT_EXPECT_TRUE(test, btfmcodec_set_current_state(state,
+							    BTADV_AUDIO_Connecting));
+	btfmcodec_move_to_next_state(state);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(state),
+			BTADV_AUDIO_Connected);
+	KUNIT_EXPECT_FALSE(test, btfmcodec_set_current_state(state, BT_Connected));
+	KUNIT_EXPECT_FALSE(test, btfmcodec_set_current_state(state,
+							     BTADV_AUDIO_Connecting));
+
+	/* A failed switch back to BT restores BTADV audio */
+	KUNIT_EXPECT_TRUE(test, btfmcodec_set_current_state(state, BT_Connecting));
+	btfmcodec_revert_current_state(state);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(state),
+			BTADV_AUDIO_Connected);
+
+	KUNIT_EXPECT_TRUE(test, btfmcodec_set_current_state(state, BT_Connecting));
+	btfmcodec_move_to_next_state(state);
+	KUNIT_EXPECT_EQ(test, btfmcodec_get_current_transport(state), BT_Connected);
+	KUNIT_EXPECT_TRUE(test, btfmcodec_set_current_state(state, IDLE));
+}
+
+static struct kunit_case btfmcodec_state_test_cases[] = {
+	KUNIT_CASE(btfmcodec_test_state_transitions),
+	{}
+};
+
+static struct kunit_suite btfmcodec_state_test_suite = {
+	.name = "btfmcodec_state",
+	.test_cases = btfmcodec_state_test_cases,
+};
+
+static struct kunit_case btfmcodec_test_cases[] = {
+	KUNIT_CASE(btfmcodec_test_hwep_register),
+	KUNIT_CASE(btfmcodec_test_dev_open),
+	KUNIT_CASE(btfmcodec_test_txn_match),
+	KUNIT_CASE(btfmcodec_test_txn_timeout),
+	KUNIT_CASE(btfmcodec_test_txn_killed),
+	KUNIT_CASE(btfmcodec_test_dai_prepare),
+	KUNIT_CASE(btfmcodec_test_dai_prepare_killed),
+	KUNIT_CASE(btfmcodec_test_bearer_switch),
+	KUNIT_CASE(btfmcodec_test_bearer_switch_killed),
+	KUNIT_CASE(btfmcodec_test_bearer_switch_timeout),
+	{}
+};
+
+static struct kunit_suite btfmcodec_test_suite = {
+	.name = "btfmcodec",
+	.init = btfmcodec_test_init,
+	.exit = btfmcodec_test_exit,
+	.test_cases = btfmcodec_test_cases,
+};
+
+kunit_test_suites(&btfmcodec_state_test_suite, &btfmcodec_test_suite);
@@ -11,7 +11,12 @@
 #include <linux/printk.h>
 #include <linux/cdev.h>
 #include <linux/skbuff.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/mempool.h>
 #include "btfm_codec_hw_interface.h"
+#include "btfm_codec_ioctl.h"
 
 #define BTM_BTFMCODEC_DEFAULT_LOG_LVL        0x03
 #define BTM_BTFMCODEC_DEBUG_LOG_LVL          0x04
@@ -33,7 +38,6 @@ static uint8_t log_lvl = BTM_BTFMCODEC_DEFAULT_LOG_LVL;
 				    }
 
 #define DEVICE_NAME_MAX_LEN	64
-#define BTM_CP_UPDATE           0xbfaf
 
 typedef enum btfmcodec_states {
 	/*Default state of kernel proxy driver */
@@ -61,11 +65,132 @@ enum btfm_pkt_type {
 
 
 char *coverttostring(enum btfmcodec_states);
+
+/* Latency histogram, bucket i counts samples below btm_lat_bounds_us[i]
+ * and the last bucket counts everything above.
+ */
+#define BTM_LAT_BUCKETS		10
+
+enum btm_lat_op {
+	BTM_LAT_OP_MASTER_CONFIG = 0,
+	BTM_LAT_OP_DMA_CONFIG,
+	BTM_LAT_OP_SHUTDOWN,
+	BTM_LAT_OP_BEARER_IND,
+	BTM_LAT_OP_MAX,
+};
+
+enum btm_lat_stage {
+	/* request enqueued -> read by userspace */
+	BTM_LAT_QUEUE = 0,
+	/* request read by userspace -> response written */
+	BTM_LAT_CLIENT,
+	/* request enqueued -> response received */
+	BTM_LAT_RTT,
+	BTM_LAT_STAGE_MAX,
+};
+
+struct btfmcodec_lat_hist {
+	atomic_t bucket[BTM_LAT_BUCKETS];
+	atomic_t count;
+	atomic64_t sum_us;
+	atomic64_t max_us;
+};
+
+void btfmcodec_lat_record(struct btfmcodec_lat_hist *, ktime_t);
+
+/* prev, current and next state are packed in one word so that a
+ * transition is a single cmpxchg and reading the state never blocks.
+ */
+#define BTM_STATE_CUR_SHIFT	0
+#define BTM_STATE_PREV_SHIFT	8
+#define BTM_STATE_NEXT_SHIFT	16
+#define BTM_STATE_MASK		0xff
+#define BTM_STATE_PACK(prev, cur, next) \
+	(((prev) << BTM_STATE_PREV_SHIFT) | ((cur) << BTM_STATE_CUR_SHIFT) | \
+	 ((next) << BTM_STATE_NEXT_SHIFT))
+#define BTM_STATE_CUR(w)	(((w) >> BTM_STATE_CUR_SHIFT) & BTM_STATE_MASK)
+#define BTM_STATE_PREV(w)	(((w) >> BTM_STATE_PREV_SHIFT) & BTM_STATE_MASK)
+#define BTM_STATE_NEXT(w)	(((w) >> BTM_STATE_NEXT_SHIFT) & BTM_STATE_MASK)
+
 struct btfmcodec_state_machine {
-	struct mutex state_machine_lock;
-	btfmcodec_state prev_state;
-	btfmcodec_state current_state;
-	btfmcodec_state next_state;
+	atomic_t state_word;
+	/* time at which current state was entered, for dwell times */
+	atomic64_t entered_ns;
+	struct btfmcodec_lat_hist dwell[BTADV_AUDIO_Connected + 1];
+};
+
+static inline void btfmcodec_reset_state(struct btfmcodec_state_machine *state)
+{
+	atomic_set(&state->state_word, BTM_STATE_PACK(IDLE, IDLE, IDLE));
+	atomic64_set(&state->entered_ns, ktime_get_ns());
+}
+
+/* Stream indices, shared out between hw eps, see BTM_HWEP_MAX_DAI */
+#define BTM_MAX_STREAMS         8
+
+/* Maximum number of requests that can wait for a response at a time */
+#define BTM_MAX_TXN             8
+
+/* Called with the stream index of the request and the result
+ * btfmcodec_txn_wait() would have returned.
+ */
+typedef void (*btfmcodec_txn_cb)(void *priv, uint8_t id, int ret);
+
+/* Outstanding request to BTADV audio manager. A response completes the
+ * transaction whose response opcode and stream id match it, so requests
+ * for different streams can be in flight together.
+ */
+struct btfmcodec_txn {
+	bool in_use;
+	uint32_t seq;
+	uint32_t rsp_opcode;
+	/* stream id on the wire, the DAI id known by the hw ep */
+	uint8_t stream_id;
+	/* stream index the request is for */
+	uint8_t id;
+	uint8_t status;
+	ktime_t t_start;
+	/* time userspace read the request, 0 until then */
+	ktime_t t_read;
+	/* set for transactions completed through a callback */
+	btfmcodec_txn_cb complete;
+	void *priv;
+	unsigned long deadline;
+};
+
+struct btfmcodec_ring {
+	struct btm_ring_hdr *hdr;
+	uint8_t *data;
+};
+
+#define BTM_MAX_OBSERVERS       4
+#define BTM_OBSERVER_BUF_SIZE   4096
+
+/* Read-only client, fed a copy of every packet. It never blocks the
+ * primary client, records that don't fit in buf are dropped and counted.
+ */
+struct btfmcodec_observer {
+	struct list_head list;
+	struct btfmcodec_char_device *btfmcodec_dev;
+	spinlock_t lock;
+	wait_queue_head_t readq;
+	/* free running, wrap on BTM_OBSERVER_BUF_SIZE */
+	uint32_t head;
+	uint32_t tail;
+	uint32_t dropped;
+	uint8_t buf[BTM_OBSERVER_BUF_SIZE];
+};
+
+/* struct btm_dai_stats is userspace ABI, see btfm_codec_ioctl.h */
+static_assert(BTM_STATS_NR_STREAMS == BTM_MAX_STREAMS);
+static_assert(BTM_STATS_NR_STATES == BTADV_AUDIO_Connected + 1);
+static_assert(sizeof(struct btm_dai_stats) == 80);
+
+struct btfmcodec_dai_stats {
+	struct btm_dai_stats stats;
+	bool open;
+	/* state times of the state machine when the stream was opened */
+	s64 state_base_us[BTADV_AUDIO_Connected + 1];
 };
 
 struct btfmcodec_char_device {
@@ -75,19 +200,85 @@ struct btfmcodec_char_device {
 	int reuse_minor;
 	char dev_name[DEVICE_NAME_MAX_LEN];
 	struct workqueue_struct *workqueue;
-	struct sk_buff_head rxq;
+	/* high priority ordered queue dedicated to rx dispatch */
+	struct workqueue_struct *rx_workqueue;
+	/* btfmcodec_pkt from userspace, protected by rx_queue_lock */
+	spinlock_t rx_queue_lock;
+	struct list_head rxq;
 	struct work_struct rx_work;
+	/* write() -> rx worker dispatch delay */
+	struct btfmcodec_lat_hist rx_queue_lat;
 	struct work_struct wq_hwep_shutdown;
-	struct work_struct wq_prepare_bearer;
+	struct delayed_work wq_prepare_bearer;
+	/* bearer switch coalescing, see btfmcodec_queue_prepare_bearer() */
+	ktime_t last_switch_req;
+	atomic_t switch_merged;
+	/* Bearer switch indications carry no bearer, only the first one
+	 * received after an ack that waits for it is passed on. Protected
+	 * by switch_lock.
+	 */
+	spinlock_t switch_lock;
+	bool switch_ind_armed;
+	atomic_t switch_coalesced;
+	atomic_t switch_avoided;
 	struct work_struct wq_hwep_configure;
+	struct work_struct wq_ssr_recovery;
+	struct work_struct wq_config_failed;
+	/* ADSP SSR -> streams replayed */
+	struct btfmcodec_lat_hist ssr_recovery_lat;
 	wait_queue_head_t readq;
 	spinlock_t tx_queue_lock;
-	struct sk_buff_head txq;
+	/* btfmcodec_pkt towards userspace, protected by tx_queue_lock */
+	struct list_head txq;
+	struct kmem_cache *pkt_cache;
+	mempool_t *pkt_pool;
 	wait_queue_head_t rsp_wait_q[BTM_PKT_TYPE_MAX];
 	uint8_t status[BTM_PKT_TYPE_MAX];
+	spinlock_t txn_lock;
+	uint32_t txn_seq;
+	struct btfmcodec_txn txn[BTM_MAX_TXN];
+	wait_queue_head_t txn_wait_q;
+	struct delayed_work txn_timeout_work;
+	/* mmap'd rings, valid only while ring_mapped is set */
+	void *ring_buf;
+	struct btfmcodec_ring tx_ring;
+	struct btfmcodec_ring rx_ring;
+	bool ring_mapped;
+	/* multiple packets per read()/write() when set */
+	bool batch_mode;
+	spinlock_t observers_lock;
+	struct list_head observers;
+	int num_observers;
+	struct btfmcodec_lat_hist lat[BTM_LAT_OP_MAX][BTM_LAT_STAGE_MAX];
+	struct dentry *debugfs;
 	void *btfmcodec;
 };
 
+/* Hardware endpoint drivers that can be registered at a time */
+#define BTM_MAX_HWEP            2
+/* Stream indices are split evenly between the hw ep slots. DAIs of the hw
+ * ep in slot n get index n * BTM_HWEP_MAX_DAI + their own DAI id, so hw eps
+ * using the same DAI ids can be registered together.
+ */
+#define BTM_HWEP_MAX_DAI        (BTM_MAX_STREAMS / BTM_MAX_HWEP)
+
+struct btfmcodec_hwep {
+	struct hwep_data *hwep_info;
+	struct snd_soc_component_driver *comp_drv;
+	struct snd_soc_dai_driver *dai_info;
+	/* stream index of DAI id 0 of this hw ep */
+	int base;
+};
+
+/* Ports of a closed stream kept up for a while in case it is reopened */
+struct btfmcodec_linger {
+	struct delayed_work work;
+	/* config the ports are set up with */
+	struct hwep_configurations config;
+	/* stream reopened, the ports wait for its prepare. Under dai_lock */
+	bool claimed;
+};
+
 struct adsp_notifier {
 	void *notifier;
 	struct notifier_block nb;
@@ -97,12 +288,69 @@ struct btfmcodec_data {
 	struct device dev;
 	struct btfmcodec_state_machine states;
 	struct btfmcodec_char_device *btfmcodec_dev;
-	struct hwep_data *hwep_info;
-	struct list_head config_head;
+	/* Registered hw eps, updated under hwep_drv_lock */
+	struct btfmcodec_hwep hwep[BTM_MAX_HWEP];
+	/* stream index -> hw ep owning it */
+	struct hwep_data *dai_hwep[BTM_MAX_STREAMS];
+	/* Cached stream configs indexed by stream id. Writers serialize on
+	 * config_lock, readers snapshot an entry with the seqlock sequence
+	 * as generation counter and never block.
+	 */
+	seqlock_t config_lock;
+	unsigned long config_mask;
+	struct hwep_configurations configs[BTM_MAX_STREAMS];
 	struct adsp_notifier notifier;
 	struct mutex hwep_drv_lock;
+	/* Serializes the ALSA DAI ops with the works bringing streams up or
+	 * down behind their back: bearer switch and SSR recovery. Never
+	 * taken from the rx worker, holders wait on it for responses.
+	 */
+	struct mutex dai_lock;
+	/* Keep BT hwep prepared but disabled while BTADV audio is active */
+	bool warm_standby;
+	/* stream ids currently held in warm standby */
+	unsigned long standby_ids;
+	/* Don't block ALSA prepare on the config response */
+	bool deferred_start;
+	spinlock_t stats_lock;
+	struct btfmcodec_dai_stats dai_stats[BTM_MAX_STREAMS];
+	/* Delay before the ports of a closed stream are shut down, 0 disables */
+	unsigned int linger_ms;
+	/* stream ids whose ports are lingering */
+	unsigned long linger_ids;
+	struct btfmcodec_linger linger[BTM_MAX_STREAMS];
+	atomic_t linger_hit;
+	atomic_t linger_miss;
+	/* BT streams active when LPASS went down, replayed once it is back.
+	 * Set by the SSR notifier, taken with xchg() by the recovery work.
+	 */
+	unsigned long ssr_mask;
+	ktime_t ssr_start;
+	/* stream id -> substream prepared on it, updated under dai_lock */
+	struct snd_pcm_substream *substream[BTM_MAX_STREAMS];
+	/* Deferred start streams whose config failed after prepare returned.
+	 * Set by the response callback, taken with xchg() by wq_config_failed.
+	 */
+	unsigned long config_fail_ids;
 };
 
+static inline struct hwep_data *btfmcodec_dai_to_hwep(struct btfmcodec_data *btfmcodec,
+						      int id)
+{
+	if (id < 0 || id >= BTM_MAX_STREAMS)
+		return NULL;
+	return READ_ONCE(btfmcodec->dai_hwep[id]);
+}
+
+/* DAI id of a stream index as known by the hw ep owning it */
+static inline int btfmcodec_hwep_dai_id(int id)
+{
+	return id % BTM_HWEP_MAX_DAI;
+}
+
 struct btfmcodec_data *btfm_get_btfmcodec(void);
 bool isCpSupported(void);
+void btfmcodec_hwep_set_cp(struct hwep_data *, bool);
+void btfmcodec_stats_open(struct btfmcodec_data *, int, uint32_t, uint8_t, uint8_t);
+void btfmcodec_stats_close(struct btfmcodec_data *, int);
 #endif /*__LINUX_BTFM_CODEC_H */
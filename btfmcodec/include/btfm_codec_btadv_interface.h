@@ -14,7 +14,9 @@ enum transport_type {
 
 static char *transport_type_text[] = {"BT", "BTADV", "NONE"};
 
-void btfmcodec_set_current_state(struct btfmcodec_state_machine *, btfmcodec_state);
+bool btfmcodec_set_current_state(struct btfmcodec_state_machine *, btfmcodec_state);
+void btfmcodec_move_to_next_state(struct btfmcodec_state_machine *);
+void btfmcodec_revert_current_state(struct btfmcodec_state_machine *);
 void btfmcodec_wq_prepare_bearer(struct work_struct *);
 void btfmcodec_wq_hwep_shutdown(struct work_struct *);
 void btfmcodec_initiate_hwep_shutdown(struct btfmcodec_char_device *btfmcodec_dev);
@@ -19,6 +19,11 @@
  */
 #define BTADV_AUDIO_MASTER_CONFIG	0
 #define BTADV_CONFIGURE_DMA             1
+/* Capabilities set in flags by the hw ep driver before registering. They
+ * tell which of the above is enabled when the target supports CP.
+ */
+#define BTADV_CAP_MASTER_CONFIG		2
+#define BTADV_CAP_CONFIGURE_DMA		3
 #define DEVICE_NAME_MAX_LEN	64
 
 struct hwep_configurations {
@@ -29,7 +34,6 @@ struct hwep_configurations {
 	uint8_t codectype;
 	uint32_t direction;
 	uint8_t num_channels;
-	struct list_head dai_list;
 };
 
 struct master_hwep_configurations {
@@ -72,6 +76,10 @@ struct hwep_dai_ops {
 	int (*hwep_get_channel_map)(void *, unsigned int *, unsigned int *,
 				unsigned int *, unsigned int *, int);
 	int (*hwep_get_configs)(void *a, void *b, uint8_t c);
+	/* Optional: disable (true) or re-enable (false) a prepared stream
+	 * while keeping its port allocation and stream configuration.
+	 */
+	int (*hwep_standby)(void *, int, bool);
 	uint8_t *hwep_codectype;
 };
 
@@ -7,6 +7,8 @@
 #define __LINUX_BTFM_CODEC_INTERFACE
 
 #include "btfm_codec_hw_interface.h"
-int btfm_register_codec(struct hwep_data *hwep_info);
-void btfm_unregister_codec(void);
+struct btfmcodec_hwep;
+
+int btfm_register_codec(struct btfmcodec_hwep *hwep);
+void btfm_unregister_codec(struct btfmcodec_hwep *hwep);
 #endif /*__LINUX_BTFM_CODEC_INTERFACE */
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ */
+
+#ifndef _UAPI_LINUX_BTFM_CODEC_IOCTL_H
+#define _UAPI_LINUX_BTFM_CODEC_IOCTL_H
+
+#include <linux/types.h>
+
+/* ioctls of the btfmcodec char device */
+#define BTM_CP_UPDATE           0xbfaf
+#define BTM_RING_RX_KICK        0xbfb0
+#define BTM_BATCH_MODE          0xbfb1
+#define BTM_WARM_STANDBY        0xbfb2
+#define BTM_DEFERRED_START      0xbfb3
+#define BTM_GET_STATS           0xbfb4
+#define BTM_SHUTDOWN_LINGER     0xbfb5
+
+/* Upper bound for the hwep shutdown linger set through BTM_SHUTDOWN_LINGER */
+#define BTM_MAX_LINGER_MS       5000
+
+/* Number of struct btm_dai_stats BTM_GET_STATS copies, one per stream */
+#define BTM_STATS_NR_STREAMS    8
+/* IDLE, BT_Connecting, BT_Connected, BTADV_AUDIO_Connecting, BTADV_AUDIO_Connected */
+#define BTM_STATS_NR_STATES     5
+
+/* Per stream statistics, every field is naturally aligned */
+struct btm_dai_stats {
+	__u32 prepare_cnt;
+	__u32 shutdown_cnt;
+	__u32 sample_rate;
+	__u8 codectype;
+	__u8 bit_width;
+	__u8 reserved[2];
+	/* time spent in each state machine state while the stream was open */
+	__u64 state_time_us[BTM_STATS_NR_STATES];
+	__u32 config_cnt;
+	__u32 config_rtt_min_us;
+	__u32 config_rtt_max_us;
+	__u32 timeout_cnt;
+	__u64 config_rtt_sum_us;
+};
+
+#endif /* _UAPI_LINUX_BTFM_CODEC_IOCTL_H */
@@ -59,10 +59,66 @@ struct btm_ctrl_pkt {
 #define BTM_LOG_LVL_IND_LEN                             1
 #define BTM_ADSP_STATE_IND_LEN				4
 #define BTM_CODEC_CONFIG_DMA_REQ_LEN			11
+/* Bearer switch requests closer than this to the previous one are held
+ * back and merged with any request that follows within the window.
+ */
+#define BTM_SWITCH_COALESCE_MS				50
 
 #define BTM_BTFMCODEC_USECASE_START_IND			0x58000008
 #define BTM_USECASE_START_IND_LEN                       1
 
+/* Largest packet exchanged on the control channel (header + payload) */
+#define BTM_MAX_PKT_LEN					64
+/* Packets kept in reserve so that the control channel works under
+ * memory pressure.
+ */
+#define BTM_PKT_POOL_SIZE				16
+
+/* Control packet queued on txq or rxq, allocated from the packet pool */
+struct btfmcodec_pkt {
+	struct list_head list;
+	/* time at which the packet was queued */
+	ktime_t stamp;
+	uint32_t len;
+	uint8_t data[BTM_MAX_PKT_LEN];
+};
+
+/* Shared ring layout exposed through mmap() on the btfmcodec dev node.
+ * Page 0 holds the ring headers, page 1 carries packets from driver to
+ * userspace (tx) and page 2 carries packets from userspace to driver (rx).
+ * head is advanced only by the producer and tail only by the consumer,
+ * both are free running and wrap on BTM_RING_DATA_SIZE.
+ */
+#define BTM_RING_DATA_SIZE				4096
+#define BTM_RING_TX_HDR_OFFSET				0
+#define BTM_RING_RX_HDR_OFFSET				64
+#define BTM_RING_TX_DATA_OFFSET				(1 * BTM_RING_DATA_SIZE)
+#define BTM_RING_RX_DATA_OFFSET				(2 * BTM_RING_DATA_SIZE)
+#define BTM_RING_MMAP_SIZE				(3 * BTM_RING_DATA_SIZE)
+
+struct btm_ring_hdr {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t size;
+	uint32_t reserved;
+} __packed;
+
+/* Read-only observers get every packet exchanged with the audio manager,
+ * each prefixed by this record header.
+ */
+#define BTM_OBSERVER_TX					0
+#define BTM_OBSERVER_RX					1
+
+struct btm_observer_hdr {
+	uint64_t timestamp_ns;
+	uint8_t dir;
+	uint8_t reserved[3];
+	/* packets dropped for this observer before this record */
+	uint32_t dropped;
+	/* length of the packet following the header */
+	uint32_t len;
+} __packed;
+
 enum rx_status {
 	/* Waiting for response */
 	BTM_WAITING_RSP,
@@ -131,6 +187,63 @@ struct btm_adsp_state_ind {
 	uint32_t action;
 } __attribute__((packed));
 
+/* Packets received from BTADV audio manager */
+struct btm_prepare_bearer_req {
+	btm_opcode opcode;
+	uint32_t len;
+	uint8_t transport;
+} __packed;
+
+/* Response to master config, dma config and master shutdown requests */
+struct btm_config_rsp {
+	btm_opcode opcode;
+	uint32_t len;
+	uint8_t stream_id;
+	uint8_t status;
+} __packed;
+
+struct btm_bearer_switch_ind {
+	btm_opcode opcode;
+	uint32_t len;
+	uint8_t status;
+} __packed;
+
+struct btm_log_lvl_ind {
+	btm_opcode opcode;
+	uint32_t len;
+	uint8_t log_lvl;
+} __packed;
+
+/* Payload length carried in the len field of a packet struct */
+#define BTM_PAYLOAD_LEN(type)		(sizeof(type) - BTM_HEADER_LEN)
+
+/*
+ * struct btfmcodec_pkt_desc - how a packet from userspace is handled
+ * opcode:	packet opcode.
+ * len:		expected payload length.
+ * status_idx:	BTM_PKT_TYPE_* slot reporting this packet, -1 if none.
+ * handler:	called with the payload, which directly follows the packet
+ *		header, or with NULL if len didn't match.
+ */
+struct btfmcodec_pkt_desc {
+	btm_opcode opcode;
+	uint32_t len;
+	int status_idx;
+	void (*handler)(struct btfmcodec_char_device *,
+			const struct btfmcodec_pkt_desc *, uint8_t *);
+};
+
 int btfmcodec_dev_enqueue_pkt(struct btfmcodec_char_device *, void *, int);
+struct btfmcodec_txn *btfmcodec_txn_start(struct btfmcodec_char_device *,
+					  btm_opcode, uint8_t, uint8_t);
+void btfmcodec_txn_release(struct btfmcodec_char_device *, struct btfmcodec_txn *);
+int btfmcodec_txn_wait(struct btfmcodec_char_device *, struct btfmcodec_txn *,
+		       unsigned int);
+void btfmcodec_txn_wait_async(struct btfmcodec_char_device *, struct btfmcodec_txn *,
+			      unsigned int, btfmcodec_txn_cb, void *);
+void btfmcodec_queue_prepare_bearer(struct btfmcodec_char_device *, uint8_t);
+void btfmcodec_switch_ind_reset(struct btfmcodec_char_device *);
+bool btfmcodec_switch_ind_match(struct btfmcodec_char_device *);
 bool btfmcodec_is_valid_cache_avb(struct btfmcodec_data *);
+bool btfmcodec_hwep_enter_standby(struct btfmcodec_data *);
 #endif /* __LINUX_BTFM_CODEC_PKT_H*/
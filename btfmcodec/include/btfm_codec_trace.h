@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (c) 2023 Qualcomm Innovation Center, Inc. All rights reserved.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM btfmcodec
+
+#if !defined(__LINUX_BTFM_CODEC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __LINUX_BTFM_CODEC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_DEFINE_ENUM(IDLE);
+TRACE_DEFINE_ENUM(BT_Connecting);
+TRACE_DEFINE_ENUM(BT_Connected);
+TRACE_DEFINE_ENUM(BTADV_AUDIO_Connecting);
+TRACE_DEFINE_ENUM(BTADV_AUDIO_Connected);
+
+#define show_btfmcodec_state(state)					\
+	__print_symbolic(state,						\
+			 { IDLE, "IDLE" },				\
+			 { BT_Connecting, "BT_CONNECTING" },		\
+			 { BT_Connected, "BT_CONNECTED" },		\
+			 { BTADV_AUDIO_Connecting, "BTADV_AUDIO_CONNECTING" }, \
+			 { BTADV_AUDIO_Connected, "BTADV_AUDIO_CONNECTED" })
+
+DECLARE_EVENT_CLASS(btfmcodec_pkt,
+
+	TP_PROTO(uint32_t opcode, uint32_t len),
+
+	TP_ARGS(opcode, len),
+
+	TP_STRUCT__entry(
+		__field(uint32_t, opcode)
+		__field(uint32_t, len)
+	),
+
+	TP_fast_assign(
+		__entry->opcode = opcode;
+		__entry->len = len;
+	),
+
+	TP_printk("opcode=%08x len=%u", __entry->opcode, __entry->len)
+);
+
+/* Packet queued towards userspace, through txq or the tx ring */
+DEFINE_EVENT(btfmcodec_pkt, btfmcodec_pkt_enqueue,
+	TP_PROTO(uint32_t opcode, uint32_t len),
+	TP_ARGS(opcode, len)
+);
+
+/* Packet handed to userspace by read() */
+DEFINE_EVENT(btfmcodec_pkt, btfmcodec_pkt_dequeue,
+	TP_PROTO(uint32_t opcode, uint32_t len),
+	TP_ARGS(opcode, len)
+);
+
+/* Packet from userspace dispatched by the rx worker */
+DEFINE_EVENT(btfmcodec_pkt, btfmcodec_pkt_dispatch,
+	TP_PROTO(uint32_t opcode, uint32_t len),
+	TP_ARGS(opcode, len)
+);
+
+TRACE_EVENT(btfmcodec_rsp_latency,
+
+	TP_PROTO(uint32_t opcode, uint8_t stream_id, uint8_t status, s64 rtt_us),
+
+	TP_ARGS(opcode, stream_id, status, rtt_us),
+
+	TP_STRUCT__entry(
+		__field(uint32_t, opcode)
+		__field(uint8_t, stream_id)
+		__field(uint8_t, status)
+		__field(s64, rtt_us)
+	),
+
+	TP_fast_assign(
+		__entry->opcode = opcode;
+		__entry->stream_id = stream_id;
+		__entry->status = status;
+		__entry->rtt_us = rtt_us;
+	),
+
+	TP_printk("opcode=%08x stream_id=%u status=%u rtt_us=%lld",
+		  __entry->opcode, __entry->stream_id, __entry->status,
+		  __entry->rtt_us)
+);
+
+TRACE_EVENT(btfmcodec_state_transition,
+
+	TP_PROTO(int from, int to),
+
+	TP_ARGS(from, to),
+
+	TP_STRUCT__entry(
+		__field(int, from)
+		__field(int, to)
+	),
+
+	TP_fast_assign(
+		__entry->from = from;
+		__entry->to = to;
+	),
+
+	TP_printk("%s -> %s", show_btfmcodec_state(__entry->from),
+		  show_btfmcodec_state(__entry->to))
+);
+
+DECLARE_EVENT_CLASS(btfmcodec_dai,
+
+	TP_PROTO(int id, int stream, int state),
+
+	TP_ARGS(id, stream, state),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(int, stream)
+		__field(int, state)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->stream = stream;
+		__entry->state = state;
+	),
+
+	TP_printk("dai_id=%d stream=%d state=%s", __entry->id, __entry->stream,
+		  show_btfmcodec_state(__entry->state))
+);
+
+DEFINE_EVENT(btfmcodec_dai, btfmcodec_dai_startup,
+	TP_PROTO(int id, int stream, int state),
+	TP_ARGS(id, stream, state)
+);
+
+DEFINE_EVENT(btfmcodec_dai, btfmcodec_dai_shutdown,
+	TP_PROTO(int id, int stream, int state),
+	TP_ARGS(id, stream, state)
+);
+
+DEFINE_EVENT(btfmcodec_dai, btfmcodec_dai_hw_params,
+	TP_PROTO(int id, int stream, int state),
+	TP_ARGS(id, stream, state)
+);
+
+DEFINE_EVENT(btfmcodec_dai, btfmcodec_dai_prepare,
+	TP_PROTO(int id, int stream, int state),
+	TP_ARGS(id, stream, state)
+);
+
+#endif /* __LINUX_BTFM_CODEC_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE btfm_codec_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (c) 2024 Qualcomm Innovation Center, Inc. All rights reserved.
+ */
+
+#ifndef __LINUX_BTFM_CHIPSET_H
+#define __LINUX_BTFM_CHIPSET_H
+
+#include <linux/bits.h>
+#include <linux/bsearch.h>
+#include <linux/types.h>
+
+/* Chipset capabilities */
+/* slimbus is reset once all ports are closed, next open has to wait */
+#define BTFM_CAP_RESET_DELAY		BIT(0)
+/* slimbus PGD/IFD enumeration address is set from prod_code */
+#define BTFM_CAP_SLIM_EA		BIT(1)
+/* FM Tx uses the Cherokee 3.x slimbus ports */
+#define BTFM_CAP_CHRKVER3_FM_PORTS	BIT(2)
+
+/*
+ * struct btfm_chipset - what the audio bus drivers need to know of a BT SoC
+ * soc_id:	chipset version reported by btpower_get_chipset_version().
+ * name:	chipset family, for logs.
+ * caps:	BTFM_CAP_* bits.
+ * prod_code:	slimbus product code of the enumeration address.
+ * port_map:	soundwire slave port map index.
+ */
+struct btfm_chipset {
+	int soc_id;
+	const char *name;
+	unsigned long caps;
+	uint16_t prod_code;
+	uint8_t port_map;
+};
+
+static inline int btfm_chipset_cmp(const void *key, const void *elt)
+{
+	int soc_id = *(const int *)key;
+	const struct btfm_chipset *chipset = elt;
+
+	if (soc_id < chipset->soc_id)
+		return -1;
+	return soc_id > chipset->soc_id;
+}
+
+/* Tables are kept sorted by soc_id */
+static inline const struct btfm_chipset *
+btfm_chipset_lookup(const struct btfm_chipset *table, size_t num, int soc_id)
+{
+	return bsearch(&soc_id, table, num, sizeof(*table), btfm_chipset_cmp);
+}
+
+static inline bool btfm_chipset_sorted(const struct btfm_chipset *table,
+				       size_t num)
+{
+	size_t i;
+
+	for (i = 1; i < num; i++) {
+		if (table[i - 1].soc_id >= table[i].soc_id)
+			return false;
+	}
+	return true;
+}
+
+#endif /* __LINUX_BTFM_CHIPSET_H */
@@ -11,6 +11,7 @@
 #include <linux/delay.h>
 #include <linux/gpio.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/ratelimit.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
@@ -20,6 +21,7 @@
 #include <sound/soc-dapm.h>
 #include <sound/tlv.h>
 #include "btpower.h"
+#include "btfm_chipset.h"
 #include "btfm_slim.h"
 #include "btfm_slim_slave.h"
 #if IS_ENABLED(CONFIG_SLIM_BTFM_CODEC)
@@ -31,6 +33,40 @@
 #define SLIM_PROD_CODE		0x221
 #define BT_CMD_SLIM_TEST	0xbfac
 
+/* Slimbus BT SoCs, sorted by soc_id */
+static const struct btfm_chipset btfm_slim_chipsets[] = {
+	{QCA_CHEROKEE_SOC_ID_0200, "Cherokee", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_CHEROKEE_SOC_ID_0201, "Cherokee", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_CHEROKEE_SOC_ID_0210, "Cherokee", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_CHEROKEE_SOC_ID_0211, "Cherokee", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_CHEROKEE_SOC_ID_0310, "Cherokee", BTFM_CAP_SLIM_EA | BTFM_CAP_CHRKVER3_FM_PORTS, 0x220},
+	{QCA_CHEROKEE_SOC_ID_0320, "Cherokee", BTFM_CAP_SLIM_EA | BTFM_CAP_CHRKVER3_FM_PORTS, 0x220},
+	{QCA_CHEROKEE_SOC_ID_0320_UMC, "Cherokee", BTFM_CAP_SLIM_EA | BTFM_CAP_CHRKVER3_FM_PORTS, 0x220},
+	{QCA_APACHE_SOC_ID_0100, "Apache", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x220},
+	{QCA_APACHE_SOC_ID_0110, "Apache", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x220},
+	{QCA_APACHE_SOC_ID_0120, "Apache", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_APACHE_SOC_ID_0121, "Apache", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x220},
+	{QCA_COMANCHE_SOC_ID_0101, "Comanche", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_COMANCHE_SOC_ID_0110, "Comanche", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_COMANCHE_SOC_ID_0120, "Comanche", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_COMANCHE_SOC_ID_0130, "Comanche", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_COMANCHE_SOC_ID_4130, "Comanche", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_COMANCHE_SOC_ID_5120, "Comanche", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_COMANCHE_SOC_ID_5130, "Comanche", BTFM_CAP_SLIM_EA, 0x220},
+	{QCA_HSP_SOC_ID_0100, "hastings prime", BTFM_CAP_SLIM_EA, SLIM_PROD_CODE},
+	{QCA_HSP_SOC_ID_0110, "hastings prime", BTFM_CAP_SLIM_EA, SLIM_PROD_CODE},
+	{QCA_HSP_SOC_ID_0200, "hastings prime", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, SLIM_PROD_CODE},
+	{QCA_HSP_SOC_ID_0210, "hastings prime", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, SLIM_PROD_CODE},
+	{QCA_HSP_SOC_ID_1201, "hastings prime", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, SLIM_PROD_CODE},
+	{QCA_HSP_SOC_ID_1211, "hastings prime", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, SLIM_PROD_CODE},
+	{QCA_MOSELLE_SOC_ID_0100, "Moselle", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x222},
+	{QCA_MOSELLE_SOC_ID_0110, "Moselle", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x222},
+	{QCA_MOSELLE_SOC_ID_0120, "Moselle", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x222},
+	{QCA_HAMILTON_SOC_ID_0100, "Hamilton", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x220},
+	{QCA_HAMILTON_SOC_ID_0101, "Hamilton", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x220},
+	{QCA_HAMILTON_SOC_ID_0200, "Hamilton", BTFM_CAP_SLIM_EA | BTFM_CAP_RESET_DELAY, 0x220},
+};
+
 struct class *btfm_slim_class;
 static int btfm_slim_major;
 
@@ -40,34 +76,176 @@ static int btfm_num_ports_open;
 
 static bool is_registered;
 
+struct btfm_slim_retry {
+	ktime_t deadline;
+	unsigned int backoff_us;
+};
+
+static void btfm_slim_retry_start(struct btfm_slim_retry *retry)
+{
+	retry->deadline = ktime_add_us(ktime_get(), SLIM_SLAVE_RW_DEADLINE_US);
+	retry->backoff_us = SLIM_SLAVE_RW_MIN_BACKOFF_US;
+}
+
+/* Sleep before the next attempt, false once the deadline has passed */
+static bool btfm_slim_retry_wait(struct btfm_slim_retry *retry)
+{
+	s64 left_us = ktime_us_delta(retry->deadline, ktime_get());
+	unsigned int delay_us;
+
+	if (left_us <= 0)
+		return false;
+
+	delay_us = min_t(s64, retry->backoff_us, left_us);
+	usleep_range(delay_us, delay_us + delay_us / 4);
+	retry->backoff_us = min_t(unsigned int, retry->backoff_us * 2,
+				  SLIM_SLAVE_RW_MAX_BACKOFF_US);
+	return true;
+}
+
+/* Called with xfer_lock held */
+static void btfm_slim_count_error(struct btfmslim *btfmslim, uint32_t reg,
+	uint8_t pgd, bool final)
+{
+	struct btfm_slim_reg_errors *errors;
+
+	if (reg >= BTFM_SLIM_NUM_REGS)
+		return;
+
+	errors = &btfmslim->reg_errors[pgd ? PGD : IFD][reg];
+	if (final)
+		errors->failures++;
+	else
+		errors->retries++;
+}
+
+static int btfm_slim_reg_errors_show(struct seq_file *s, void *unused)
+{
+	struct btfmslim *btfmslim = s->private;
+	struct btfm_slim_reg_errors *errors;
+	int dev, reg;
+
+	seq_puts(s, "dev reg     retries  failures\n");
+	mutex_lock(&btfmslim->xfer_lock);
+	for (dev = IFD; dev <= PGD; dev++) {
+		for (reg = 0; reg < BTFM_SLIM_NUM_REGS; reg++) {
+			errors = &btfmslim->reg_errors[dev][reg];
+			if (!errors->retries && !errors->failures)
+				continue;
+			seq_printf(s, "%s 0x%04x  %-8u %u\n", dev ? "PGD" : "IFD",
+				   SLIM_SLAVE_REG_OFFSET + reg, errors->retries,
+				   errors->failures);
+		}
+	}
+	mutex_unlock(&btfmslim->xfer_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(btfm_slim_reg_errors);
+
+static bool btfm_slim_reg_cacheable(struct btfmslim *btfmslim, uint32_t reg)
+{
+	const struct btfm_slim_reg_range *range = btfmslim->volatile_regs;
+
+	if (reg >= BTFM_SLIM_NUM_REGS)
+		return false;
+
+	for (; range && range->start != BTFM_SLIM_REG_LAST; range++) {
+		if (reg >= range->start && reg <= range->end)
+			return false;
+	}
+	return true;
+}
+
+/* Called with xfer_lock held */
+static bool btfm_slim_cache_get(struct btfmslim *btfmslim, uint32_t reg,
+	uint8_t pgd, uint8_t *reg_val)
+{
+	struct btfm_slim_cache *cache = &btfmslim->cache[pgd ? PGD : IFD];
+
+	if (!btfm_slim_reg_cacheable(btfmslim, reg) || !test_bit(reg, cache->valid))
+		return false;
+
+	*reg_val = cache->reg_val[reg];
+	return true;
+}
+
+/* Called with xfer_lock held */
+static void btfm_slim_cache_set(struct btfmslim *btfmslim, uint32_t reg,
+	uint8_t pgd, uint8_t reg_val)
+{
+	struct btfm_slim_cache *cache = &btfmslim->cache[pgd ? PGD : IFD];
+
+	if (!btfm_slim_reg_cacheable(btfmslim, reg))
+		return;
+
+	cache->reg_val[reg] = reg_val;
+	set_bit(reg, cache->valid);
+}
+
+/* Called with xfer_lock held, value on the device is unknown */
+static void btfm_slim_cache_drop(struct btfmslim *btfmslim, uint32_t reg,
+	uint8_t pgd)
+{
+	if (reg < BTFM_SLIM_NUM_REGS)
+		clear_bit(reg, btfmslim->cache[pgd ? PGD : IFD].valid);
+}
+
+void btfm_slim_cache_invalidate(struct btfmslim *btfmslim)
+{
+	mutex_lock(&btfmslim->xfer_lock);
+	bitmap_zero(btfmslim->cache[IFD].valid, BTFM_SLIM_NUM_REGS);
+	bitmap_zero(btfmslim->cache[PGD].valid, BTFM_SLIM_NUM_REGS);
+	mutex_unlock(&btfmslim->xfer_lock);
+}
+
 int btfm_slim_write(struct btfmslim *btfmslim,
 		uint16_t reg, uint8_t reg_val, uint8_t pgd)
 {
 	int ret = -1;
 	uint32_t reg_addr;
-	int slim_write_tries = SLIM_SLAVE_RW_MAX_TRIES;
+	uint8_t cached;
+	struct btfm_slim_retry retry;
 
 	BTFMSLIM_INFO("Write to %s", pgd?"PGD":"IFD");
 	reg_addr = SLIM_SLAVE_REG_OFFSET + reg;
 
-	for ( ; slim_write_tries != 0; slim_write_tries--) {
+	mutex_lock(&btfmslim->xfer_lock);
+	if (btfm_slim_cache_get(btfmslim, reg, pgd, &cached) && cached == reg_val) {
+		mutex_unlock(&btfmslim->xfer_lock);
+		BTFMSLIM_DBG("reg 0x%x already holds 0x%02x", reg_addr, reg_val);
+		return 0;
+	}
+	mutex_unlock(&btfmslim->xfer_lock);
+
+	btfm_slim_retry_start(&retry);
+	for (;;) {
 		mutex_lock(&btfmslim->xfer_lock);
 		ret = slim_writeb(pgd ? btfmslim->slim_pgd :
 			&btfmslim->slim_ifd, reg_addr, reg_val);
+		if (ret)
+			btfm_slim_cache_drop(btfmslim, reg, pgd);
+		else
+			btfm_slim_cache_set(btfmslim, reg, pgd, reg_val);
 		mutex_unlock(&btfmslim->xfer_lock);
-		if (ret) {
-			BTFMSLIM_DBG("retrying to Write 0x%02x to reg 0x%x ret %d",
-					 reg_val, reg_addr, ret);
-		} else {
+		if (!ret) {
 			BTFMSLIM_DBG("Written 0x%02x to reg 0x%x ret %d", reg_val, reg_addr, ret);
 			break;
 		}
 
-		usleep_range(5000, 5100);
+		if (!btfm_slim_retry_wait(&retry))
+			break;
+		BTFMSLIM_DBG("retrying to Write 0x%02x to reg 0x%x ret %d",
+				 reg_val, reg_addr, ret);
+		mutex_lock(&btfmslim->xfer_lock);
+		btfm_slim_count_error(btfmslim, reg, pgd, false);
+		mutex_unlock(&btfmslim->xfer_lock);
 	}
 	if (ret) {
-		BTFMSLIM_DBG("retrying to Write 0x%02x to reg 0x%x ret %d",
+		BTFMSLIM_ERR("failed to Write 0x%02x to reg 0x%x ret %d",
 				reg_val, reg_addr, ret);
+		mutex_lock(&btfmslim->xfer_lock);
+		btfm_slim_count_error(btfmslim, reg, pgd, true);
+		mutex_unlock(&btfmslim->xfer_lock);
 	}
 	return ret;
 }
@@ -75,37 +253,209 @@ int btfm_slim_write(struct btfmslim *btfmslim,
 int btfm_slim_read(struct btfmslim *btfmslim, uint32_t reg, uint8_t pgd)
 {
 	int ret = -1;
-	int slim_read_tries = SLIM_SLAVE_RW_MAX_TRIES;
+	struct btfm_slim_retry retry;
 	uint32_t reg_addr;
+	uint8_t cached;
 	BTFMSLIM_DBG("Read from %s", pgd?"PGD":"IFD");
 	reg_addr = SLIM_SLAVE_REG_OFFSET + reg;
 
-	for ( ; slim_read_tries != 0; slim_read_tries--) {
+	mutex_lock(&btfmslim->xfer_lock);
+	if (btfm_slim_cache_get(btfmslim, reg, pgd, &cached)) {
+		mutex_unlock(&btfmslim->xfer_lock);
+		BTFMSLIM_DBG("Read 0x%02x from cached reg 0x%x", cached, reg_addr);
+		return cached;
+	}
+	mutex_unlock(&btfmslim->xfer_lock);
+
+	btfm_slim_retry_start(&retry);
+	for (;;) {
 		mutex_lock(&btfmslim->xfer_lock);
 
 		ret = slim_readb(pgd ? btfmslim->slim_pgd :
 				&btfmslim->slim_ifd, reg_addr);
 		BTFMSLIM_DBG("Read 0x%02x from reg 0x%x", ret, reg_addr);
+		if (ret >= 0)
+			btfm_slim_cache_set(btfmslim, reg, pgd, ret);
 		mutex_unlock(&btfmslim->xfer_lock);
-		if (ret > 0)
+		if (ret >= 0 || !btfm_slim_retry_wait(&retry))
 			break;
-		usleep_range(5000, 5100);
+		mutex_lock(&btfmslim->xfer_lock);
+		btfm_slim_count_error(btfmslim, reg, pgd, false);
+		mutex_unlock(&btfmslim->xfer_lock);
+	}
+	if (ret < 0) {
+		BTFMSLIM_ERR("failed to Read reg 0x%x ret %d", reg_addr, ret);
+		mutex_lock(&btfmslim->xfer_lock);
+		btfm_slim_count_error(btfmslim, reg, pgd, true);
+		mutex_unlock(&btfmslim->xfer_lock);
 	}
 	return ret;
 }
 
+int btfm_slim_batch_write(struct btfmslim *btfmslim,
+	struct btfm_slim_batch *batch, uint16_t reg, uint8_t reg_val,
+	uint8_t pgd, uint8_t stage)
+{
+	struct btfm_slim_reg_write *w;
+	uint8_t cached;
+	bool skip;
+	int ret, i;
+
+	if (!batch)
+		return btfm_slim_write(btfmslim, reg, reg_val, pgd);
+
+	/* Nothing to write if the register already holds the value, unless
+	 * a write queued before changes it.
+	 */
+	mutex_lock(&btfmslim->xfer_lock);
+	skip = btfm_slim_cache_get(btfmslim, reg, pgd, &cached) && cached == reg_val;
+	mutex_unlock(&btfmslim->xfer_lock);
+	for (i = 0; skip && i < batch->count; i++) {
+		if (batch->writes[i].reg == reg && batch->writes[i].pgd == pgd)
+			skip = false;
+	}
+	if (skip) {
+		BTFMSLIM_DBG("reg 0x%x already holds 0x%02x", reg, reg_val);
+		return 0;
+	}
+
+	if (batch->count == BTFM_SLIM_BATCH_MAX) {
+		ret = btfm_slim_batch_commit(btfmslim, batch);
+		if (ret < 0)
+			return ret;
+	}
+
+	w = &batch->writes[batch->count++];
+	w->reg = reg;
+	w->reg_val = reg_val;
+	w->pgd = pgd;
+	w->stage = stage;
+	return 0;
+}
+
+/* Largest value element access, in bytes, that fits in len */
+static int btfm_slim_ve_len(int len)
+{
+	static const uint8_t ve_len[] = { 16, 12, 8, 6, 4, 3, 2, 1 };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ve_len); i++) {
+		if (ve_len[i] <= len)
+			return ve_len[i];
+	}
+	return 1;
+}
+
+/* Write len consecutive registers from reg in a single bus transaction,
+ * falling back to one write per register if it fails.
+ */
+static int btfm_slim_write_run(struct btfmslim *btfmslim, uint16_t reg,
+	uint8_t *vals, int len, uint8_t pgd)
+{
+	int ret, i;
+
+	if (len > 1) {
+		mutex_lock(&btfmslim->xfer_lock);
+		ret = slim_write(pgd ? btfmslim->slim_pgd : &btfmslim->slim_ifd,
+				 SLIM_SLAVE_REG_OFFSET + reg, len, vals);
+		for (i = 0; i < len; i++) {
+			if (ret)
+				btfm_slim_cache_drop(btfmslim, reg + i, pgd);
+			else
+				btfm_slim_cache_set(btfmslim, reg + i, pgd, vals[i]);
+		}
+		mutex_unlock(&btfmslim->xfer_lock);
+		if (!ret) {
+			BTFMSLIM_DBG("Written %d regs from 0x%x", len,
+				     SLIM_SLAVE_REG_OFFSET + reg);
+			return 0;
+		}
+		BTFMSLIM_DBG("failed to write %d regs from 0x%x ret %d, writing one by one",
+			     len, SLIM_SLAVE_REG_OFFSET + reg, ret);
+	}
+
+	for (i = 0; i < len; i++) {
+		ret = btfm_slim_write(btfmslim, reg + i, vals[i], pgd);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+int btfm_slim_batch_commit(struct btfmslim *btfmslim,
+	struct btfm_slim_batch *batch)
+{
+	struct btfm_slim_reg_write *w[BTFM_SLIM_BATCH_MAX], *tmp;
+	uint8_t vals[BTFM_SLIM_BATCH_MAX];
+	int stage, n, i, j, len, ret = 0;
+
+	for (stage = 0; stage < BTFM_SLIM_BATCH_STAGES && !ret; stage++) {
+		/* Writes of this stage, ordered by device and address while
+		 * keeping the queued order for a repeated register.
+		 */
+		for (n = 0, i = 0; i < batch->count; i++) {
+			if (batch->writes[i].stage != stage)
+				continue;
+			tmp = &batch->writes[i];
+			for (j = n; j > 0 && (w[j - 1]->pgd > tmp->pgd ||
+			     (w[j - 1]->pgd == tmp->pgd && w[j - 1]->reg > tmp->reg)); j--)
+				w[j] = w[j - 1];
+			w[j] = tmp;
+			n++;
+		}
+
+		/* Consecutive registers go out in one value element access */
+		for (i = 0; i < n && !ret; i += len) {
+			vals[0] = w[i]->reg_val;
+			for (len = 1; i + len < n; len++) {
+				if (w[i + len]->pgd != w[i]->pgd ||
+				    w[i + len]->reg != w[i]->reg + len)
+					break;
+				vals[len] = w[i + len]->reg_val;
+			}
+			len = btfm_slim_ve_len(len);
+			ret = btfm_slim_write_run(btfmslim, w[i]->reg, vals, len,
+						  w[i]->pgd);
+			if (ret)
+				BTFMSLIM_ERR("failed to write (%d) reg 0x%x", ret,
+					     w[i]->reg);
+		}
+	}
+
+	batch->count = 0;
+	return ret;
+}
+
+/* Wait for whatever is left of the bus reset that follows the last port
+ * being closed on some chipsets.
+ */
+static void btfm_slim_wait_settle(struct btfmslim *btfmslim)
+{
+	s64 left_us = ktime_us_delta(btfmslim->settle_end, ktime_get());
+
+	if (left_us <= 0)
+		return;
+
+	BTFMSLIM_INFO("waiting %lld us for SB reset to settle", left_us);
+	if (left_us > 20 * USEC_PER_MSEC)
+		msleep(DIV_ROUND_UP(left_us, USEC_PER_MSEC));
+	else
+		usleep_range(left_us, left_us + 100);
+}
+
 int btfm_slim_enable_ch(struct btfmslim *btfmslim, struct btfmslim_ch *ch,
 	uint8_t rxport, uint32_t rates, uint8_t nchan)
 {
+	struct btfm_slim_batch batch = { 0 };
 	int ret = -1;
 	int i = 0;
 	struct btfmslim_ch *chan = ch;
-	int chipset_ver;
 
 	if (!btfmslim || !ch)
 		return -EINVAL;
 
 	BTFMSLIM_DBG("port: %d ch: %d", ch->port, ch->ch);
+	btfm_slim_wait_settle(btfmslim);
 
 	chan->dai.sruntime = slim_stream_allocate(btfmslim->slim_pgd, "BTFM_SLIM");
 	if (chan->dai.sruntime == NULL) {
@@ -124,7 +474,7 @@ int btfm_slim_enable_ch(struct btfmslim *btfmslim, struct btfmslim_ch *ch,
 		/* Enable port through registration setting */
 		if (btfmslim->vendor_port_en) {
 			ret = btfmslim->vendor_port_en(btfmslim, ch->port,
-					rxport, 1);
+					rxport, 1, &batch);
 			if (ret < 0) {
 				BTFMSLIM_ERR("vendor_port_en failed ret[%d]",
 					ret);
@@ -135,10 +485,15 @@ int btfm_slim_enable_ch(struct btfmslim *btfmslim, struct btfmslim_ch *ch,
 		chan->dai.sconfig.port_mask |= BIT(ch->port);
 	}
 
+	/* Port setup of all channels in as few bus transactions as possible */
+	ret = btfm_slim_batch_commit(btfmslim, &batch);
+	if (ret < 0) {
+		BTFMSLIM_ERR("failed to enable ports ret[%d]", ret);
+		goto error;
+	}
+
 	/* Activate the channel immediately */
 	BTFMSLIM_INFO("port: %d, ch: %d", chan->port, chan->ch);
-	chipset_ver = btpower_get_chipset_version();
-	BTFMSLIM_INFO("chipset soc version:%x", chipset_ver);
 
 	/* for feedback channel, PCM bit should not be set */
 	if (btfm_feedback_ch_setting) {
@@ -175,9 +530,9 @@ error:
 int btfm_slim_disable_ch(struct btfmslim *btfmslim, struct btfmslim_ch *ch,
 			uint8_t rxport, uint8_t nchan)
 {
+	struct btfm_slim_batch batch = { 0 };
 	int ret = -1;
 	int i = 0;
-	int chipset_ver = 0;
 	if (!btfmslim || !ch)
 		return -EINVAL;
 
@@ -218,13 +573,18 @@ int btfm_slim_disable_ch(struct btfmslim *btfmslim, struct btfmslim_ch *ch,
 	for (i = 0; i < nchan; i++, ch++) {
 		if (btfmslim->vendor_port_en) {
 			ret = btfmslim->vendor_port_en(btfmslim, ch->port,
-				rxport, 0);
+				rxport, 0, &batch);
 			if (ret < 0) {
 				BTFMSLIM_ERR("vendor_port_en failed [%d]", ret);
 				break;
 			}
 		}
 	}
+	if (batch.count) {
+		ret = btfm_slim_batch_commit(btfmslim, &batch);
+		if (ret < 0)
+			BTFMSLIM_ERR("failed to disable ports [%d]", ret);
+	}
 	ch->dai.sconfig.port_mask = 0;
 	if (ch->dai.sconfig.chs != NULL) {
 		kfree(ch->dai.sconfig.chs);
@@ -240,45 +600,54 @@ int btfm_slim_disable_ch(struct btfmslim *btfmslim, struct btfmslim_ch *ch,
 
 	BTFMSLIM_INFO("btfm_num_ports_open: %d", btfm_num_ports_open);
 
-	chipset_ver = btpower_get_chipset_version();
+	if (btfm_num_ports_open == 0 &&
+	    (btfmslim->caps & BTFM_CAP_RESET_DELAY)) {
+		BTFMSLIM_INFO("SB reset needed after all ports disabled");
+		btfmslim->settle_end = ktime_add_ms(ktime_get(),
+						    DELAY_FOR_PORT_OPEN_MS);
+	}
+
+	return ret;
+}
 
-	if (btfm_num_ports_open == 0 && (chipset_ver == QCA_HSP_SOC_ID_0200 ||
-		chipset_ver == QCA_HSP_SOC_ID_0210 ||
-		chipset_ver == QCA_HSP_SOC_ID_1201 ||
-		chipset_ver == QCA_HSP_SOC_ID_1211 ||
-		chipset_ver == QCA_HAMILTON_SOC_ID_0100 ||
-		chipset_ver == QCA_HAMILTON_SOC_ID_0101 ||
-		chipset_ver == QCA_HAMILTON_SOC_ID_0200 ||
-		chipset_ver == QCA_APACHE_SOC_ID_0100 ||
-		chipset_ver == QCA_APACHE_SOC_ID_0110 ||
-		chipset_ver == QCA_APACHE_SOC_ID_0121 ||
-		chipset_ver == QCA_MOSELLE_SOC_ID_0100 ||
-		chipset_ver == QCA_MOSELLE_SOC_ID_0110 ||
-		chipset_ver == QCA_MOSELLE_SOC_ID_0120)) {
-		BTFMSLIM_INFO("SB reset needed after all ports disabled, sleeping");
-		msleep(DELAY_FOR_PORT_OPEN_MS);
+int btfm_slim_standby_ch(struct btfmslim *btfmslim, struct btfmslim_ch *ch,
+			 bool standby)
+{
+	int ret;
+
+	if (!btfmslim || !ch)
+		return -EINVAL;
+
+	BTFMSLIM_INFO("port:%d standby:%d", ch->port, standby);
+	if (ch->dai.sruntime == NULL) {
+		BTFMSLIM_ERR("Channel not enabled yet. returning");
+		return -EINVAL;
 	}
 
+	/* Ports and stream config stay allocated, only the stream toggles */
+	if (standby)
+		ret = slim_stream_disable(ch->dai.sruntime);
+	else
+		ret = slim_stream_enable(ch->dai.sruntime);
+	if (ret)
+		BTFMSLIM_ERR("failed to %s stream ret %d",
+			     standby ? "disable" : "enable", ret);
+
 	return ret;
 }
 
 static int btfm_slim_alloc_port(struct btfmslim *btfmslim)
 {
 	int ret = -EINVAL, i;
-	int  chipset_ver;
 	struct btfmslim_ch *rx_chs;
 	struct btfmslim_ch *tx_chs;
 
 	if (!btfmslim)
 		return ret;
 
-	chipset_ver = btpower_get_chipset_version();
-	BTFMSLIM_INFO("chipset soc version:%x", chipset_ver);
-
 	rx_chs = btfmslim->rx_chs;
 	tx_chs = btfmslim->tx_chs;
-	if ((chipset_ver >=  QCA_CHEROKEE_SOC_ID_0310) &&
-		(chipset_ver <=  QCA_CHEROKEE_SOC_ID_0320_UMC)) {
+	if (btfmslim->caps & BTFM_CAP_CHRKVER3_FM_PORTS) {
 		for (i = 0; (tx_chs->port != BTFM_SLIM_PGD_PORT_LAST) &&
 		(i < BTFM_SLIM_NUM_CODEC_DAIS); i++, tx_chs++) {
 			if (tx_chs->port == SLAVE_SB_PGD_PORT_TX1_FM)
@@ -336,6 +705,9 @@ int btfm_slim_hw_init(struct btfmslim *btfmslim)
 	slim_ifd = &btfmslim->slim_ifd;
 
 	mutex_lock(&btfmslim->io_lock);
+	btfm_slim_wait_settle(btfmslim);
+	/* Slave may have been reset since registers were last accessed */
+	btfm_slim_cache_invalidate(btfmslim);
 	BTFMSLIM_INFO(
 		"PGD Enum Addr: mfr id:%.02x prod code:%.02x dev ind:%.02x ins:%.02x",
 		slim->e_addr.manf_id, slim->e_addr.prod_code,
@@ -343,39 +715,19 @@ int btfm_slim_hw_init(struct btfmslim *btfmslim)
 
 
 	chipset_ver = btpower_get_chipset_version();
-	BTFMSLIM_INFO("chipset soc version:%x", chipset_ver);
-
-	if (chipset_ver == QCA_HSP_SOC_ID_0100 ||
-		chipset_ver == QCA_HSP_SOC_ID_0110 ||
-		chipset_ver == QCA_HSP_SOC_ID_0200 ||
-		chipset_ver == QCA_HSP_SOC_ID_0210 ||
-		chipset_ver == QCA_HSP_SOC_ID_1201 ||
-		chipset_ver == QCA_HSP_SOC_ID_1211) {
-		BTFMSLIM_INFO("chipset is hastings prime, overwriting EA");
-		slim->is_laddr_valid = false;
-		slim->e_addr.manf_id = SLIM_MANF_ID_QCOM;
-		slim->e_addr.prod_code = SLIM_PROD_CODE;
-		slim->e_addr.dev_index = 0x01;
-		slim->e_addr.instance = 0x0;
-		/* we are doing this to indicate that this is not a child node
-		 * (doesn't have call back functions). Needed only for querying
-		 * logical address.
-		 */
-		slim_ifd->dev.driver = NULL;
-		slim_ifd->ctrl = btfmslim->slim_pgd->ctrl; //slimbus controller structure.
-		slim_ifd->is_laddr_valid = false;
-		slim_ifd->e_addr.manf_id = SLIM_MANF_ID_QCOM;
-		slim_ifd->e_addr.prod_code = SLIM_PROD_CODE;
-		slim_ifd->e_addr.dev_index = 0x0;
-		slim_ifd->e_addr.instance = 0x0;
-		slim_ifd->laddr = 0x0;
-	} else if (chipset_ver == QCA_MOSELLE_SOC_ID_0100 ||
-		chipset_ver == QCA_MOSELLE_SOC_ID_0110 ||
-		chipset_ver == QCA_MOSELLE_SOC_ID_0120) {
-		BTFMSLIM_INFO("chipset is Moselle, overwriting EA");
+	btfmslim->chipset = btfm_chipset_lookup(btfm_slim_chipsets,
+						ARRAY_SIZE(btfm_slim_chipsets),
+						chipset_ver);
+	btfmslim->caps = btfmslim->chipset ? btfmslim->chipset->caps : 0;
+	BTFMSLIM_INFO("chipset soc version:%x caps:%lx", chipset_ver,
+		      btfmslim->caps);
+
+	if (btfmslim->caps & BTFM_CAP_SLIM_EA) {
+		BTFMSLIM_INFO("chipset is %s, overwriting EA",
+			      btfmslim->chipset->name);
 		slim->is_laddr_valid = false;
 		slim->e_addr.manf_id = SLIM_MANF_ID_QCOM;
-		slim->e_addr.prod_code = 0x222;
+		slim->e_addr.prod_code = btfmslim->chipset->prod_code;
 		slim->e_addr.dev_index = 0x01;
 		slim->e_addr.instance = 0x0;
 		/* we are doing this to indicate that this is not a child node
@@ -386,64 +738,7 @@ int btfm_slim_hw_init(struct btfmslim *btfmslim)
 		slim_ifd->ctrl = btfmslim->slim_pgd->ctrl; //slimbus controller structure.
 		slim_ifd->is_laddr_valid = false;
 		slim_ifd->e_addr.manf_id = SLIM_MANF_ID_QCOM;
-		slim_ifd->e_addr.prod_code = 0x222;
-		slim_ifd->e_addr.dev_index = 0x0;
-		slim_ifd->e_addr.instance = 0x0;
-		slim_ifd->laddr = 0x0;
-	} else if (chipset_ver == QCA_HAMILTON_SOC_ID_0100 ||
-		chipset_ver ==  QCA_HAMILTON_SOC_ID_0101 ||
-		chipset_ver ==  QCA_HAMILTON_SOC_ID_0200) {
-		BTFMSLIM_INFO("chipset is Hamliton, overwriting EA");
-		slim->is_laddr_valid = false;
-		slim->e_addr.manf_id = SLIM_MANF_ID_QCOM;
-		slim->e_addr.prod_code = 0x220;
-		slim->e_addr.dev_index = 0x01;
-		slim->e_addr.instance = 0x0;
-		/* we are doing this to indicate that this is not a child node
-		 * (doesn't have call back functions). Needed only for querying
-		 * logical address.
-		 */
-		slim_ifd->dev.driver = NULL;
-		slim_ifd->ctrl = btfmslim->slim_pgd->ctrl; //slimbus controller structure.
-		slim_ifd->is_laddr_valid = false;
-		slim_ifd->e_addr.manf_id = SLIM_MANF_ID_QCOM;
-		slim_ifd->e_addr.prod_code = 0x220;
-		slim_ifd->e_addr.dev_index = 0x0;
-		slim_ifd->e_addr.instance = 0x0;
-		slim_ifd->laddr = 0x0;
-	} else if (chipset_ver == QCA_CHEROKEE_SOC_ID_0200 ||
-		chipset_ver ==  QCA_CHEROKEE_SOC_ID_0201  ||
-		chipset_ver ==  QCA_CHEROKEE_SOC_ID_0210  ||
-		chipset_ver ==  QCA_CHEROKEE_SOC_ID_0211  ||
-		chipset_ver ==  QCA_CHEROKEE_SOC_ID_0310  ||
-		chipset_ver ==  QCA_CHEROKEE_SOC_ID_0320  ||
-		chipset_ver ==  QCA_CHEROKEE_SOC_ID_0320_UMC  ||
-		chipset_ver ==  QCA_APACHE_SOC_ID_0100  ||
-		chipset_ver ==  QCA_APACHE_SOC_ID_0110  ||
-		chipset_ver ==  QCA_APACHE_SOC_ID_0120 ||
-		chipset_ver ==  QCA_APACHE_SOC_ID_0121 ||
-		chipset_ver ==  QCA_COMANCHE_SOC_ID_0101 ||
-		chipset_ver ==  QCA_COMANCHE_SOC_ID_0110 ||
-		chipset_ver ==  QCA_COMANCHE_SOC_ID_0120 ||
-		chipset_ver ==  QCA_COMANCHE_SOC_ID_0130 ||
-		chipset_ver ==  QCA_COMANCHE_SOC_ID_4130 ||
-		chipset_ver ==  QCA_COMANCHE_SOC_ID_5120 ||
-		chipset_ver ==  QCA_COMANCHE_SOC_ID_5130 ) {
-		BTFMSLIM_INFO("chipset is Chk/Apache/CMC, overwriting EA");
-		slim->is_laddr_valid = false;
-		slim->e_addr.manf_id = SLIM_MANF_ID_QCOM;
-		slim->e_addr.prod_code = 0x220;
-		slim->e_addr.dev_index = 0x01;
-		slim->e_addr.instance = 0x0;
-		/* we are doing this to indicate that this is not a child node
-		 * (doesn't have call back functions). Needed only for querying
-		 * logical address.
-		 */
-		slim_ifd->dev.driver = NULL;
-		slim_ifd->ctrl = btfmslim->slim_pgd->ctrl; //slimbus controller structure.
-		slim_ifd->is_laddr_valid = false;
-		slim_ifd->e_addr.manf_id = SLIM_MANF_ID_QCOM;
-		slim_ifd->e_addr.prod_code = 0x220;
+		slim_ifd->e_addr.prod_code = btfmslim->chipset->prod_code;
 		slim_ifd->e_addr.dev_index = 0x0;
 		slim_ifd->e_addr.instance = 0x0;
 		slim_ifd->laddr = 0x0;
@@ -647,6 +942,9 @@ static int btfm_slim_probe(struct slim_device *slim)
 	btfm_slim->tx_chs = SLIM_SLAVE_TXPORT;
 	btfm_slim->vendor_init = SLIM_SLAVE_INIT;
 	btfm_slim->vendor_port_en = SLIM_SLAVE_PORT_EN;
+	btfm_slim->volatile_regs = SLIM_SLAVE_VOLATILE;
+	WARN_ON(!btfm_chipset_sorted(btfm_slim_chipsets,
+				     ARRAY_SIZE(btfm_slim_chipsets)));
 
 	/* Created Mutex for slimbus data transfer */
 	mutex_init(&btfm_slim->io_lock);
@@ -687,6 +985,10 @@ static int btfm_slim_probe(struct slim_device *slim)
 		ret = -1;
 		goto device_err;
 	}
+
+	btfm_slim->debugfs = debugfs_create_dir("btfmslim", NULL);
+	debugfs_create_file("reg_errors", 0444, btfm_slim->debugfs, btfm_slim,
+			    &btfm_slim_reg_errors_fops);
 	return ret;
 
 device_err:
@@ -711,6 +1013,7 @@ static void btfm_slim_remove(struct slim_device *slim)
 	struct device *dev = &slim->dev;
 	struct btfmslim *btfm_slim = dev_get_drvdata(dev);
 	BTFMSLIM_DBG("");
+	debugfs_remove_recursive(btfm_slim->debugfs);
 	mutex_destroy(&btfm_slim->io_lock);
 	mutex_destroy(&btfm_slim->xfer_lock);
 	snd_soc_unregister_component(&slim->dev);
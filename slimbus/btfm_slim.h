@@ -7,6 +7,7 @@
 #ifndef BTFM_SLIM_H
 #define BTFM_SLIM_H
 #include <linux/slimbus.h>
+#include "btfm_chipset.h"
 
 #define BTFMSLIM_DBG(fmt, arg...)  pr_debug("%s: " fmt "\n", __func__, ## arg)
 #define BTFMSLIM_INFO(fmt, arg...) pr_info("%s: " fmt "\n", __func__, ## arg)
@@ -21,9 +22,17 @@
 #define SLIM_SLAVE_TXPORT		NULL
 #define SLIM_SLAVE_INIT			NULL
 #define SLIM_SLAVE_PORT_EN		NULL
+#define SLIM_SLAVE_VOLATILE		NULL
 
 /* Misc defines */
-#define SLIM_SLAVE_RW_MAX_TRIES		3
+/* Failed register accesses are retried after SLIM_SLAVE_RW_MIN_BACKOFF_US,
+ * each following retry waits twice as long as the previous one, up to
+ * SLIM_SLAVE_RW_MAX_BACKOFF_US, until SLIM_SLAVE_RW_DEADLINE_US have
+ * passed since the first attempt.
+ */
+#define SLIM_SLAVE_RW_MIN_BACKOFF_US	50
+#define SLIM_SLAVE_RW_MAX_BACKOFF_US	5000
+#define SLIM_SLAVE_RW_DEADLINE_US	15000
 #define SLIM_SLAVE_PRESENT_TIMEOUT	100
 
 #define PGD	1
@@ -61,6 +70,55 @@ struct btfmslim_ch {
 /* Slimbus Port defines - This should be redefined in specific device file */
 #define BTFM_SLIM_PGD_PORT_LAST				0xFF
 
+/* Register writes collected for all channels of a stream */
+#define BTFM_SLIM_BATCH_MAX		16
+
+/* Batched writes go out stage by stage, in this order */
+enum {
+	/* port setup: multichannel, overrun/underrun recovery */
+	BTFM_SLIM_BATCH_CFG = 0,
+	/* port enable or disable */
+	BTFM_SLIM_BATCH_EN,
+	BTFM_SLIM_BATCH_STAGES
+};
+
+struct btfm_slim_reg_write {
+	uint16_t reg;
+	uint8_t reg_val;
+	uint8_t pgd;
+	uint8_t stage;
+};
+
+struct btfm_slim_batch {
+	int count;
+	struct btfm_slim_reg_write writes[BTFM_SLIM_BATCH_MAX];
+};
+
+/* Registers below this address are shadowed and have access error
+ * counters, for PGD and IFD each
+ */
+#define BTFM_SLIM_NUM_REGS		0x200
+/* Marks the end of a volatile register list */
+#define BTFM_SLIM_REG_LAST		0xFFFF
+
+/* Registers from start to end, both included, are never shadowed */
+struct btfm_slim_reg_range {
+	uint16_t start;
+	uint16_t end;
+};
+
+struct btfm_slim_cache {
+	uint8_t reg_val[BTFM_SLIM_NUM_REGS];
+	DECLARE_BITMAP(valid, BTFM_SLIM_NUM_REGS);
+};
+
+struct btfm_slim_reg_errors {
+	/* failed attempts that were retried */
+	uint32_t retries;
+	/* accesses still failing at the retry deadline */
+	uint32_t failures;
+};
+
 struct btfmslim {
 	struct device *dev;
 	struct slim_device *slim_pgd; //Physical address
@@ -78,7 +136,18 @@ struct btfmslim {
 	struct btfmslim_ch *tx_chs;
 	int (*vendor_init)(struct btfmslim *btfmslim);
 	int (*vendor_port_en)(struct btfmslim *btfmslim, uint8_t port_num,
-		uint8_t rxport, uint8_t enable);
+		uint8_t rxport, uint8_t enable, struct btfm_slim_batch *batch);
+	/* Shadow registers indexed by IFD/PGD, updated under xfer_lock */
+	struct btfm_slim_cache cache[2];
+	const struct btfm_slim_reg_range *volatile_regs;
+	/* Access errors indexed by IFD/PGD, updated under xfer_lock */
+	struct btfm_slim_reg_errors reg_errors[2][BTFM_SLIM_NUM_REGS];
+	struct dentry *debugfs;
+	/* Slave isn't accessed before this time once all ports are closed */
+	ktime_t settle_end;
+	/* BT SoC found at hw init, NULL if unknown, and its BTFM_CAP_* bits */
+	const struct btfm_chipset *chipset;
+	unsigned long caps;
 #if IS_ENABLED(CONFIG_SLIM_BTFM_CODEC)
 	int device_id;
 #endif
@@ -130,6 +199,41 @@ int btfm_slim_write(struct btfmslim *btfmslim,
 int btfm_slim_read(struct btfmslim *btfmslim,
 	uint32_t reg, uint8_t pgd);
 
+/**
+ * btfm_slim_cache_invalidate: drop all shadowed register values
+ * @btfmslim: slimbus slave device data pointer.
+ * Returns:
+ * VOID
+ */
+void btfm_slim_cache_invalidate(struct btfmslim *btfmslim);
+
+/**
+ * btfm_slim_batch_write: queue a register write in a batch
+ * @btfmslim: slimbus slave device data pointer.
+ * @batch: batch to queue the write in, written right away if NULL
+ * @reg: slimbus slave register address
+ * @reg_val: value to write at register address
+ * @pgd: selection for device: either PGD or IFD
+ * @stage: BTFM_SLIM_BATCH_CFG or BTFM_SLIM_BATCH_EN
+ * Returns:
+ * 0: Success
+ * else: Fail
+ */
+int btfm_slim_batch_write(struct btfmslim *btfmslim,
+	struct btfm_slim_batch *batch, uint16_t reg, uint8_t reg_val,
+	uint8_t pgd, uint8_t stage);
+
+/**
+ * btfm_slim_batch_commit: write all registers queued in a batch
+ * @btfmslim: slimbus slave device data pointer.
+ * @batch: batch to write, empty on return
+ * Returns:
+ * 0: Success
+ * else: first error met
+ */
+int btfm_slim_batch_commit(struct btfmslim *btfmslim,
+	struct btfm_slim_batch *batch);
+
 
 /**
  * btfm_slim_enable_ch: enable channel for slimbus slave port
@@ -159,6 +263,19 @@ int btfm_slim_enable_ch(struct btfmslim *btfmslim,
 int btfm_slim_disable_ch(struct btfmslim *btfmslim,
 	struct btfmslim_ch *ch, uint8_t rxport, uint8_t nchan);
 
+/**
+ * btfm_slim_standby_ch: disable or re-enable a prepared slimbus stream
+ * without releasing its ports
+ * @btfmslim: slimbus slave device data pointer.
+ * @ch: slimbus slave channel pointer
+ * @standby: true to disable the stream, false to enable it again
+ * Returns:
+ * -EINVAL
+ * 0
+ */
+int btfm_slim_standby_ch(struct btfmslim *btfmslim,
+	struct btfmslim_ch *ch, bool standby);
+
 /**
  * btfm_slim_register_codec: Register codec driver in slimbus device node
  * @btfmslim: slimbus slave device data pointer.
@@ -166,6 +166,43 @@ static void btfm_slim_dai_shutdown(void *dai, int id)
 	btfm_slim_hw_deinit(btfmslim);
 }
 
+static int btfm_slim_dai_standby(void *dai, int id, bool standby)
+{
+	struct hwep_data *hwep_info = (struct hwep_data *)dai;
+	struct btfmslim *btfmslim = dev_get_drvdata(hwep_info->dev);
+	struct btfmslim_ch *ch;
+	int i;
+
+	BTFMSLIM_DBG("");
+	switch (id) {
+	case BTFM_FM_SLIM_TX:
+	case BTFM_BT_SCO_SLIM_TX:
+		ch = btfmslim->tx_chs;
+		break;
+	case BTFM_BT_SCO_A2DP_SLIM_RX:
+	case BTFM_BT_SPLIT_A2DP_SLIM_RX:
+		ch = btfmslim->rx_chs;
+		break;
+	case BTFM_SLIM_NUM_CODEC_DAIS:
+	default:
+		BTFMSLIM_ERR("id is invalid:%d", id);
+		return -EINVAL;
+	}
+	/* Search for dai->id matched port handler */
+	for (i = 0; (i < BTFM_SLIM_NUM_CODEC_DAIS) &&
+		(ch->id != BTFM_SLIM_NUM_CODEC_DAIS) &&
+		(ch->id != id); ch++, i++)
+		;
+
+	if ((ch->port == BTFM_SLIM_PGD_PORT_LAST) ||
+		(ch->id == BTFM_SLIM_NUM_CODEC_DAIS)) {
+		BTFMSLIM_ERR("ch is invalid!!");
+		return -EINVAL;
+	}
+
+	return btfm_slim_standby_ch(btfmslim, ch, standby);
+}
+
 static int btfm_slim_dai_hw_params(void *dai, uint32_t bps,
 				   uint32_t direction,
 				   uint8_t num_channels) {
@@ -446,6 +483,7 @@ static struct hwep_dai_ops  btfmslim_hw_dai_ops = {
 	.hwep_set_channel_map = btfm_slim_dai_set_channel_map,
 	.hwep_get_channel_map = btfm_slim_dai_get_channel_map,
 	.hwep_get_configs = btfm_slim_dai_get_configs,
+	.hwep_standby = btfm_slim_dai_standby,
 	.hwep_codectype = &usecase_codec,
 };
 
@@ -521,6 +559,7 @@ int btfm_slim_register_hw_ep(struct btfmslim *btfm_slim)
 	hwep_info->num_dai = 2;
 	hwep_info->num_mixer_ctrl = ARRAY_SIZE(status_controls);
 	hwep_info->mixer_ctrl = status_controls;
+	set_bit(BTADV_CAP_MASTER_CONFIG, &hwep_info->flags);
 	/* Register to hardware endpoint */
 	ret = btfmcodec_register_hw_ep(hwep_info);
 	if (ret) {
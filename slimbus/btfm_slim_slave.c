@@ -31,6 +31,19 @@ struct btfmslim_ch slave_txport[] = {
 	.port = BTFM_SLIM_PGD_PORT_LAST},
 };
 
+/* Status and interrupt clear registers, always accessed on the bus */
+const struct btfm_slim_reg_range slave_volatile_regs[] = {
+	{SLAVE_SB_INTF_INT_STATUS, SLAVE_SB_INTF_INT_CLR},
+	{SLAVE_SB_FRM_STATUS, SLAVE_SB_FRM_STATUS},
+	{SLAVE_SB_FRM_INT_STATUS, SLAVE_SB_FRM_VE_STATUS},
+	{SLAVE_SB_PGD_TX_CFG_STATUS, SLAVE_SB_PGD_RX_CFG_STATUS},
+	{SLAVE_SB_PGD_DEV_INT_STATUS, SLAVE_SB_PGD_DEV_INT_CLR},
+	{SLAVE_SB_PGD_PORT_INT_STATUS_RX_0, SLAVE_SB_PGD_PORT_INT_CLR_TX_1},
+	{SLAVE_SB_PGD_PORT_RX_STATUSN(0),
+	 SLAVE_SB_PGD_PORT_TX_STATUSN(SLAVE_SB_PGD_PORT_TX_NUM - 1)},
+	{BTFM_SLIM_REG_LAST, BTFM_SLIM_REG_LAST},
+};
+
 /* Function description */
 int btfm_slim_slave_hw_init(struct btfmslim *btfmslim)
 {
@@ -73,7 +86,7 @@ static inline int is_fm_port(struct btfmslim *btfmslim)
 }
 
 int btfm_slim_slave_enable_port(struct btfmslim *btfmslim, uint8_t port_num,
-	uint8_t rxport, uint8_t enable)
+	uint8_t rxport, uint8_t enable, struct btfm_slim_batch *batch)
 {
 	int ret = 0;
 	uint8_t reg_val = 0, en;
@@ -102,7 +115,8 @@ int btfm_slim_slave_enable_port(struct btfmslim *btfmslim, uint8_t port_num,
 
 			BTFMSLIM_DBG("writing reg_val (%d) to reg(%x)",
 				reg_val, reg);
-			ret = btfm_slim_write(btfmslim, reg, reg_val, IFD);
+			ret = btfm_slim_batch_write(btfmslim, batch, reg, reg_val, IFD,
+					BTFM_SLIM_BATCH_CFG);
 			if (ret < 0) {
 				BTFMSLIM_ERR("failed to write (%d) reg 0x%x",
 					ret, reg);
@@ -128,7 +142,8 @@ int btfm_slim_slave_enable_port(struct btfmslim *btfmslim, uint8_t port_num,
 					(0x1 << SLAVE_SB_PGD_PORT_TX2_FM);
 		reg = SLAVE_SB_PGD_TX_PORTn_MULTI_CHNL_0(port_num);
 		BTFMSLIM_INFO("writing reg_val (%d) to reg(%x)", reg_val, reg);
-		ret = btfm_slim_write(btfmslim, reg, reg_val, IFD);
+		ret = btfm_slim_batch_write(btfmslim, batch, reg, reg_val, IFD,
+				BTFM_SLIM_BATCH_CFG);
 		if (ret < 0) {
 			BTFMSLIM_ERR("failed to write (%d) reg 0x%x", ret, reg);
 			goto error;
@@ -139,7 +154,8 @@ int btfm_slim_slave_enable_port(struct btfmslim *btfmslim, uint8_t port_num,
 		reg = SLAVE_SB_PGD_TX_PORTn_MULTI_CHNL_0(port_num);
 		BTFMSLIM_DBG("writing reg_val (%d) to reg(%x)",
 				reg_val, reg);
-		ret = btfm_slim_write(btfmslim, reg, reg_val, IFD);
+		ret = btfm_slim_batch_write(btfmslim, batch, reg, reg_val, IFD,
+				BTFM_SLIM_BATCH_CFG);
 		if (ret < 0) {
 			BTFMSLIM_ERR("failed to write (%d) reg 0x%x",
 					ret, reg);
@@ -151,7 +167,8 @@ int btfm_slim_slave_enable_port(struct btfmslim *btfmslim, uint8_t port_num,
 		reg = SLAVE_SB_PGD_TX_PORTn_MULTI_CHNL_0(port_num);
 		BTFMSLIM_DBG("writing reg_val (%d) to reg(%x)",
 				reg_val, reg);
-		ret = btfm_slim_write(btfmslim, reg, reg_val, IFD);
+		ret = btfm_slim_batch_write(btfmslim, batch, reg, reg_val, IFD,
+				BTFM_SLIM_BATCH_CFG);
 		if (ret < 0) {
 			BTFMSLIM_ERR("failed to write (%d) reg 0x%x",
 					ret, reg);
@@ -163,7 +180,8 @@ int btfm_slim_slave_enable_port(struct btfmslim *btfmslim, uint8_t port_num,
 	reg_val = (SLAVE_ENABLE_OVERRUN_AUTO_RECOVERY |
 				SLAVE_ENABLE_UNDERRUN_AUTO_RECOVERY);
 	reg = SLAVE_SB_PGD_PORT_TX_OR_UR_CFGN(port_num);
-	ret = btfm_slim_write(btfmslim, reg, reg_val, IFD);
+	ret = btfm_slim_batch_write(btfmslim, batch, reg, reg_val, IFD,
+			BTFM_SLIM_BATCH_CFG);
 	if (ret < 0) {
 		BTFMSLIM_ERR("failed to write (%d) reg 0x%x", ret, reg);
 		goto error;
@@ -193,7 +211,8 @@ enable_disable_rxport:
 		BTFMSLIM_INFO("programming A2DP Tx with reg_val %d to reg 0x%x",
 				reg_val, reg);
 
-	ret = btfm_slim_write(btfmslim, reg, reg_val, IFD);
+	ret = btfm_slim_batch_write(btfmslim, batch, reg, reg_val, IFD,
+			BTFM_SLIM_BATCH_EN);
 	if (ret < 0)
 		BTFMSLIM_ERR("failed to write (%d) reg 0x%x", ret, reg);
 
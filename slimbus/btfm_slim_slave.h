@@ -147,12 +147,13 @@ int btfm_slim_slave_hw_init(struct btfmslim *btfmslim);
  * @portNum: slimbus slave port number to enable
  * @rxport: rxport or txport
  * @enable: enable port or disable port
+ * @batch: batch collecting the register writes, NULL to write right away
  * Returns:
  * 0: Success
  * else: Fail
  */
 int btfm_slim_slave_enable_port(struct btfmslim *btfmslim, uint8_t portNum,
-	uint8_t rxport, uint8_t enable);
+	uint8_t rxport, uint8_t enable, struct btfm_slim_batch *batch);
 
 /* Specific defines for slave slimbus device */
 #define SLAVE_SLIM_REG_OFFSET		0x0800
@@ -165,6 +166,7 @@ int btfm_slim_slave_enable_port(struct btfmslim *btfmslim, uint8_t portNum,
 /* Assign vendor specific function */
 extern struct btfmslim_ch slave_txport[];
 extern struct btfmslim_ch slave_rxport[];
+extern const struct btfm_slim_reg_range slave_volatile_regs[];
 
 #ifdef SLIM_SLAVE_RXPORT
 #undef SLIM_SLAVE_RXPORT
@@ -185,4 +187,9 @@ extern struct btfmslim_ch slave_rxport[];
 #undef SLIM_SLAVE_PORT_EN
 #define SLIM_SLAVE_PORT_EN btfm_slim_slave_enable_port
 #endif
+
+#ifdef SLIM_SLAVE_VOLATILE
+#undef SLIM_SLAVE_VOLATILE
+#define SLIM_SLAVE_VOLATILE (&slave_volatile_regs[0])
+#endif
 #endif
@@ -20,6 +20,7 @@
 #include <sound/soc-dapm.h>
 #include <sound/tlv.h>
 #include "btpower.h"
+#include "btfm_chipset.h"
 #include "btfm_swr.h"
 #include "btfm_swr_hw_interface.h"
 #include "btfm_swr_slave.h"
@@ -33,20 +34,27 @@ static int btfm_num_ports_open;
 
 static int btfm_swr_probe(struct swr_device *pdev);
 
+/* BT SoCs behind soundwire, sorted by soc_id */
+static const struct btfm_chipset btfm_swr_chipsets[] = {
+	{QCA_EVROS_SOC_ID_0100, "EVROS", 0, 0, EVROS},
+	{QCA_EVROS_SOC_ID_0104, "EVROS", 0, 0, EVROS},
+	{QCA_EVROS_SOC_ID_0200, "EVROS", 0, 0, EVROS},
+	{QCA_GANGES_SOC_ID_0100, "GANGES", 0, 0, GANGES},
+	{QCA_GANGES_SOC_ID_0200, "GANGES", 0, 0, GANGES},
+};
+
 int btfm_get_bt_soc_index(int chipset_ver)
 {
-	switch (chipset_ver) {
-	case QCA_GANGES_SOC_ID_0100:
-	case QCA_GANGES_SOC_ID_0200:
-		return GANGES;
-	case QCA_EVROS_SOC_ID_0100:
-	case QCA_EVROS_SOC_ID_0200:
-	case QCA_EVROS_SOC_ID_0104:
-		return EVROS;
-	default:
+	const struct btfm_chipset *chipset;
+
+	chipset = btfm_chipset_lookup(btfm_swr_chipsets,
+				      ARRAY_SIZE(btfm_swr_chipsets),
+				      chipset_ver);
+	if (!chipset) {
 		BTFMSWR_ERR("no BT SOC id defined, returning EVROS");
 		return EVROS;
 	}
+	return chipset->port_map;
 }
 
 int btfm_swr_hw_init(void)
@@ -279,6 +287,8 @@ static struct swr_driver btfm_swr_driver = {
 static int __init btfm_swr_init(void)
 {
 	BTFMSWR_INFO("");
+	WARN_ON(!btfm_chipset_sorted(btfm_swr_chipsets,
+				     ARRAY_SIZE(btfm_swr_chipsets)));
 	return swr_driver_register(&btfm_swr_driver);
 }
 
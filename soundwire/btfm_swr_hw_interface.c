@@ -421,6 +421,7 @@ int btfm_swr_register_hw_ep(struct btfmswr *btfm_swr)
 	hwep_info->num_dai = 4;
 	hwep_info->num_mixer_ctrl = ARRAY_SIZE(status_controls);
 	hwep_info->mixer_ctrl = status_controls;
+	set_bit(BTADV_CAP_CONFIGURE_DMA, &hwep_info->flags);
 	/* Register to hardware endpoint */
 	ret = btfmcodec_register_hw_ep(hwep_info);
 	if (ret) {